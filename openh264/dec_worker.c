@@ -0,0 +1,271 @@
+/**
+ * @file dec_worker.c  Decoder thread fed with complete access units through a single producer, single consumer queue
+ *
+ * Copyright (C) 2015 SeNSE Project
+ */
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "h264_packetize.h"
+#include "openh264_codec.h"
+
+
+struct dec_slot
+{
+	struct mbuf *mb;
+	uint64_t au_start;	/* first packet of the AU in [us] */
+	bool base;		/* temporal layer 0 */
+	bool skip;		/* set by the producer when a base layer AU found no room */
+};
+
+
+/*
+ * Ring of qdepth + 1 slots. The slot at tail belongs to the producer,
+ * which assembles the next access unit in it, the slots from head up to
+ * tail belong to the worker. head is only written by the worker and tail
+ * only by the producer, no lock is taken on the packet path.
+ */
+struct dec_worker
+{
+	pthread_t thread;
+	sem_t items;		/* posted per queued AU */
+	bool run;
+
+	struct dec_slot *slotv;
+	uint32_t size;
+	uint32_t head;
+	uint32_t tail;
+	uint32_t enh_max;	/* queue length up to which enhancement AUs are taken */
+	bool drop_enh;		/* an AU was dropped, enhancement AUs go until the next base AU */
+
+	dec_worker_h *h;
+	void *arg;
+
+	struct dec_worker_stats stats;
+};
+
+
+static inline uint32_t dec_worker_qlen(const struct dec_worker *w)
+{
+	uint32_t head = __atomic_load_n(&w->head, __ATOMIC_ACQUIRE);
+
+	return (w->tail + w->size - head) % w->size;
+}
+
+
+static void *dec_worker_thread(void *arg)
+{
+	struct dec_worker *w = arg;
+
+	for (;;) {
+		struct dec_slot *slot;
+
+		while (sem_wait(&w->items) && errno == EINTR)
+			;
+
+		if (!__atomic_load_n(&w->run, __ATOMIC_ACQUIRE))
+			break;
+
+		slot = &w->slotv[w->head];
+
+		if (__atomic_load_n(&slot->skip, __ATOMIC_RELAXED))
+			__atomic_add_fetch(&w->stats.n_skipped, 1, __ATOMIC_RELAXED);
+		else
+			w->h(slot->mb, slot->au_start, w->arg);
+
+		__atomic_store_n(&w->head, (w->head + 1) % w->size, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+
+static void destructor(void *arg)
+{
+	struct dec_worker *w = arg;
+	uint32_t i;
+
+	if (w->run) {
+		__atomic_store_n(&w->run, false, __ATOMIC_RELEASE);
+		sem_post(&w->items);
+
+		pthread_join(w->thread, NULL);
+	}
+
+	sem_destroy(&w->items);
+
+	for (i = 0; w->slotv && i < w->size; i++)
+		mem_deref(w->slotv[i].mb);
+
+	mem_deref(w->slotv);
+}
+
+
+/*
+ * Allocates a decoder worker
+ *
+ * qdepth:  access units queued at most
+ * reserve: queue slots only base layer AUs may take, at most qdepth - 1
+ * bufsize: initial size of the access unit buffers
+ * h:       decodes one access unit, called on the worker thread
+ */
+int dec_worker_alloc(struct dec_worker **wp, uint32_t qdepth, uint32_t reserve,
+		     size_t bufsize, dec_worker_h *h, void *arg)
+{
+	struct dec_worker *w;
+	uint32_t i;
+	int err = 0;
+
+	if (!wp || !qdepth || !bufsize || !h)
+		return EINVAL;
+
+	w = mem_zalloc(sizeof(*w), destructor);
+	if (!w)
+		return ENOMEM;
+
+	sem_init(&w->items, 0, 0);
+
+	w->size    = qdepth + 1;
+	w->enh_max = qdepth - min(reserve, qdepth - 1);
+	w->h    = h;
+	w->arg  = arg;
+
+	w->slotv = mem_zalloc(w->size * sizeof(*w->slotv), NULL);
+	if (!w->slotv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < w->size; i++) {
+		w->slotv[i].mb = mbuf_alloc(bufsize);
+		if (!w->slotv[i].mb) {
+			err = ENOMEM;
+			goto out;
+		}
+	}
+
+	w->run = true;
+	err = pthread_create(&w->thread, NULL, dec_worker_thread, w);
+	if (err) {
+		w->run = false;
+		goto out;
+	}
+
+ out:
+	if (err)
+		mem_deref(w);
+	else
+		*wp = w;
+
+	return err;
+}
+
+
+/* the buffer the producer assembles the next access unit in */
+struct mbuf *dec_worker_buf(struct dec_worker *w)
+{
+	return w ? w->slotv[w->tail].mb : NULL;
+}
+
+
+/* marks the queued enhancement AUs, the worker passes over them */
+static void dec_worker_skip_enh(struct dec_worker *w)
+{
+	uint32_t i;
+
+	for (i = __atomic_load_n(&w->head, __ATOMIC_ACQUIRE); i != w->tail; i = (i + 1) % w->size) {
+		if (!w->slotv[i].base)
+			__atomic_store_n(&w->slotv[i].skip, true, __ATOMIC_RELAXED);
+	}
+}
+
+
+/*
+ * Queues the access unit assembled in dec_worker_buf(), without waiting
+ * for the worker. Enhancement AUs leave the reserve at the end of the
+ * queue to base layer AUs: past it an enhancement AU is dropped, together
+ * with the enhancement AUs after it up to the next base layer AU, which
+ * may reference it. A base layer AU only finds no room once base layer
+ * AUs have filled the reserve too. It is dropped as well; the queued
+ * enhancement AUs are then skipped, as they belong to a reference chain
+ * that is broken, and the caller has to wait for a keyframe.
+ *
+ * Returns ENOSPC if an enhancement AU was dropped and EOVERFLOW if a base
+ * layer AU was dropped, its buffer is then reused.
+ */
+int dec_worker_push(struct dec_worker *w, bool base, uint64_t au_start)
+{
+	struct dec_slot *slot;
+	uint32_t next, qlen;
+
+	if (!w)
+		return EINVAL;
+
+	slot = &w->slotv[w->tail];
+	next = (w->tail + 1) % w->size;
+
+	if (base)
+		w->drop_enh = false;
+
+	if (!base && (w->drop_enh || dec_worker_qlen(w) >= w->enh_max)) {
+		w->drop_enh = true;
+		__atomic_add_fetch(&w->stats.n_dropped, 1, __ATOMIC_RELAXED);
+		return ENOSPC;
+	}
+
+	if (next == __atomic_load_n(&w->head, __ATOMIC_ACQUIRE)) {
+		__atomic_add_fetch(&w->stats.n_base_dropped, 1, __ATOMIC_RELAXED);
+		dec_worker_skip_enh(w);
+		w->drop_enh = true;
+		return EOVERFLOW;
+	}
+
+	slot->au_start = au_start;
+	slot->base     = base;
+	__atomic_store_n(&slot->skip, false, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&w->tail, next, __ATOMIC_RELEASE);
+	sem_post(&w->items);
+
+	__atomic_add_fetch(&w->stats.n_au, 1, __ATOMIC_RELAXED);
+
+	qlen = dec_worker_qlen(w);
+	if (qlen > w->stats.qlen_max)
+		w->stats.qlen_max = qlen;
+
+	return 0;
+}
+
+
+void dec_worker_stats(const struct dec_worker *w, struct dec_worker_stats *stats)
+{
+	if (!w || !stats)
+		return;
+
+	stats->n_au      = __atomic_load_n(&w->stats.n_au, __ATOMIC_RELAXED);
+	stats->n_dropped = __atomic_load_n(&w->stats.n_dropped, __ATOMIC_RELAXED);
+	stats->n_skipped = __atomic_load_n(&w->stats.n_skipped, __ATOMIC_RELAXED);
+	stats->n_base_dropped = __atomic_load_n(&w->stats.n_base_dropped, __ATOMIC_RELAXED);
+	stats->qlen_max  = w->stats.qlen_max;
+}
+
+
+int dec_worker_debug(struct re_printf *pf, const struct dec_worker *w)
+{
+	struct dec_worker_stats stats;
+
+	if (!w)
+		return 0;
+
+	dec_worker_stats(w, &stats);
+
+	return re_hprintf(pf, "decoder worker: qdepth=%u reserve=%u queued=%llu"
+			  " dropped=%llu skipped=%llu base dropped=%llu qlen max=%u\n",
+			  w->size - 1, w->size - 1 - w->enh_max, stats.n_au, stats.n_dropped,
+			  stats.n_skipped, stats.n_base_dropped, stats.qlen_max);
+}
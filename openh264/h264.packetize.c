@@ -8,6 +8,7 @@
 #include <rem.h>
 #include <baresip.h>
 #include "h264_packetize.h"
+#include "h264_tl0d.h"
 #include "openh264_codec.h"
 
 
@@ -43,7 +44,7 @@ int h264_hdr_decode(struct h264_hdr *hdr, struct mbuf *mb)
 
 int fu_hdr_encode(const struct fu *fu, struct mbuf *mb)
 {
-	uint8_t v = fu->s<<7 | fu->s<<6 | fu->r<<5 | fu->type;
+	uint8_t v = fu->s<<7 | fu->e<<6 | fu->r<<5 | fu->type;
 	return mbuf_write_u8(mb, v);
 }
 
@@ -66,47 +67,6 @@ int fu_hdr_decode(struct fu *fu, struct mbuf *mb)
 }
 
 
-/*
- * Find the NAL start sequence in a H.264 byte stream
- *
- * @note: copied from ffmpeg source
- */
-const uint8_t *h264_find_startcode(const uint8_t *p, const uint8_t *end)
-{
-	const uint8_t *a = p + 4 - ((long)p & 3);
-
-	for (end -= 3; p < a && p < end; p++ ) {
-		if (p[0] == 0 && p[1] == 0 && p[2] == 1)
-			return p;
-	}
-
-	for (end -= 3; p < end; p += 4) {
-		uint32_t x = *(const uint32_t*)(void *)p;
-		if ( (x - 0x01010101) & (~x) & 0x80808080 ) {
-			if (p[1] == 0 ) {
-				if ( p[0] == 0 && p[2] == 1 )
-					return p;
-				if ( p[2] == 0 && p[3] == 1 )
-					return p+1;
-			}
-			if ( p[3] == 0 ) {
-				if ( p[2] == 0 && p[4] == 1 )
-					return p+2;
-				if ( p[4] == 0 && p[5] == 1 )
-					return p+3;
-			}
-		}
-	}
-
-	for (end += 3; p < end; p++) {
-		if (p[0] == 0 && p[1] == 0 && p[2] == 1)
-			return p;
-	}
-
-	return end + 3;
-}
-
-
 static int rtp_send_data(const uint8_t *hdr, size_t hdr_sz,
 			 const uint8_t *buf, size_t sz, bool eof,
 			 videnc_packet_h *pkth, void *arg)
@@ -157,11 +117,52 @@ int h264_nal_send(bool first, bool last,
 }
 
 
-int h264_packetize(struct mbuf *mb, size_t pktsize,
+/*
+ * Sends the pending NAL units as one STAP-A (RFC 6184, 5.7.1), or as a
+ * single NAL unit packet if only one is pending
+ */
+static int h264_stap_a_send(const uint8_t **nalv, const size_t *szv, size_t n,
+			    bool marker, size_t pktsize,
+			    videnc_packet_h *pkth, void *arg)
+{
+	uint8_t stap[STAP_A_SIZE];
+	uint8_t hdr = 0;
+	size_t i, len = 0;
+
+	if (n == 1)
+		return h264_nal_send(true, true, marker, nalv[0][0],
+				     nalv[0]+1, szv[0]-1, pktsize, pkth, arg);
+
+	for (i = 0; i < n; i++) {
+
+		if ((nalv[i][0] & 0x60) > (hdr & 0x60))
+			hdr = nalv[i][0] & 0x60;
+
+		stap[len++] = (uint8_t)(szv[i] >> 8);
+		stap[len++] = (uint8_t)(szv[i]);
+		memcpy(stap + len, nalv[i], szv[i]);
+		len += szv[i];
+	}
+
+	hdr |= H264_NAL_STAP_A;
+
+	return rtp_send_data(&hdr, 1, stap, len, marker, pkth, arg);
+}
+
+
+/*
+ * Packetizes an Annex-B access unit. In packetization-mode 1 consecutive
+ * NAL units that fit into pktsize are aggregated into STAP-A packets.
+ */
+int h264_packetize(struct mbuf *mb, size_t pktsize, uint32_t pmode,
 		   videnc_packet_h *pkth, void *arg)
 {
 	const uint8_t *start = mb->buf;
 	const uint8_t *end   = start + mb->end;
+	const uint8_t *nalv[KMaxNumberOfNALUs];
+	size_t szv[KMaxNumberOfNALUs];
+	size_t maxsz = pktsize < STAP_A_SIZE ? pktsize : STAP_A_SIZE;
+	size_t n = 0, len = 1;
 	const uint8_t *r;
 	int err = 0;
 		
@@ -169,18 +170,49 @@ int h264_packetize(struct mbuf *mb, size_t pktsize,
 	
 	while (r < end) {
 		const uint8_t *r1;
+		size_t sz;
 
 		/* skip zeros */
 		while (!*(r++))
 			;
 
 		r1 = h264_find_startcode(r, end);
+		sz = r1 - r;
+
+		if (!pmode) {
+			err |= h264_nal_send(true, true, (r1 >= end), r[0],
+					     r+1, sz-1, pktsize,
+					     pkth, arg);
+			r = r1;
+			continue;
+		}
+
+		/* flush the pending aggregate if this NAL unit does not fit */
+		if (n && (len + 2 + sz > maxsz || n == KMaxNumberOfNALUs)) {
+			err |= h264_stap_a_send(nalv, szv, n, false,
+						pktsize, pkth, arg);
+			n = 0;
+			len = 1;
+		}
+
+		if (1 + 2 + sz > maxsz) {
+			err |= h264_nal_send(true, true, (r1 >= end), r[0],
+					     r+1, sz-1, pktsize,
+					     pkth, arg);
+		}
+		else {
+			nalv[n] = r;
+			szv[n]  = sz;
+			n++;
+			len += 2 + sz;
+		}
 
-		err |= h264_nal_send(true, true, (r1 >= end), r[0],
-				     r+1, r1-r-1, pktsize,
-				     pkth, arg);
 		r = r1;
 	}
 
+	if (n)
+		err |= h264_stap_a_send(nalv, szv, n, true, pktsize,
+					pkth, arg);
+
 	return err;
 }
@@ -10,98 +10,84 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <string.h>
+#include <time.h>
 
-#include "h264_tl0d.h"
 #include "h264_packetize.h"
+#include "h264_tl0d.h"
 #include "openh264_codec.h"
 
 
 
-static uint16_t AU_start_seq;
-static uint16_t AU_last_seq;
-static int sequence_indicator = -2;
-
-
-
-static int init_svc_naluheader(SVC_NALUHeader *svc_header, int size)
+int tl0d_packetizer_alloc(struct tl0d_packetizer **tpp)
 {
-	int err = 0;
-	int i;
-		
-	for(i = 0; i < size; i++)
-	{
-		svc_header[i].r = 1;
-		svc_header[i].idr = 0;
-		svc_header[i].priorityID = 0;
-		svc_header[i].interLayerPred =0;
-		svc_header[i].dependencyID = 0;
-		svc_header[i].qualityID = 0;
-		svc_header[i].temporalID = 0;
-		svc_header[i].useRefBasePic = 0;
-		svc_header[i].discardable = 0;
-		svc_header[i].output = 0;
-		svc_header[i].rr = 3;
-		svc_header[i].length = 3;
-	}
-
-	return err;
+	struct tl0d_packetizer *tp;
+	
+	if(!tpp)
+		return EINVAL;
+	
+	tp = mem_zalloc(sizeof(*tp), NULL);
+	if(!tp)
+		return ENOMEM;
+	
+	tp->sequence_indicator = -2;
+	
+	*tpp = tp;
+	
+	return 0;
 }
 
 
-static int init_tl0d(TL0D *tl0d, int size)
-{
-	int err = 0;
-	int i;
 
-	for(i = 0; i < size; i++)
-	{
-		tl0d[i].NALlength = 6;
-		tl0d[i].type = 31;
-		tl0d[i].nalu_size = 0;
-		tl0d[i].TL0picIDx = 0;
-		tl0d[i].fsn  = 0;
-		tl0d[i].lsn  = 0;
-	}
-	
-	return err;
-}
-
-static int h264_Info(H264Info **h264_info)
+/* prints the packetizer counters */
+int h264_tl0d_debug(struct re_printf *pf, const struct tl0d_packetizer *tp)
 {
-	H264Info *h264Inf;
-	int err = 0;
+	const struct tl0d_stats *st;
 	
-	h264Inf = mem_zalloc(sizeof(*h264Inf), NULL);
-	if(!h264Inf)
-	{
-		warning("faild to allocate memeory");
-		err = ENOMEM;
-		return err;
-	}
+	if(!tp)
+		return 0;
 	
-	h264Inf->numNALUs = 0;
-	h264Inf->numLayers = 0;
+	st = &tp->stats;
 	
-	memset(h264Inf->startCodeLength, 0, sizeof(KMaxNumberOfNALUs*sizeof(uint8_t)));
-	memset(h264Inf->payloadSize, 0, sizeof(KMaxNumberOfNALUs*sizeof(uint32_t)));
-	memset(h264Inf->NRI, 0, sizeof(KMaxNumberOfNALUs*sizeof(uint8_t)));
-	memset(h264Inf->type, 0, sizeof(KMaxNumberOfNALUs*sizeof(uint8_t)));
-	memset(h264Inf->accLayerSize, 0, sizeof(KMaxNumberOfLayers*sizeof(int32_t)));
+	return re_hprintf(pf, "tl0d packetizer: AUs=%llu packets=%llu bytes=%llu"
+					  " packets/AU=%llu.%02llu copied=%llu oversize=%llu skipped=%llu"
+					  " toolong=%llu capped=%llu"
+					  " ns/AU=%llu ns/packet=%llu max ns/AU=%llu\n",
+					  st->n_au, st->n_pkt, st->n_bytes,
+					  st->n_au ? st->n_pkt / st->n_au : 0ULL,
+					  st->n_au ? (st->n_pkt * 100 / st->n_au) % 100 : 0ULL,
+					  st->n_copied, st->n_oversize, st->n_skipped,
+					  st->n_toolong, st->n_capped,
+					  st->n_au ? st->ns_sum / st->n_au : 0ULL,
+					  st->n_pkt ? st->ns_sum / st->n_pkt : 0ULL,
+					  st->ns_max);
+}
+
+
+static inline unsigned long long tl0d_now_ns(void)
+{
+	struct timespec ts;
 	
-	err = init_svc_naluheader(h264Inf->SVCheader, KMaxNumberOfNALUs);
-	if(err)
-	{
-		//to do
-	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 	
-	err = init_tl0d(h264Inf->tl0d, KMaxNumberOfNALUs);
-	if(err)
-	{
-		//to do
-	}
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-	*h264_info = h264Inf;
-	return err;
+
+
+static void init_svc_naluheader(SVC_NALUHeader *svc_header)
+{
+	svc_header->r = 1;
+	svc_header->idr = 0;
+	svc_header->priorityID = 0;
+	svc_header->interLayerPred =0;
+	svc_header->dependencyID = 0;
+	svc_header->qualityID = 0;
+	svc_header->temporalID = 0;
+	svc_header->useRefBasePic = 0;
+	svc_header->discardable = 0;
+	svc_header->output = 0;
+	svc_header->rr = 3;
+	svc_header->length = 3;
 }
 
 static inline int32_t FindNALUStartCodeLength(const uint8_t *p, int remLength)
@@ -120,11 +106,12 @@ static inline int32_t FindNALUStartCodeLength(const uint8_t *p, int remLength)
     return -1;
 }
 
-static int32_t ParseSVCNALUHeader(H264Info *h264_info, const uint8_t *p)
+static void ParseSVCNALUHeader(H264NALU *nalu)
 {
-	int err = 0;
-	if(h264_info->type[h264_info->numNALUs]  == 5)
-		h264_info->SVCheader[h264_info->numNALUs].idr = 1;
+	const uint8_t *p = nalu->buf;
+
+	if(nalu->type  == 5)
+		nalu->SVCheader.idr = 1;
 		
 	
 //	CONSTRUCT SVC HEADER - types 14, 20
@@ -147,287 +134,631 @@ static int32_t ParseSVCNALUHeader(H264Info *h264_info, const uint8_t *p)
 // O    - Output_flag. Affects the decoded picture output process as defined in Annex C of [H.264].
 // RR   - Reserved_three_2bits (MUST be '11'). Receivers SHOULD ignore the value of RR.
 
-	if(h264_info->type[h264_info->numNALUs] == 14 || h264_info->type[h264_info->numNALUs] ==20)
+	if((nalu->type == 14 || nalu->type == 20) && nalu->size >= 4)
 	{
-		uint32_t curByte = h264_info->startCodeLength[h264_info->numNALUs] + 1;
-		
-	    h264_info->SVCheader[h264_info->numNALUs].idr        	 = (p[curByte] >> 6) & 0x01;
-        h264_info->SVCheader[h264_info->numNALUs].priorityID 	 = (p[curByte++] & 0x3F);
-
-        h264_info->SVCheader[h264_info->numNALUs].interLayerPred = (p[curByte] >> 7) & 0x01;
-        h264_info->SVCheader[h264_info->numNALUs].dependencyID   = (p[curByte] >> 4) & 0x07;
-        h264_info->SVCheader[h264_info->numNALUs].qualityID      = (p[curByte++] & 0x0F);
+	    nalu->SVCheader.idr        	 = (p[1] >> 6) & 0x01;
+        nalu->SVCheader.priorityID 	 = (p[1] & 0x3F);
 
-        h264_info->SVCheader[h264_info->numNALUs].temporalID     = (p[curByte] >> 5) & 0x07;
-        h264_info->SVCheader[h264_info->numNALUs].useRefBasePic  = (p[curByte] >> 4) & 0x01;
-        h264_info->SVCheader[h264_info->numNALUs].discardable    = (p[curByte] >> 3) & 0x01;
-        h264_info->SVCheader[h264_info->numNALUs].output         = (p[curByte] >> 2) & 0x01;
+        nalu->SVCheader.interLayerPred = (p[2] >> 7) & 0x01;
+        nalu->SVCheader.dependencyID   = (p[2] >> 4) & 0x07;
+        nalu->SVCheader.qualityID      = (p[2] & 0x0F);
 
-        if (h264_info->type[h264_info->numNALUs] == 14)
-        {
-            // inform the next NALU
-            memcpy(&(h264_info->SVCheader[h264_info->numNALUs+1]), &(h264_info->SVCheader[h264_info->numNALUs]), sizeof(SVC_NALUHeader));
-        }
+        nalu->SVCheader.temporalID     = (p[3] >> 5) & 0x07;
+        nalu->SVCheader.useRefBasePic  = (p[3] >> 4) & 0x01;
+        nalu->SVCheader.discardable    = (p[3] >> 3) & 0x01;
+        nalu->SVCheader.output         = (p[3] >> 2) & 0x01;
     }
+}
 
-	return err;
+static void GetNRI(H264NALU *nalu)
+{
+    //  NAL unit header (1 byte)
+    //  ---------------------------------
+    // |   start code    |F|NRI|  Type   |
+    //  ---------------------------------
+
+    // NRI (2 bits) - nal_ref_idc. '00' - the NAL unit is not used to reconstruct reference pictures.
+    //                             >00  - the NAL unit is required to reconstruct reference pictures
+    //                                    in the same layer, or contains a parameter set.
+
+    // NALU type of 5, 7 and 8 should have NRI to b011
+    if( nalu->type == 5 || nalu->type == 7 || nalu->type == 8)
+        nalu->NRI = 0x60;
+    else
+        nalu->NRI = nalu->buf[0] & 0x60;
+}
+
+/*
+ * Sets a handler that receives all packets of an access unit in one call,
+ * e.g. for a transport that sends them with sendmmsg()
+ */
+void h264_tl0d_set_batch(struct tl0d_packetizer *tp, videnc_batch_h *batchh, void *arg)
+{
+	if(!tp)
+		return;
 	
+	tp->batchh = batchh;
+	tp->batch_arg = arg;
 }
 
-static int32_t FindNALUType(H264Info *h264_info, const uint8_t *p)
+/*
+ * Fills the NAL unit table of one access unit. The table only points into
+ * the bitstream, nothing is copied.
+ */
+int h264_tl0d_nalu_add(H264Info *h264Info, const uint8_t *buf, uint32_t size)
 {
-	int err = 0;
+	H264NALU *nalu;
 	
-	//gets the nal unit's type 
-    h264_info->type[h264_info->numNALUs] = p[h264_info->startCodeLength[h264_info->numNALUs]] & 0x1f;
+	if(h264Info->numNALUs >= KMaxNumberOfNALUs)
+	{
+		warning("h264_tl0d_packetize: more than %u NAL units in access unit\n", KMaxNumberOfNALUs);
+		return EOVERFLOW;
+	}
 	
-	if(h264_info->type[h264_info->numNALUs] == 0)
+	nalu = &h264Info->nalu[h264Info->numNALUs];
+	
+	nalu->buf  = buf;
+	nalu->size = size;
+	
+	//gets the nal unit's type 
+	nalu->type = buf[0] & 0x1f;
+	if(nalu->type == 0)
 	{
 		re_printf("Type is 0\n");
-		return 1;
+		return EBADMSG;
 	}
 	
-	err = ParseSVCNALUHeader(h264_info, p);
+	// a prefix NAL unit (type 14) informs the next NALU
+	if(h264Info->numNALUs > 0 && nalu[-1].type == 14)
+		nalu->SVCheader = nalu[-1].SVCheader;
+	else
+		init_svc_naluheader(&nalu->SVCheader);
 	
-	return err;
+	GetNRI(nalu);
+	ParseSVCNALUHeader(nalu);
+	
+	h264Info->numNALUs++;
+	
+	return 0;
 }
 
-static void GetNRI(H264Info *h264_info, const uint8_t *p)
+static int h264_annexb_parse(H264Info *h264Info, const uint8_t *start, const uint8_t *end)
 {
-    //  NAL unit header (1 byte)
-    //  ---------------------------------
-    // |   start code    |F|NRI|  Type   |
-    //  ---------------------------------
-
-    // NRI (2 bits) - nal_ref_idc. '00' - the NAL unit is not used to reconstruct reference pictures.
-    //                             >00  - the NAL unit is required to reconstruct reference pictures
-    //                                    in the same layer, or contains a parameter set.
-
-	//gets the headers nri of the nal unit pointed by p 
-    const uint8_t type = p[h264_info->startCodeLength[h264_info->numNALUs]] & 0x1f;
-
-    // NALU type of 5, 7 and 8 should have NRI to b011
-    if( type == 5 || type == 7 || type == 8)
-        h264_info->NRI[h264_info->numNALUs] = 0x60;
-    else
-        h264_info->NRI[h264_info->numNALUs] = p[h264_info->startCodeLength[h264_info->numNALUs]] & 0x60;
+	const uint8_t *pCurrentStartCode;
+	int err = 0;
+	
+	pCurrentStartCode = h264_find_startcode(start, end);
+	
+	while (pCurrentStartCode < end) 
+	{
+		const uint8_t *pNextStartCode;
+		int32_t StartCodeLength;
+					
+		StartCodeLength = FindNALUStartCodeLength(pCurrentStartCode, end - pCurrentStartCode);
+		if(StartCodeLength < 0 || pCurrentStartCode + StartCodeLength >= end)
+			break;
+		
+		pNextStartCode = h264_find_startcode(pCurrentStartCode + StartCodeLength, end);
+		
+		err = h264_tl0d_nalu_add(h264Info, pCurrentStartCode + StartCodeLength, pNextStartCode - pCurrentStartCode - StartCodeLength);
+		if(err)
+		{
+			re_printf("Error: h264_tl0d_nalu_add()\n");
+			return err;
+		}
+		
+		pCurrentStartCode = pNextStartCode;
+	}
+	
+	return err;
 }
 	
-static void h264_tl0d_encode(H264Info *h264_info, uint8_t *TL0D_NalUnit, int i, uint16_t fseq, uint16_t lseq, uint8_t nalu_size, uint8_t sequence_id)
+static void h264_tl0d_encode(uint8_t *TL0D_NalUnit, const H264NALU *nalu, uint8_t tl0, uint16_t fseq, uint16_t lseq, uint8_t nalu_size, uint8_t sequence_id)
 {
-			memset(TL0D_NalUnit, 0, TL0D_SIZE);
-			
 			/*NAL Unit Header */
-			//F = 0, from memset
-			//NRI
-			TL0D_NalUnit[0] |= h264_info->NRI[i] << 5;
-			//Type
-			TL0D_NalUnit[0] |= h264_info->tl0d[i].type;
+			//F = 0, NRI (already in place), Type
+			TL0D_NalUnit[0] = nalu->NRI | 31;
 			
 			/*SVC Header */
 			//R - I - PRID 
-			TL0D_NalUnit[1] |= h264_info->SVCheader[i].r << 7;
-			TL0D_NalUnit[1] |= h264_info->SVCheader[i].idr << 6;
-			TL0D_NalUnit[1] |= h264_info->SVCheader[i].priorityID;			
+			TL0D_NalUnit[1] = nalu->SVCheader.r << 7 | nalu->SVCheader.idr << 6 | nalu->SVCheader.priorityID;
 			
 			//N - DID - QID
-			TL0D_NalUnit[2] |= h264_info->SVCheader[i].interLayerPred << 7;
-			TL0D_NalUnit[2] |= h264_info->SVCheader[i].dependencyID << 4;
-			TL0D_NalUnit[2] |= h264_info->SVCheader[i].qualityID;
+			TL0D_NalUnit[2] = nalu->SVCheader.interLayerPred << 7 | nalu->SVCheader.dependencyID << 4 | nalu->SVCheader.qualityID;
 			
 			//TID - U - D - O - RR
-			TL0D_NalUnit[3] |= h264_info->SVCheader[i].temporalID << 5;
-			TL0D_NalUnit[3] |= h264_info->SVCheader[i].useRefBasePic << 4;
-			TL0D_NalUnit[3] |= h264_info->SVCheader[i].discardable << 3;
-			TL0D_NalUnit[3] |= h264_info->SVCheader[i].output << 2;
-			TL0D_NalUnit[3] |= h264_info->SVCheader[i].rr << 0;
+			TL0D_NalUnit[3] = nalu->SVCheader.temporalID << 5 | nalu->SVCheader.useRefBasePic << 4 |
+							  nalu->SVCheader.discardable << 3 | nalu->SVCheader.output << 2 | nalu->SVCheader.rr << 0;
 			
 			/*NUM_ENH_NALUS*/
-			TL0D_NalUnit[4] = nalu_size;
-			TL0D_NalUnit[4] |= sequence_id << 7;
+			TL0D_NalUnit[4] = nalu_size | sequence_id << 7;
 			
 			/*TL0PICIDX */
-			TL0D_NalUnit[5] |= h264_info->tl0d[i].TL0picIDx;
+			TL0D_NalUnit[5] = tl0;
 			/*fsn*/
-			TL0D_NalUnit[6] |= (uint8_t)(fseq >> 8);
-			TL0D_NalUnit[7] |= (uint8_t)(fseq);
+			TL0D_NalUnit[6] = (uint8_t)(fseq >> 8);
+			TL0D_NalUnit[7] = (uint8_t)(fseq);
 			/*lsn*/
-			TL0D_NalUnit[8] |= (uint8_t)(lseq >> 8);
-			TL0D_NalUnit[9] |= (uint8_t)(lseq);
+			TL0D_NalUnit[8] = (uint8_t)(lseq >> 8);
+			TL0D_NalUnit[9] = (uint8_t)(lseq);
 }
 
+static inline bool h264_tl0d_batching(const struct tl0d_packetizer *tp)
+{
+	return tp->batchh || tp->pacer;
+}
 
-int h264_tl0d_packetize(struct mbuf *mb, size_t pktsize,
-		   videnc_packet_h *pkth, void *arg)
+/*
+ * Hands the collected packets of the access unit over, to the batch
+ * handler if there is one, else to the pacer. With both the pacer splits
+ * the batch into the runs it sends between pauses.
+ */
+static int h264_tl0d_flush(struct tl0d_packetizer *tp, videnc_packet_h *pkth, void *arg)
 {
-	const uint8_t *start = mb->buf;
-	const uint8_t *end   = start + mb->end;
-	const uint8_t *pCurrentStartCode;
-	H264Info *h264Info = NULL;
+	int err = 0;
+	
+	if(!tp->pktc)
+		return 0;
+	
+	if(tp->batchh)
+		err = pacer_send_chunks(tp->pacer, tp->pktv, tp->pktc, tp->batchh, tp->batch_arg);
+	else
+		err = pacer_send_batch(tp->pacer, tp->pktv, tp->pktc, pkth, arg);
+	
+	tp->pktc = 0;
+	tp->stap_pos = 0;
+	
+	return err;
+}
 
-	bool foundLast = false;
-	int i;
+/*
+ * Passes one packet on. Without batching it goes straight to the transport,
+ * else the header is copied into the batch and the payload is referenced
+ * until the batch is flushed.
+ */
+static inline int h264_tl0d_output(struct tl0d_packetizer *tp, bool marker,
+								   const uint8_t *hdr, size_t hdr_len,
+								   const uint8_t *pld, size_t pld_len,
+								   videnc_packet_h *pkth, void *arg)
+{
+	struct videnc_pkt *pkt;
 	int err = 0;
-	int StartCodeLength = -1;
 	
-	uint8_t tl0 = 0;
-	bool dup = false;
-	bool idr = false;	
+	tp->stats.n_pkt++;
+	tp->stats.n_bytes += hdr_len + pld_len;
 	
-	get_tl0_pic_idx(&dup, &idr, &tl0, arg);
+	//TID of the SVC header in TL0D, only the base layer is kept for retransmission
+	if(tp->hist && !(hdr[3] >> 5))
+		tl0_hist_put(tp->hist, tp->pkt_seq, marker, hdr, hdr_len, pld, pld_len);
+	tp->pkt_seq++;
 	
-	if(end - start < 4)
-	{
-		re_printf("Error: not enough space ing buffer: end - star < 4\n");
+	if(!h264_tl0d_batching(tp))
+		return pkth(marker, hdr, hdr_len, pld, pld_len, arg);
+	
+	if(tp->pktc == TL0D_BATCH_SIZE)
+		err = h264_tl0d_flush(tp, pkth, arg);
+	
+	memcpy(tp->hdrv[tp->pktc], hdr, hdr_len);
+	
+	pkt = &tp->pktv[tp->pktc++];
+	pkt->marker  = marker;
+	pkt->hdr     = tp->hdrv[tp->pktc - 1];
+	pkt->hdr_len = hdr_len;
+	pkt->pld     = pld;
+	pkt->pld_len = pld_len;
+	
+	return err;
+}
+
+/* payload bytes of a NAL unit that fit into one FU-A fragment */
+static inline size_t h264_tl0d_fu_size(size_t pktsize)
+{
+	return pktsize > TL0D_SIZE + 2 ? pktsize - TL0D_SIZE - 2 : 1;
+}
+
+/*
+ * Number of RTP packets needed for one NAL unit sent on its own, 0 if it
+ * does not fit into pktsize and fragmentation is not allowed
+ */
+static uint16_t h264_tl0d_nalu_packets(const H264NALU *nalu, size_t pktsize, uint32_t pmode)
+{
+	size_t sz;
+	
+	if(TL0D_SIZE + nalu->size <= pktsize)
 		return 1;
-	}
+	
+	//FU-A is not allowed in packetization-mode 0 (RFC 6184, 6.2)
+	if(pmode == 0)
+		return 0;
+	
+	sz = h264_tl0d_fu_size(pktsize);
+	
+	return (uint16_t)((nalu->size - 1 + sz - 1) / sz);
+}
 
-	if(!h264Info)
+/*
+ * Sends one NAL unit behind a TL0D header. The TL0D header and the NAL unit
+ * are passed as two separate segments, the NAL unit is never copied.
+ *
+ * NAL units larger than pktsize are fragmented into FU-A (RFC 6190, 4.8)
+ * and every fragment carries the TL0D header, so that the receiver can
+ * place each base layer packet in its access unit. The caller makes sure
+ * that this only happens in packetization-mode 1:
+ *
+ *  +----------+--------------+-----------+----------------------
+ *  | TL0D (10)| FU indicator | FU header | NAL unit fragment ...
+ *  +----------+--------------+-----------+----------------------
+ */
+static int h264_tl0d_send(struct tl0d_packetizer *tp, const uint8_t *TL0D_NalUnit, const H264NALU *nalu,
+						  bool marker, size_t pktsize, videnc_packet_h *pkth, void *arg)
+{
+	uint8_t FU_hdr[TL0D_SIZE + 2];
+	const uint8_t *buf;
+	size_t size, sz;
+	int err = 0;
+	
+	if(TL0D_SIZE + nalu->size <= pktsize)
+		return h264_tl0d_output(tp, marker, TL0D_NalUnit, TL0D_SIZE, nalu->buf, nalu->size, pkth, arg);
+	
+	sz   = h264_tl0d_fu_size(pktsize);
+	buf  = nalu->buf + 1;
+	size = nalu->size - 1;
+	
+	memcpy(FU_hdr, TL0D_NalUnit, TL0D_SIZE);
+	FU_hdr[TL0D_SIZE]     = (nalu->buf[0] & 0x60) | H264_NAL_FU_A;
+	FU_hdr[TL0D_SIZE + 1] = 1<<7 | (nalu->buf[0] & 0x1f);   /* start bit */
+	
+	while(size > sz)
 	{
-		err = h264_Info(&h264Info);
-		if(err)
-		{
-			re_printf("Error: h264_Info()\n");
-			return err;
-		}
+		err |= h264_tl0d_output(tp, false, FU_hdr, sizeof(FU_hdr), buf, sz, pkth, arg);
+		buf  += sz;
+		size -= sz;
+		FU_hdr[TL0D_SIZE + 1] &= ~(1 << 7);
 	}
+	
+	FU_hdr[TL0D_SIZE + 1] |= 1<<6;  /* end bit */
+	
+	err |= h264_tl0d_output(tp, marker, FU_hdr, sizeof(FU_hdr), buf, size, pkth, arg);
+	
+	return err;
+}
 
-	pCurrentStartCode = h264_find_startcode(mb->buf, end);
 
-	while (pCurrentStartCode < end) 
+/*
+ * Returns how many NAL units, starting at nalu[i], go into the next packet.
+ * Consecutive NAL units of the same temporal layer are aggregated into one
+ * STAP-A as long as they fit together with the TL0D header into maxsz.
+ * Aggregation packets are not allowed in packetization-mode 0 (RFC 6184,
+ * 6.2), every NAL unit is then sent on its own.
+ */
+static int h264_tl0d_stap_count(const H264Info *h264Info, int i, size_t maxsz, uint32_t pmode)
+{
+	const H264NALU *first = &h264Info->nalu[i];
+	size_t len = TL0D_SIZE + 1 + 2 + first->size;
+	int n = 1;
+	
+	if(pmode == 0)
+		return 1;
+	
+	if(maxsz > STAP_A_SIZE)
+		maxsz = STAP_A_SIZE;
+	
+	while(i + n < h264Info->numNALUs)
 	{
-		const uint8_t *pNextStartCode;
-					
-		StartCodeLength = FindNALUStartCodeLength(pCurrentStartCode, end - pCurrentStartCode + 1);
+		const H264NALU *nalu = &h264Info->nalu[i + n];
 		
-		h264Info->startCodeLength[h264Info->numNALUs] = StartCodeLength;
+		if(nalu->SVCheader.temporalID != first->SVCheader.temporalID)
+			break;
 		
-		pNextStartCode = h264_find_startcode(pCurrentStartCode + h264Info->startCodeLength[h264Info->numNALUs], end);
+		if(len + 2 + nalu->size > maxsz)
+			break;
 		
-		h264Info->payloadSize[h264Info->numNALUs] = pNextStartCode - pCurrentStartCode - StartCodeLength;
+		len += 2 + nalu->size;
+		n++;
+	}
+	
+	return n;
+}
+
+/* temporal ID of an access unit, parameter sets count as TL0 */
+static uint8_t h264_tl0d_au_tid(const H264Info *h264Info)
+{
+	uint8_t tid = 0;
+	int i;
+	
+	for(i = 0; i < h264Info->numNALUs; i++)
+	{
+		if(h264Info->nalu[i].SVCheader.temporalID > tid)
+			tid = h264Info->nalu[i].SVCheader.temporalID;
+	}
+	
+	return tid;
+}
+
+
+/*
+ * Decides whether an access unit is sent. TL0 AUs always are. An
+ * enhancement AU is skipped when it does not fit the TL0D header or the
+ * pacer is behind, and so is every AU above its layer until a layer at
+ * or below it is sent again, as those AUs may reference the skipped one.
+ */
+static bool h264_tl0d_admit(struct tl0d_packetizer *tp, uint8_t tid, bool fits)
+{
+	if(tid == 0)
+	{
+		tp->skip_tid = 0;
+		return true;
+	}
+	
+	if(!fits || (tp->skip_tid && tid > tp->skip_tid) || !pacer_admit(tp->pacer, false))
+	{
+		if(!tp->skip_tid || tid < tp->skip_tid)
+			tp->skip_tid = tid;
 		
-		if(pNextStartCode == end) 
-			foundLast = true;
+		return false;
+	}
+	
+	if(tid <= tp->skip_tid)
+		tp->skip_tid = 0;
+	
+	return true;
+}
+
+
+/*
+ * Sends n NAL units as one STAP-A behind a single TL0D header, the TL0D
+ * header carries the highest NRI of the aggregated NAL units
+ *
+ *  +----------+-----------+-----------+-------+-----------+-------+-----
+ *  | TL0D (10)| STAP-A hdr| NALU 1 sz | NALU 1| NALU 2 sz | NALU 2| ...
+ *  +----------+-----------+-----------+-------+-----------+-------+-----
+ */
+static int h264_tl0d_send_stap(struct tl0d_packetizer *tp, const H264NALU *nalu, int n, uint8_t tl0, uint16_t fseq, uint16_t lseq,
+							   uint8_t nalu_size, uint8_t sequence_id, bool marker,
+							   videnc_packet_h *pkth, void *arg)
+{
+	uint8_t *STAP;
+	uint8_t TL0D_NalUnit[TL0D_SIZE];
+	H264NALU agg = nalu[0];
+	size_t len = 1;
+	int i, err = 0;
+	
+	//aggregates are built in the packetizer so that they outlive a batch,
+	//flush first if the arena or the batch is full
+	if(tp->stap_pos + STAP_A_SIZE > sizeof(tp->stap_buf) || tp->pktc == TL0D_BATCH_SIZE)
+		err = h264_tl0d_flush(tp, pkth, arg);
+	
+	STAP = tp->stap_buf + tp->stap_pos;
+	
+	for(i = 0; i < n; i++)
+	{
+		if(nalu[i].NRI > agg.NRI)
+			agg.NRI = nalu[i].NRI;
+		agg.SVCheader.idr |= nalu[i].SVCheader.idr;
 		
-		GetNRI(h264Info, pCurrentStartCode);
+		STAP[len++] = (uint8_t)(nalu[i].size >> 8);
+		STAP[len++] = (uint8_t)(nalu[i].size);
+		memcpy(STAP + len, nalu[i].buf, nalu[i].size);
+		len += nalu[i].size;
+	}
+	
+	STAP[0] = agg.NRI | H264_NAL_STAP_A;
+	
+	h264_tl0d_encode(TL0D_NalUnit, &agg, tl0, fseq, lseq, nalu_size, sequence_id);
+	
+	if(h264_tl0d_batching(tp))
+		tp->stap_pos += len;
+	
+	tp->stats.n_copied += len - 1 - 2 * n;
+	
+	err |= h264_tl0d_output(tp, marker, TL0D_NalUnit, TL0D_SIZE, STAP, len, pkth, arg);
+	
+	return err;
+}
+
+
+/*
+ * Sends all NAL units of one access unit, tp->h264Info must have been
+ * filled with h264_tl0d_nalu_add(). STAP-A aggregation and FU-A
+ * fragmentation are only used in packetization-mode 1. In mode 0 an AU
+ * with a NAL unit larger than a packet is refused with EMSGSIZE, the
+ * encoder limits its slice size so that this does not happen, and so is
+ * an enhancement AU of more packets than NUM_ENH_NALUS counts. With a
+ * pacer that is behind, or when its reference was not sent, an
+ * enhancement AU is not sent and EAGAIN is returned; the encoder carries
+ * on with its next frame.
+ */
+int h264_tl0d_send_au(struct tl0d_packetizer *tp, size_t pktsize, uint32_t pmode,
+		   videnc_packet_h *pkth, void *arg)
+{
+	const H264Info *h264Info = &tp->h264Info;
+	uint8_t sequence_id;
+	uint16_t numPackets = 0;
+	uint8_t nalu_size;
+	uint8_t tid;
+	bool fits;
+
+	int i, n;
+	int err = 0;
+	
+	uint8_t tl0 = 0;
+	bool dup = false;
+	bool idr = false;	
+	unsigned long long t;
+	
+	if(!h264Info->numNALUs)
+		return 0;
+	
+	t = tl0d_now_ns();
+	
+	//fsn/lsn and NUM_ENH_NALUS count packets, so plan aggregation and fragmentation first
+	for(i = 0; i < h264Info->numNALUs; i += n)
+	{
+		uint16_t np = 1;
 		
-		err = FindNALUType(h264Info, pCurrentStartCode);
-		if(err)
-		{
-			re_printf("Error: FindNALUType()\n");
-		}
+		n = h264_tl0d_stap_count(h264Info, i, pktsize, pmode);
+		if(n == 1)
+			np = h264_tl0d_nalu_packets(&h264Info->nalu[i], pktsize, pmode);
 		
-		if(foundLast)
+		//an oversized NAL unit in mode 0 fails the AU before it takes sequence numbers
+		if(!np)
 		{
-			h264Info->tl0d[h264Info->numNALUs].TL0picIDx = tl0;
-			h264Info->numNALUs++;
-			
-			break;
+			warning("h264_tl0d_packetize: %u byte NAL unit does not fit into %zu byte packets"
+					" in packetization-mode 0\n", h264Info->nalu[i].size, pktsize);
+			tp->stats.n_oversize++;
+			return EMSGSIZE;
 		}
 		
-		h264Info->tl0d[h264Info->numNALUs].TL0picIDx = tl0;
+		numPackets += np;
+	}
+	
+	tid = h264_tl0d_au_tid(h264Info);
+	
+	//NUM_ENH_NALUS is 7 bits, a wrapped count would let the receiver release the AU incomplete
+	fits = !tid || numPackets <= TL0D_MAX_ENH_NALUS;
+	if(!fits)
+	{
+		warning("h264_tl0d_packetize: TID%u AU of %u packets exceeds NUM_ENH_NALUS (%u), not sent\n",
+				tid, numPackets, TL0D_MAX_ENH_NALUS);
+		tp->stats.n_toolong++;
+	}
+	
+	//rather than stall the encoder, enhancement AUs are dropped before they take sequence numbers
+	if(!h264_tl0d_admit(tp, tid, fits))
+	{
+		//a skipped AU still holds its place in the group, or the TID2 after it goes out with seq_id 0
+		tp->sequence_indicator++;
+		if(!fits)
+			return EMSGSIZE;
 		
-		pCurrentStartCode = pNextStartCode;
-		h264Info->numNALUs++;
+		tp->stats.n_skipped++;
+		return EAGAIN;
 	}
-
-	pCurrentStartCode = h264_find_startcode(mb->buf, end);
+	
+	get_tl0_pic_idx(&dup, &idr, &tl0, arg);
+	
+	get_seq(&tp->seq_next, arg);	//get_seq temporary defined in video.c
+	
+	tp->pkt_seq = tp->seq_next;
 	
 	if(dup)
-	{	//get_seq temporary defined in video.c
-		get_seq(&AU_start_seq, arg);
-		AU_last_seq = AU_start_seq + h264Info->numNALUs - 1;
-		sequence_indicator = -2;
+	{
+		tp->AU_start_seq = tp->seq_next;
+		tp->AU_last_seq = tp->AU_start_seq + numPackets - 1;
+		tp->sequence_indicator = -2;
 	}
 	else
-		sequence_indicator++;
+		tp->sequence_indicator++;
+	
+	//the receiver completes a TL0 AU from fsn/lsn, so its count may be capped
+	nalu_size = (uint8_t)min(numPackets, TL0D_MAX_ENH_NALUS);
+	if(numPackets > TL0D_MAX_ENH_NALUS)
+		tp->stats.n_capped++;
+		
+	sequence_id = (!dup && tp->sequence_indicator > 0) ? (tp->sequence_indicator & 1) : 0;
 
-	for(i = 0; i < h264Info->numNALUs; i++)
+	for(i = 0; i < h264Info->numNALUs; i += n)
 	{
-		uint8_t STAP[STAP_A_SIZE];
-		uint8_t TL0D_NalUnit[TL0D_SIZE];
-			
-		if(STAP_A_SIZE < h264Info->payloadSize[i] + TL0D_SIZE)
-		{
-			err = 1;
-			return err;
-		}
+		bool last;
 		
-		memset(STAP, 0, sizeof(STAP));
-		
-		if(dup)
-			h264_tl0d_encode(h264Info, TL0D_NalUnit, i, AU_start_seq, AU_last_seq, h264Info->numNALUs, 0);
-		else
-		{
-			if(sequence_indicator < 0)
-				h264_tl0d_encode(h264Info, TL0D_NalUnit, i, AU_start_seq, AU_last_seq, h264Info->numNALUs, 0);
-			else
-				h264_tl0d_encode(h264Info, TL0D_NalUnit, i, AU_start_seq, AU_last_seq, h264Info->numNALUs, sequence_indicator);
-		}
+		n = h264_tl0d_stap_count(h264Info, i, pktsize, pmode);
+		last = (i + n == h264Info->numNALUs);
 		
-		memcpy(STAP, &TL0D_NalUnit[1], TL0D_SIZE - 1);
-		memcpy(STAP + TL0D_SIZE - 1, pCurrentStartCode + h264Info->startCodeLength[i], (int)(h264Info->payloadSize[i] + 1));
+		set_tl0(dup, idr, 0, tp->AU_start_seq, tp->AU_last_seq, arg);
+		idr = false;
 		
-		if(idr)
+		if(n > 1)
 		{
-			set_tl0(dup, true, 0, AU_start_seq, AU_last_seq, arg);
-			
-			foundLast = (i == h264Info->numNALUs - 1) ? true : false;
-			
-			err |= h264_nal_send(true, true, foundLast, TL0D_NalUnit[0], STAP, TL0D_SIZE + h264Info->payloadSize[i], pktsize, pkth, arg);
-			
-			pCurrentStartCode += h264Info->startCodeLength[i] + h264Info->payloadSize[i];		
-			idr = false;
+			err |= h264_tl0d_send_stap(tp, &h264Info->nalu[i], n, tl0, tp->AU_start_seq, tp->AU_last_seq,
+									   nalu_size, sequence_id, last, pkth, arg);
 		}
 		else
 		{
-			set_tl0(dup, idr, 0, AU_start_seq, AU_last_seq, arg);
-		
-			foundLast = (i == h264Info->numNALUs - 1) ? true : false;
+			uint8_t TL0D_NalUnit[TL0D_SIZE];
 			
-			err |= h264_nal_send(true, true, foundLast, TL0D_NalUnit[0], STAP, TL0D_SIZE + h264Info->payloadSize[i], pktsize, pkth, arg);
+			h264_tl0d_encode(TL0D_NalUnit, &h264Info->nalu[i], tl0, tp->AU_start_seq, tp->AU_last_seq, nalu_size, sequence_id);
 			
-			pCurrentStartCode += h264Info->startCodeLength[i] + h264Info->payloadSize[i];
+			err |= h264_tl0d_send(tp, TL0D_NalUnit, &h264Info->nalu[i], last, pktsize, pkth, arg);
 		}
 	}
 	
-	h264Info->numNALUs = 0;
-	mem_deref(h264Info);
-	h264Info = NULL;
+	err |= h264_tl0d_flush(tp, pkth, arg);
+	
+	tp->seq_next += numPackets;
+	
+	t = tl0d_now_ns() - t;
+	tp->stats.n_au++;
+	tp->stats.ns_sum += t;
+	if(t > tp->stats.ns_max)
+		tp->stats.ns_max = t;
 	
 	return err;
 }
 
-static void h264_svc_header_decode(SVC_NALUHeader *SVCheader, const uint8_t * NalUnit, int pos)
+
+/*
+ * Packetizes one access unit given as an Annex-B byte stream
+ */
+int h264_tl0d_packetize(struct tl0d_packetizer *tp, struct mbuf *mb, size_t pktsize, uint32_t pmode,
+		   videnc_packet_h *pkth, void *arg)
 {
-			/*SVC Header */
-			//R - I - PRID 
-			SVCheader->r 			= (NalUnit[pos] & 0x80) >> 7;
-			SVCheader->idr 			= (NalUnit[pos] & 0x40) >> 6;
-			SVCheader->priorityID 	= (NalUnit[pos] & 0x3f) >> 0;			
-			
-			//N - DID - QID
-			SVCheader->interLayerPred 	= (NalUnit[pos + 1] & 0x80) >> 7;
-			SVCheader->dependencyID 	= (NalUnit[pos + 1] & 0x70) >> 4;
-			SVCheader->qualityID 		= (NalUnit[pos + 1] & 0x0F) >> 0;
-			
-			//TID - U - D - O - RR
-			SVCheader->temporalID 		= (NalUnit[pos + 2] & 0xE0) >> 5;
-			SVCheader->useRefBasePic 	= (NalUnit[pos + 2] & 0x10) >> 4;
-			SVCheader->discardable 		= (NalUnit[pos + 2] & 0x08) >> 3;
-			SVCheader->output			= (NalUnit[pos + 2] & 0x04) >> 2;
-			SVCheader->rr 				= (NalUnit[pos + 2] & 0x03) >> 0;	
+	const uint8_t *start = mb->buf;
+	const uint8_t *end   = start + mb->end;
+	int err = 0;
+	
+	if(end - start < 4)
+	{
+		re_printf("Error: not enough space ing buffer: end - star < 4\n");
+		return 1;
+	}
+
+	tp->h264Info.numNALUs = 0;
+	
+	err = h264_annexb_parse(&tp->h264Info, start, end);
+	if(err)
+		return err;
+	
+	return h264_tl0d_send_au(tp, pktsize, pmode, pkth, arg);
 }
 
-void h264_tl0d_decode(TL0D *tl0d, const uint8_t * SVC_NalUnit, int pos)
+/*
+ * Parses the TL0D header at p, len bytes are readable. Decodes the SVC
+ * header only, the NAL unit behind it is left to the caller.
+ */
+int h264_tl0d_parse(TL0D *tl0d, const uint8_t *p, size_t len)
 {
-	h264_svc_header_decode(&tl0d->SVCheader, SVC_NalUnit, pos);
-	 
-	tl0d->nalu_size =  SVC_NalUnit[pos + 3] & 0x7F;
-	
-	tl0d->TL0picIDx = SVC_NalUnit[pos + 4] & 0xFF;
-	tl0d->fsn |= (SVC_NalUnit[pos + 5] & 0xFF) << 8;
-	tl0d->fsn |= SVC_NalUnit[pos + 6] & 0xFF;
-	tl0d->lsn |= (SVC_NalUnit[pos + 7] & 0xFF) << 8;
-	tl0d->lsn |= SVC_NalUnit[pos + 8] & 0xFF;
+	if (!tl0d || !p || len < TL0D_SIZE)
+		return EBADMSG;
+
+	if ((p[0] & 0x1f) != 31)
+		return EBADMSG;
+
+	memset(tl0d, 0, sizeof(*tl0d));
+
+	tl0d->type = 31;
+
+	//R - I - PRID
+	tl0d->SVCheader.r              = (p[1] & 0x80) >> 7;
+	tl0d->SVCheader.idr            = (p[1] & 0x40) >> 6;
+	tl0d->SVCheader.priorityID     =  p[1] & 0x3f;
+
+	//N - DID - QID
+	tl0d->SVCheader.interLayerPred = (p[2] & 0x80) >> 7;
+	tl0d->SVCheader.dependencyID   = (p[2] & 0x70) >> 4;
+	tl0d->SVCheader.qualityID      =  p[2] & 0x0f;
+
+	//TID - U - D - O - RR
+	tl0d->SVCheader.temporalID     = (p[3] & 0xe0) >> 5;
+	tl0d->SVCheader.useRefBasePic  = (p[3] & 0x10) >> 4;
+	tl0d->SVCheader.discardable    = (p[3] & 0x08) >> 3;
+	tl0d->SVCheader.output         = (p[3] & 0x04) >> 2;
+	tl0d->SVCheader.rr             =  p[3] & 0x03;
+
+	tl0d->nalu_size = p[4] & 0x7f;
+	tl0d->seq_id    = p[4] >> 7;
+	tl0d->TL0picIDx = p[5];
+	tl0d->fsn       = (uint16_t)(p[6] << 8 | p[7]);
+	tl0d->lsn       = (uint16_t)(p[8] << 8 | p[9]);
+
+	return 0;
 }
@@ -65,4 +65,18 @@ struct fu
 int fu_hdr_encode(const struct fu *fu, struct mbuf *mb);
 int fu_hdr_decode(struct fu *fu, struct mbuf *mb);
 
+/* one RTP payload, header and payload are separate segments */
+struct videnc_pkt
+{
+	bool marker;
+	const uint8_t *hdr;
+	size_t hdr_len;
+	const uint8_t *pld;
+	size_t pld_len;
+};
+
+/* receives all packets of one access unit in a single call */
+typedef int (videnc_batch_h)(const struct videnc_pkt *pktv, size_t pktc, void *arg);
+
+void h264_startcode_init(void);
 const uint8_t *h264_find_startcode(const uint8_t *p, const uint8_t *end);
@@ -0,0 +1,210 @@
+/**
+ * @file h264_startcode.c  H.264 Annex-B start code scanning with runtime CPU dispatch
+ *
+ * Copyright (C) 2015 SeNSE Project
+ */
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+#include "h264_packetize.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#endif
+#if defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_AVX2 1
+#endif
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+
+typedef const uint8_t *(startcode_h)(const uint8_t *p, const uint8_t *end);
+
+
+/*
+ * Find the NAL start sequence in a H.264 byte stream
+ *
+ * @note: copied from ffmpeg source
+ */
+static const uint8_t *find_startcode_c(const uint8_t *p, const uint8_t *end)
+{
+	const uint8_t *a = p + 4 - ((long)p & 3);
+
+	for (end -= 3; p < a && p < end; p++ ) {
+		if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+			return p;
+	}
+
+	for (end -= 3; p < end; p += 4) {
+		uint32_t x = *(const uint32_t*)(void *)p;
+		if ( (x - 0x01010101) & (~x) & 0x80808080 ) {
+			if (p[1] == 0 ) {
+				if ( p[0] == 0 && p[2] == 1 )
+					return p;
+				if ( p[2] == 0 && p[3] == 1 )
+					return p+1;
+			}
+			if ( p[3] == 0 ) {
+				if ( p[2] == 0 && p[4] == 1 )
+					return p+2;
+				if ( p[4] == 0 && p[5] == 1 )
+					return p+3;
+			}
+		}
+	}
+
+	for (end += 3; p < end; p++) {
+		if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+			return p;
+	}
+
+	return end + 3;
+}
+
+
+/* byte by byte scan of the last few bytes that do not fill a vector */
+static inline const uint8_t *find_startcode_tail(const uint8_t *p, const uint8_t *end)
+{
+	for (; p + 2 < end; p++) {
+		if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+			return p;
+	}
+
+	return end;
+}
+
+
+#ifdef HAVE_SSE2
+/*
+ * Compares 16 positions at once: byte i, i+1 and i+2 are loaded as three
+ * overlapping vectors and tested for 0, 0 and 1 respectively.
+ */
+static const uint8_t *find_startcode_sse2(const uint8_t *p, const uint8_t *end)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one  = _mm_set1_epi8(1);
+
+	for (; p + 18 <= end; p += 16) {
+		__m128i v0 = _mm_loadu_si128((const __m128i *)(const void *)p);
+		__m128i v1 = _mm_loadu_si128((const __m128i *)(const void *)(p + 1));
+		__m128i v2 = _mm_loadu_si128((const __m128i *)(const void *)(p + 2));
+		__m128i m;
+		int mask;
+
+		m = _mm_and_si128(_mm_cmpeq_epi8(v0, zero),
+				  _mm_cmpeq_epi8(v1, zero));
+		m = _mm_and_si128(m, _mm_cmpeq_epi8(v2, one));
+
+		mask = _mm_movemask_epi8(m);
+		if (mask)
+			return p + __builtin_ctz((unsigned)mask);
+	}
+
+	return find_startcode_tail(p, end);
+}
+#endif
+
+
+#ifdef HAVE_AVX2
+__attribute__((target("avx2")))
+static const uint8_t *find_startcode_avx2(const uint8_t *p, const uint8_t *end)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i one  = _mm256_set1_epi8(1);
+
+	for (; p + 34 <= end; p += 32) {
+		__m256i v0 = _mm256_loadu_si256((const __m256i *)(const void *)p);
+		__m256i v1 = _mm256_loadu_si256((const __m256i *)(const void *)(p + 1));
+		__m256i v2 = _mm256_loadu_si256((const __m256i *)(const void *)(p + 2));
+		__m256i m;
+		uint32_t mask;
+
+		m = _mm256_and_si256(_mm256_cmpeq_epi8(v0, zero),
+				     _mm256_cmpeq_epi8(v1, zero));
+		m = _mm256_and_si256(m, _mm256_cmpeq_epi8(v2, one));
+
+		mask = (uint32_t)_mm256_movemask_epi8(m);
+		if (mask)
+			return p + __builtin_ctz(mask);
+	}
+
+	return find_startcode_tail(p, end);
+}
+#endif
+
+
+#ifdef HAVE_NEON
+static const uint8_t *find_startcode_neon(const uint8_t *p, const uint8_t *end)
+{
+	const uint8x16_t zero = vdupq_n_u8(0);
+	const uint8x16_t one  = vdupq_n_u8(1);
+
+	for (; p + 18 <= end; p += 16) {
+		uint8x16_t m;
+
+		m = vandq_u8(vceqq_u8(vld1q_u8(p), zero),
+			     vceqq_u8(vld1q_u8(p + 1), zero));
+		m = vandq_u8(m, vceqq_u8(vld1q_u8(p + 2), one));
+
+		/* NEON has no movemask, locate the hit in this block only */
+		if (vmaxvq_u8(m))
+			return find_startcode_tail(p, p + 18);
+	}
+
+	return find_startcode_tail(p, end);
+}
+#endif
+
+
+static startcode_h *find_startcode = find_startcode_c;
+
+
+/*
+ * Selects the fastest start code scanner supported by the running CPU,
+ * called once at module load
+ */
+void h264_startcode_init(void)
+{
+	const char *name = "c";
+
+	find_startcode = find_startcode_c;
+
+#ifdef HAVE_SSE2
+	find_startcode = find_startcode_sse2;
+	name = "sse2";
+#endif
+
+#ifdef HAVE_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		find_startcode = find_startcode_avx2;
+		name = "avx2";
+	}
+#endif
+
+#ifdef HAVE_NEON
+	find_startcode = find_startcode_neon;
+	name = "neon";
+#endif
+
+	debug("openh264: start code scanner: %s\n", name);
+}
+
+
+/*
+ * Find the NAL start sequence in a H.264 byte stream
+ *
+ * Returns a pointer to the first 00 00 01 sequence in [p, end), or end
+ * if there is none
+ */
+const uint8_t *h264_find_startcode(const uint8_t *p, const uint8_t *end)
+{
+	return find_startcode(p, end);
+}
@@ -13,6 +13,9 @@
 
 #define STAP_A_SIZE 2000
 #define TL0D_SIZE 10
+#define TL0D_BATCH_SIZE 256
+#define TL0D_MAX_ENH_NALUS 0x7f
+#define TL0D_STAP_ARENA (8 * STAP_A_SIZE)
 
 //NAL types 14, 15, 20.
 typedef struct SVC_NALUHeader
@@ -37,6 +40,7 @@ typedef struct TL0D
 	uint32_t        NALlength;
 	uint8_t         type;
 	uint8_t			nalu_size;
+	uint8_t			seq_id;
 	uint8_t         TL0picIDx;
 	uint16_t        fsn;
 	uint16_t        lsn;
@@ -44,22 +48,75 @@ typedef struct TL0D
 }TL0D;
 
 
+/* One NAL unit of an access unit, pointing into the encoder's bitstream */
+typedef struct H264NALU
+{
+	const uint8_t       *buf;		/* NAL unit header, start code skipped */
+	uint32_t             size;		/* NAL unit header + payload */
+	uint8_t              NRI;
+	uint8_t              type;
+	SVC_NALUHeader       SVCheader;
+}H264NALU;
+
+
 typedef struct H264Info
 {
 	uint16_t             numNALUs;
-	uint8_t              numLayers;
-	uint8_t              startCodeLength[KMaxNumberOfNALUs];
-	uint32_t             payloadSize[KMaxNumberOfNALUs];
-	uint8_t              NRI[KMaxNumberOfNALUs];
-	uint8_t              type[KMaxNumberOfNALUs];
-	SVC_NALUHeader 		 SVCheader[KMaxNumberOfNALUs];
-	TL0D     			 tl0d[KMaxNumberOfNALUs];
-	int32_t              accLayerSize[KMaxNumberOfLayers];
+	H264NALU             nalu[KMaxNumberOfNALUs];
 }H264Info;
 
 
 
-int h264_tl0d_packetize(struct mbuf *mb, size_t pktsize,
+struct pacer;
+struct tl0_hist;
+
+/* packetizer counters, times include the packet handler */
+struct tl0d_stats
+{
+	unsigned long long   n_au;
+	unsigned long long   n_pkt;
+	unsigned long long   n_bytes;		/* header + payload handed over */
+	unsigned long long   n_copied;		/* payload bytes copied into aggregates */
+	unsigned long long   n_oversize;		/* AUs refused, a NAL unit needed FU-A in mode 0 */
+	unsigned long long   n_skipped;		/* enhancement AUs not sent, the pacer was behind or their reference was not sent */
+	unsigned long long   n_toolong;		/* enhancement AUs refused, more packets than NUM_ENH_NALUS holds */
+	unsigned long long   n_capped;		/* TL0 AUs with NUM_ENH_NALUS capped, the receiver uses fsn/lsn */
+	unsigned long long   ns_sum;		/* time spent in h264_tl0d_send_au */
+	unsigned long long   ns_max;
+};
+
+/* Packetizer state of one encoder, owned by struct videnc_state */
+struct tl0d_packetizer
+{
+	uint16_t             AU_start_seq;		/* fsn of the current TL0 access unit */
+	uint16_t             AU_last_seq;		/* lsn of the current TL0 access unit */
+	int                  sequence_indicator;	/* enhancement AUs since the last TL0 AU */
+	uint8_t              skip_tid;		/* lowest TID skipped since the last TL0 AU, 0 for none */
+	uint16_t             seq_next;		/* RTP sequence number of the next packet */
+	struct pacer        *pacer;		/* optional, not owned */
+	struct tl0_hist     *hist;		/* optional, not owned, keeps TL0 packets for RTX */
+	uint16_t             pkt_seq;		/* RTP sequence number of the packet being sent */
+	H264Info             h264Info;		/* NAL unit table, reused for every AU */
+	
+	/* packets of the current access unit, handed over in one call */
+	videnc_batch_h      *batchh;
+	void                *batch_arg;
+	struct videnc_pkt    pktv[TL0D_BATCH_SIZE];
+	uint8_t              hdrv[TL0D_BATCH_SIZE][TL0D_SIZE + 2];
+	size_t               pktc;
+	uint8_t              stap_buf[TL0D_STAP_ARENA];
+	size_t               stap_pos;
+	
+	struct tl0d_stats    stats;
+};
+
+int tl0d_packetizer_alloc(struct tl0d_packetizer **tpp);
+void h264_tl0d_set_batch(struct tl0d_packetizer *tp, videnc_batch_h *batchh, void *arg);
+int h264_tl0d_debug(struct re_printf *pf, const struct tl0d_packetizer *tp);
+int h264_tl0d_nalu_add(H264Info *h264Info, const uint8_t *buf, uint32_t size);
+int h264_tl0d_send_au(struct tl0d_packetizer *tp, size_t pktsize, uint32_t pmode,
+		   videnc_packet_h *pkth, void *arg);
+int h264_tl0d_packetize(struct tl0d_packetizer *tp, struct mbuf *mb, size_t pktsize, uint32_t pmode,
 		   videnc_packet_h *pkth, void *arg);
 
-void h264_tl0d_decode(TL0D *tl0d, const uint8_t * NalUnit, int pos);
+int h264_tl0d_parse(TL0D *tl0d, const uint8_t *p, size_t len);
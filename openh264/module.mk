@@ -7,6 +7,7 @@
 
 MOD		:= openh264
 $(MOD)_SRCS	+= openh264_codec.c h264_packetize.c openh264_encode.c openh264_decode.c h264_tl0d_packetize.c
+$(MOD)_SRCS	+= h264_startcode.c pacer.c tl0_history.c dec_worker.c
 $(MOD)_LFLAGS	+= -lopenh264
 
 include mk/mod.mk
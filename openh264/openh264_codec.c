@@ -12,7 +12,7 @@
 
 
 
-static uint32_t packetization_mode(const char *fmtp)
+uint32_t packetization_mode(const char *fmtp)
 {
 	struct pl pl, mode;
 
@@ -40,10 +40,11 @@ static int h264_fmtp_enc(struct mbuf *mb, const struct sdp_format *fmt,
 		return 0;
 
 	return mbuf_printf(mb, "a=fmtp:%s"
-			   " packetization-mode=0"
+			   " packetization-mode=%u"
 			   ";profile-level-id=%02x%02x%02x"
 			   "\r\n",
-			   fmt->id, profile_idc, profile_iop, h264_level_idc);
+			   fmt->id, packetization_mode(vc->variant),
+			   profile_idc, profile_iop, h264_level_idc);
 }
 
 
@@ -55,7 +56,21 @@ static bool h264_fmtp_cmp(const char *fmtp1, const char *fmtp2, void *data)
 }
 
 
-static struct vidcodec openh264 = {
+/* non-interleaved mode: single NAL units, STAP-A and FU-A */
+static struct vidcodec openh264_1 = {
+	.name = "H264",
+	.variant = "packetization-mode=1",
+	.encupdh = openh264_encoder_update,
+	.ench = openh264_encode,
+	.decupdh = openh264_decoder_update,
+	.dech = openh264_decode,
+	.fmtp_ench = h264_fmtp_enc,
+	.fmtp_cmph = h264_fmtp_cmp,
+};
+
+
+/* single NAL unit mode */
+static struct vidcodec openh264_0 = {
 	.name = "H264",
 	.variant = "packetization-mode=0",
 	.encupdh = openh264_encoder_update,
@@ -69,14 +84,19 @@ static struct vidcodec openh264 = {
 
 static int module_init(void)
 {
-	vidcodec_register(&openh264);
+	h264_startcode_init();
+	
+	/* registration order is offer order, mode 1 is preferred */
+	vidcodec_register(&openh264_1);
+	vidcodec_register(&openh264_0);
 	return 0;
 }
 
 
 static int module_close(void)
 {
-	vidcodec_unregister(&openh264);
+	vidcodec_unregister(&openh264_0);
+	vidcodec_unregister(&openh264_1);
 	return 0;
 }
 
@@ -8,6 +8,8 @@
 
 extern const uint8_t h264_level_idc;
 
+uint32_t packetization_mode(const char *fmtp);
+
 
 /*
  * Encode
@@ -19,6 +21,16 @@ int openh264_encoder_update(struct videnc_state **vesp, const struct vidcodec *v
 							struct videnc_param *prm, const char *fmtp);
 int openh264_encode(struct videnc_state *st, bool update, const struct vidframe *frame,
 					videnc_packet_h *pkth, void *arg);
+int openh264_encoder_debug(struct re_printf *pf, const struct videnc_state *st);
+void openh264_encoder_set_batch(struct videnc_state *st, videnc_batch_h *batchh, void *arg);
+
+/*
+ * Base layer RTX, not reachable through struct vidcodec. The video layer
+ * registers its RTX sender and passes the RTCP messages of the stream on,
+ * until then no history is kept even with openh264_rtx enabled.
+ */
+void openh264_encoder_set_rtx(struct videnc_state *st, videnc_packet_h *rtxh, void *arg);
+int openh264_encoder_rtcp(struct videnc_state *st, const struct rtcp_msg *msg);
 
 
 /*
@@ -31,8 +43,20 @@ int openh264_decoder_update(struct viddec_state **vdsp, const struct vidcodec *v
 int openh264_decode(struct viddec_state *st, struct vidframe *frame, bool eof, uint16_t seq, struct mbuf *src);
 int h264_parse_nal_units(struct viddec_state *st, struct mbuf *src);
 
+enum openh264_dec_ctrl
+{
+	OPENH264_DEC_DISCARD,	/* drop the partly assembled access unit */
+	OPENH264_DEC_RESYNC,	/* drop it and wait for the next parameter sets */
+};
+
+int openh264_decode_ctrl(struct viddec_state *st, enum openh264_dec_ctrl ctrl);
+int openh264_decoder_debug(struct re_printf *pf, const struct viddec_state *st);
+
+typedef void (openh264_frame_h)(const struct vidframe *frame, void *arg);
+int openh264_decoder_set_frameh(struct viddec_state *st, openh264_frame_h *frameh, void *arg);
+
 int decode_sdpparam_h264(struct videnc_state *st, const struct pl *name, const struct pl *val);
-int h264_packetize(struct mbuf *mb, size_t pktsize, videnc_packet_h *pkth, void *arg);
+int h264_packetize(struct mbuf *mb, size_t pktsize, uint32_t pmode, videnc_packet_h *pkth, void *arg);
 
 
 int h264_nal_send(bool first, bool last, bool marker, uint32_t ihdr, const uint8_t *buf,
@@ -40,3 +64,79 @@ int h264_nal_send(bool first, bool last, bool marker, uint32_t ihdr, const uint8
 
 //For TL0 Mechanism
 void update_tl0_pic_idx(void *arg1, void *arg2);
+
+
+/*
+ * Pacer
+ */
+
+struct pacer;
+
+struct pacer_stats
+{
+	unsigned long long n_pkt;
+	unsigned long long n_bytes;
+	unsigned long long delay_sum;	/* hand-over to send in [us] */
+	unsigned long long delay_max;
+	unsigned long long n_late;	/* packets sent unpaced after the budget ran out */
+	unsigned long long n_refused;	/* enhancement AUs turned away by pacer_admit() */
+};
+
+int pacer_alloc(struct pacer **pp, uint32_t rate, uint32_t burst, uint32_t budget,
+				uint32_t backlog, size_t pktsize);
+bool pacer_admit(struct pacer *p, bool base);
+void pacer_set_rate(struct pacer *p, uint32_t rate, uint32_t budget);
+int pacer_send(struct pacer *p, bool marker, const uint8_t *hdr, size_t hdr_len,
+			   const uint8_t *pld, size_t pld_len, videnc_packet_h *pkth, void *arg);
+int pacer_send_batch(struct pacer *p, const struct videnc_pkt *pktv, size_t pktc,
+					 videnc_packet_h *pkth, void *arg);
+int pacer_send_chunks(struct pacer *p, const struct videnc_pkt *pktv, size_t pktc,
+					  videnc_batch_h *batchh, void *arg);
+void pacer_stats(struct pacer *p, struct pacer_stats *stats);
+int pacer_debug(struct re_printf *pf, struct pacer *p);
+
+
+/*
+ * TL0 retransmission history
+ */
+
+struct tl0_hist;
+
+struct tl0_hist_stats
+{
+	unsigned long long n_stored;
+	unsigned long long n_resent;
+	unsigned long long n_miss;	/* NACKed but not in the history */
+	unsigned long long n_toobig;
+};
+
+int tl0_hist_alloc(struct tl0_hist **hp, uint32_t size, size_t pktsize);
+void tl0_hist_put(struct tl0_hist *h, uint16_t seq, bool marker, const uint8_t *hdr, size_t hdr_len,
+				  const uint8_t *pld, size_t pld_len);
+int tl0_hist_resend(struct tl0_hist *h, uint16_t pid, uint16_t blp, videnc_packet_h *rtxh, void *arg);
+int tl0_hist_debug(struct re_printf *pf, struct tl0_hist *h);
+
+
+/*
+ * Decoder worker
+ */
+
+struct dec_worker;
+
+struct dec_worker_stats
+{
+	unsigned long long n_au;	/* AUs queued */
+	unsigned long long n_dropped;	/* enhancement AUs dropped, the queue was up to the base layer reserve */
+	unsigned long long n_skipped;	/* queued enhancement AUs passed over after a base layer drop */
+	unsigned long long n_base_dropped;	/* base layer AUs dropped on a full queue */
+	uint32_t qlen_max;
+};
+
+typedef void (dec_worker_h)(struct mbuf *mb, uint64_t au_start, void *arg);
+
+int dec_worker_alloc(struct dec_worker **wp, uint32_t qdepth, uint32_t reserve, size_t bufsize,
+					 dec_worker_h *h, void *arg);
+struct mbuf *dec_worker_buf(struct dec_worker *w);
+int dec_worker_push(struct dec_worker *w, bool base, uint64_t au_start);
+void dec_worker_stats(const struct dec_worker *w, struct dec_worker_stats *stats);
+int dec_worker_debug(struct re_printf *pf, const struct dec_worker *w);
@@ -8,6 +8,7 @@
 #include <baresip.h>
 #include <stdbool.h>
 #include <string.h>
+#include <time.h>
 
 #include "h264_packetize.h"
 #include "h264_tl0d.h"
@@ -16,21 +17,172 @@
 /* OpenH264: */
 #include <wels/codec_api.h>
 #include <wels/codec_app_def.h>
+#include <wels/codec_ver.h>
 
 
+/* decoder defaults, overridden by openh264_dec_* in the config */
+enum {
+	DEFAULT_DEC_BUFSIZE = 131072,	/* initial access unit buffer */
+	DEFAULT_DEC_QDEPTH  = 8,	/* AUs queued for the decoder thread */
+	DEFAULT_DEC_RESERVE = 1,	/* queue slots kept for base layer AUs */
+};
+
+/*
+ * Temporal layer adaptation: the decoder load is the share of wall time
+ * spent decoding over a window. Above the high mark one temporal layer
+ * is dropped, below the low mark one is added back, but not sooner than
+ * the hold time after the last change. Each layer about doubles the
+ * frame rate, so the low mark is below half the high mark.
+ */
+enum {
+	TID_MAX         = 7,
+	TID_WINDOW      = 500000,	/* [us] */
+	TID_HOLD        = 2000000,	/* [us] */
+	TID_LOAD_HIGH   = 90,		/* [%] */
+	TID_LOAD_LOW    = 40,		/* [%] */
+};
+
+/* state of the temporal layer adaptation */
+struct tid_adapt
+{
+	bool enabled;
+	bool forced;			/* openh264_max_tid set in the config */
+	uint8_t max_tid;		/* highest temporal ID passed to OpenH264 */
+	uint8_t seen_tid;		/* highest temporal ID in the stream */
+	bool skip;			/* the current AU is above max_tid */
+	uint64_t win_start;
+	unsigned long long win_busy;
+	unsigned long long win_frames;
+	uint32_t load;			/* [%] of the last window */
+	uint32_t fps;			/* decoded frames per second of the last window */
+	uint64_t last_change;
+	uint32_t n_down;
+	uint32_t n_up;
+	unsigned long long n_skipped;	/* AUs not passed to OpenH264 */
+};
+
+/* reassembly counters of a decoder, the frame and latency counters are
+   atomic as they are written by the decoder thread if there is one */
+struct dec_stats
+{
+	unsigned long long n_au;
+	unsigned long long n_copied;	/* bytes written into the AU buffer */
+	unsigned long long n_moved;	/* bytes moved by buffer reallocations */
+	uint32_t n_realloc;
+	size_t au_max;			/* largest access unit */
+	unsigned long long n_frames;
+	unsigned long long n_feed;	/* calls into OpenH264 */
+	unsigned long long lat_sum;	/* first packet to decoded frame in [us] */
+	unsigned long long lat_max;
+	unsigned long long busy;	/* time spent in OpenH264 in [us] */
+};
 
 struct viddec_state 
 {
 	ISVCDecoder *decoder;
 	SDecodingParam DecodingParam;
-	struct mbuf *mb;
+	struct mbuf *mb;		/* access unit buffer, kept for the life of the stream */
 	bool got_keyframe;
+	uint32_t packetization_mode;
+	TL0D tl0d;		/* TL0D header of the last packet, parsed once */
+	bool low_latency;	/* feed NAL units as they complete */
+	bool nal_open;		/* the AU buffer ends inside a FU-A */
+	size_t fed;		/* AU buffer bytes already passed to OpenH264 */
+	uint64_t au_start;	/* first packet of the AU in [us] */
+	struct dec_stats stats;
+
+	/* optional decoder thread, frames are then passed to frameh */
+	struct dec_worker *worker;
+	openh264_frame_h *frameh;
+	void *frame_arg;
+	bool dec_err;		/* set by the worker, resets got_keyframe */
+
+	struct tid_adapt tid;
 };
 
+static const uint8_t nal_seq[3] = {0, 0, 1};
+
+
+static uint64_t dec_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void dec_busy_add(struct viddec_state *st, uint64_t t0)
+{
+	__atomic_add_fetch(&st->stats.busy, dec_now_us() - t0, __ATOMIC_RELAXED);
+}
+
+static void au_rewind(struct viddec_state *st)
+{
+	mbuf_rewind(st->mb);
+	st->fed = 0;
+	st->nal_open = false;
+}
+
+
+/*
+ * Makes room for n more bytes in the access unit buffer. The buffer only
+ * grows, to twice the size needed, so a stream stops reallocating once
+ * its largest access unit has been seen.
+ */
+static int au_reserve(struct viddec_state *st, size_t n)
+{
+	struct mbuf *mb = st->mb;
+	int err;
+
+	if (mb->pos + n <= mb->size)
+		return 0;
+
+	st->stats.n_realloc++;
+	st->stats.n_moved += mb->end;
+
+	err = mbuf_resize(mb, 2 * (mb->pos + n));
+	if (err)
+		warning("openh264: could not grow AU buffer to %zu bytes\n", 2 * (mb->pos + n));
+
+	return err;
+}
+
+/* appends to the access unit buffer, the only copy of the payload */
+static int au_write(struct viddec_state *st, const uint8_t *p, size_t n)
+{
+	struct mbuf *mb = st->mb;
+	int err;
+
+	err = au_reserve(st, n);
+	if (err)
+		return err;
+
+	memcpy(mb->buf + mb->pos, p, n);
+	mb->pos += n;
+	mb->end  = mb->pos;
+
+	st->stats.n_copied += n;
+
+	return 0;
+}
+
+/* start code and a rebuilt NAL header, for the first fragment of a FU-A */
+static int au_nal_start(struct viddec_state *st, const struct h264_hdr *hdr)
+{
+	uint8_t b[4] = {0, 0, 1, 0};
+
+	b[3] = hdr->f << 7 | hdr->nri << 5 | hdr->type;
+
+	return au_write(st, b, sizeof(b));
+}
+
 static void destructor(void *arg)
 {
 	struct viddec_state *st = arg;
 
+	/* the worker still uses the decoder until it is joined */
+	mem_deref(st->worker);
 	mem_deref(st->mb);
 	if (st->decoder)
 	{
@@ -93,6 +245,8 @@ int openh264_decoder_update(struct viddec_state **vdsp, const struct vidcodec *v
 		  const char *fmtp)
 {
 	struct viddec_state *st;
+	uint32_t bufsize = DEFAULT_DEC_BUFSIZE;
+	uint32_t max_tid;
 	int err = 0;
 
 	if (!vdsp || !vc)
@@ -101,15 +255,24 @@ int openh264_decoder_update(struct viddec_state **vdsp, const struct vidcodec *v
 	if (*vdsp)
 		return 0;
 
-	(void)fmtp;
-
 	st = mem_zalloc(sizeof(*st), destructor);
 	if (!st)
 		return ENOMEM;
 
 
-	/* if further memory is required then mbuf_write_mem allocates it automatically */
-	st->mb = mbuf_alloc(1024);
+	(void)conf_get_u32(conf_cur(), "openh264_dec_bufsize", &bufsize);
+	(void)conf_get_bool(conf_cur(), "openh264_low_latency", &st->low_latency);
+
+	st->tid.enabled = true;
+	st->tid.max_tid = TID_MAX;
+	(void)conf_get_bool(conf_cur(), "openh264_adaptive_tid", &st->tid.enabled);
+	if (0 == conf_get_u32(conf_cur(), "openh264_max_tid", &max_tid)) {
+		st->tid.forced  = true;
+		st->tid.max_tid = max_tid > TID_MAX ? TID_MAX : max_tid;
+	}
+
+	/* sized once per stream, au_reserve() grows it if an AU does not fit */
+	st->mb = mbuf_alloc(bufsize ? bufsize : DEFAULT_DEC_BUFSIZE);
 	if (!st->mb) 
 	{
 		err = ENOMEM;
@@ -117,6 +280,7 @@ int openh264_decoder_update(struct viddec_state **vdsp, const struct vidcodec *v
 	}
 
 	st->decoder = NULL;
+	st->packetization_mode = packetization_mode(fmtp);
 
 	err = openh264_init_open_decoder(st);
 	if (err) 
@@ -125,7 +289,8 @@ int openh264_decoder_update(struct viddec_state **vdsp, const struct vidcodec *v
 		goto out;
 	}
 
-	debug("openh264: video decoder %s (%s)\n", vc->name, fmtp);
+	debug("openh264: video decoder %s (%s) packetization-mode=%u%s\n", vc->name, fmtp,
+	      st->packetization_mode, st->low_latency ? " low-latency" : "");
 
  out:
 	if (err)
@@ -137,82 +302,319 @@ int openh264_decoder_update(struct viddec_state **vdsp, const struct vidcodec *v
 }
 
 
+static void decoder_output(struct viddec_state *st, struct vidframe *frame,
+			   uint8_t *pFrameData[3], const SBufferInfo *info, uint64_t au_start)
+{
+	uint64_t lat;
+	int i;
+
+	if (info->iBufferStatus != 1)
+		return;
+
+	for (i=0; i<3; i++) 
+	{
+		int j = i>0 ? 1 : 0;
+		frame->data[i]     = pFrameData[i];
+		frame->linesize[i] = info->UsrData.sSystemBuffer.iStride[j];
+	}
+
+	frame->size.w = info->UsrData.sSystemBuffer.iWidth;
+	frame->size.h = info->UsrData.sSystemBuffer.iHeight;
+	frame->fmt    = VID_FMT_YUV420P;
+
+	lat = dec_now_us() - au_start;
+
+	__atomic_add_fetch(&st->stats.n_frames, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&st->stats.lat_sum, lat, __ATOMIC_RELAXED);
+	if (lat > __atomic_load_n(&st->stats.lat_max, __ATOMIC_RELAXED))
+		__atomic_store_n(&st->stats.lat_max, lat, __ATOMIC_RELAXED);
+}
+
+
+/* passes the NAL units completed since the last call on to OpenH264 */
+static int decoder_feed(struct viddec_state *st, struct vidframe *frame, bool eof)
+{
+	uint8_t * pFrameData[3] = {NULL};
+	SBufferInfo sDstBufInfo;
+	const uint8_t *p = st->mb->buf + st->fed;
+	int n = (int)(st->mb->end - st->fed);
+	uint64_t t0 = dec_now_us();
+	int err;
+
+	memset(&sDstBufInfo, 0, sizeof(sDstBufInfo));
+
+	st->fed = st->mb->end;
+	__atomic_add_fetch(&st->stats.n_feed, 1, __ATOMIC_RELAXED);
+
+	if (!eof) {
+		err = (*st->decoder)->DecodeFrame2(st->decoder, p, n, pFrameData, &sDstBufInfo);
+	}
+	else {
+#if OPENH264_MAJOR > 1 || (OPENH264_MAJOR == 1 && OPENH264_MINOR >= 5)
+		err = (*st->decoder)->DecodeFrameNoDelay(st->decoder, p, n, pFrameData, &sDstBufInfo);
+#else
+		int eos = false;
+
+		/* the empty call ends the picture, as DecodeFrameNoDelay() does in 1.5 */
+		err = (*st->decoder)->DecodeFrame2(st->decoder, p, n, pFrameData, &sDstBufInfo);
+		if (!err && sDstBufInfo.iBufferStatus != 1)
+			err = (*st->decoder)->DecodeFrame2(st->decoder, NULL, 0, pFrameData, &sDstBufInfo);
+
+		(void)(*st->decoder)->SetOption(st->decoder, DECODER_OPTION_END_OF_STREAM, &eos);
+#endif
+	}
+
+	dec_busy_add(st, t0);
+
+	if (err)
+		return err;
+
+	decoder_output(st, frame, pFrameData, &sDstBufInfo, st->au_start);
+
+	return 0;
+}
+
+
+/* decodes one queued access unit, runs on the worker thread */
+static void decoder_worker_h(struct mbuf *mb, uint64_t au_start, void *arg)
+{
+	struct viddec_state *st = arg;
+	uint8_t * pFrameData[3] = {NULL};
+	SBufferInfo sDstBufInfo;
+	struct vidframe frame;
+	uint64_t t0 = dec_now_us();
+	int err;
+
+	memset(&sDstBufInfo, 0, sizeof(sDstBufInfo));
+	memset(&frame, 0, sizeof(frame));
+
+	__atomic_add_fetch(&st->stats.n_feed, 1, __ATOMIC_RELAXED);
+
+	err = (*st->decoder)->DecodeFrame2(st->decoder, mb->buf, (int)mb->end, pFrameData, &sDstBufInfo);
+	dec_busy_add(st, t0);
+	if (err) {
+		__atomic_store_n(&st->dec_err, true, __ATOMIC_RELEASE);
+		return;
+	}
+
+	decoder_output(st, &frame, pFrameData, &sDstBufInfo, au_start);
+
+	if (sDstBufInfo.iBufferStatus == 1)
+		st->frameh(&frame, st->frame_arg);
+}
+
+
+/*
+ * Hands the assembled access unit to the worker and continues in a free
+ * buffer. A dropped base layer AU is reported to the caller as EOVERFLOW,
+ * a dropped enhancement AU only shows in the worker's counters.
+ */
+static int decoder_queue(struct viddec_state *st)
+{
+	int err;
+
+	err = dec_worker_push(st->worker, st->tl0d.SVCheader.temporalID == 0, st->au_start);
+
+	//the base layer still decodes, an error would make the video layer ask for a keyframe
+	if (err == ENOSPC)
+		return 0;
+
+	if (err)
+		return err;
+
+	mem_deref(st->mb);
+	st->mb = mem_ref(dec_worker_buf(st->worker));
+
+	return 0;
+}
+
+
+/*
+ * Registers the handler for frames decoded on the decoder thread. With
+ * openh264_dec_thread enabled, access units are then decoded on their
+ * own thread and openh264_decode() returns without a frame. frameh is
+ * called on that thread.
+ */
+int openh264_decoder_set_frameh(struct viddec_state *st, openh264_frame_h *frameh, void *arg)
+{
+	uint32_t qdepth = DEFAULT_DEC_QDEPTH;
+	uint32_t reserve = DEFAULT_DEC_RESERVE;
+	bool enable = false;
+	int err;
+
+	if (!st)
+		return EINVAL;
+
+	(void)conf_get_bool(conf_cur(), "openh264_dec_thread", &enable);
+	(void)conf_get_u32(conf_cur(), "openh264_dec_qdepth", &qdepth);
+	(void)conf_get_u32(conf_cur(), "openh264_dec_reserve", &reserve);
+
+	if (st->worker || !enable || !frameh)
+		return 0;
+
+	st->frameh    = frameh;
+	st->frame_arg = arg;
+
+	err = dec_worker_alloc(&st->worker, qdepth, reserve, st->mb->size, decoder_worker_h, st);
+	if (err) {
+		warning("openh264: could not start decoder thread (%m)\n", err);
+		return err;
+	}
+
+	mem_deref(st->mb);
+	st->mb = mem_ref(dec_worker_buf(st->worker));
+	au_rewind(st);
+
+	return 0;
+}
+
+
 /*
  * TODO: check input/output size
  */
 static int openh264_decoder_decode(struct viddec_state *st, struct vidframe *frame,
 		    bool eof, struct mbuf *src)
 {
-	int i, err;
 	uint8_t * pFrameData[3] = {NULL};
 	SBufferInfo sDstBufInfo;
+	uint64_t t0;
+	int err;
 
 	/* assemble packets in "mbuf" until a full access unit arrives*/
-	err = mbuf_write_mem(st->mb, mbuf_buf(src), mbuf_get_left(src));
+	err = au_write(st, mbuf_buf(src), mbuf_get_left(src));
 	
 	if (err)
 		return err;
 	
 	if (!eof)
+	{
+		//decoding overlaps the arrival of the rest of the AU
+		if (st->low_latency && !st->worker && st->got_keyframe && !st->nal_open)
+		{
+			err = decoder_feed(st, frame, false);
+			if (err)
+				goto out;
+		}
+
 		return 0;
+	}
+
+	st->stats.n_au++;
+	if (st->mb->end > st->stats.au_max)
+		st->stats.au_max = st->mb->end;
 
 	st->mb->pos = 0;
 
+	if (__atomic_exchange_n(&st->dec_err, false, __ATOMIC_ACQUIRE))
+		st->got_keyframe = false;
+
 	if (!st->got_keyframe) 
 	{
 		err = EPROTO;
 		goto out;
 	}
 
+	if (st->worker)
+	{
+		err = decoder_queue(st);
+		goto out;
+	}
+
+	if (st->low_latency)
+	{
+		err = decoder_feed(st, frame, true);
+		goto out;
+	}
+
 	memset (&sDstBufInfo, 0, sizeof (SBufferInfo));
 
+	__atomic_add_fetch(&st->stats.n_feed, 1, __ATOMIC_RELAXED);
+
 	/* Decode */
+	t0 = dec_now_us();
 	err = (*st->decoder)->DecodeFrame2(st->decoder, st->mb->buf, (int)mbuf_get_left(st->mb), pFrameData, &sDstBufInfo);
+	dec_busy_add(st, t0);
 	if(err)
 		goto out;
 		
-	if (sDstBufInfo.iBufferStatus == 1) 
-	{
-		for (i=0; i<3; i++) 
-		{
-			int j = i>0 ? 1 : 0;
-			frame->data[i]     = pFrameData[i];
-			frame->linesize[i] = sDstBufInfo.UsrData.sSystemBuffer.iStride[j];
-		}
-
-		frame->size.w = sDstBufInfo.UsrData.sSystemBuffer.iWidth;
-		frame->size.h = sDstBufInfo.UsrData.sSystemBuffer.iHeight;
-		frame->fmt    = VID_FMT_YUV420P;
-	}
+	decoder_output(st, frame, pFrameData, &sDstBufInfo, st->au_start);
 
 
  out:
 	if (eof)
-		mbuf_rewind(st->mb);
+		au_rewind(st);
 	
 	//For TL0 Mechanism
 	if(err)
 	{
 		st->got_keyframe = false;
-		mbuf_rewind(st->mb);
+		au_rewind(st);
 	}
 
 	return err;
 }
 
+/*unpacks all NAL units of a STAP-A into the access unit buffer,
+  src is fully consumed
+*/
+static int h264_stap_a_unpack(struct viddec_state *st, struct mbuf *src)
+{
+	int err = 0;
+	
+	while (mbuf_get_left(src) >= 2)
+	{
+		const uint8_t *p = mbuf_buf(src);
+		size_t len = (size_t)p[0] << 8 | p[1];
+		
+		src->pos += 2;
+		
+		if (!len || len > mbuf_get_left(src))
+			return EBADMSG;
+		
+		if (!st->got_keyframe) 
+		{
+			switch (src->buf[src->pos] & 0x1f) 
+			{
+				case H264_NAL_PPS:
+				case H264_NAL_SPS:
+						st->got_keyframe = true;
+						break;
+			}
+		}
+		
+		err = au_reserve(st, sizeof(nal_seq) + len);
+		if (err)
+			return err;
+		
+		(void)au_write(st, nal_seq, sizeof(nal_seq));
+		(void)au_write(st, mbuf_buf(src), len);
+		
+		src->pos += len;
+	}
+	
+	src->pos = src->end;
+	
+	return err;
+}
+
 /*adds the start code and nal header at the begening of each nal unit
   or fragmented nal units
 */
 int h264_parse_nal_units(struct viddec_state *st, struct mbuf *src)
 {
 	struct h264_hdr h264_hdr;
-	const uint8_t nal_seq[3] = {0, 0, 1};
 	int err;
 	
+	if (!st->mb->end)
+		st->au_start = dec_now_us();
+
 	err = h264_hdr_decode(&h264_hdr, src);	
 	if (err)
 		return err;
 	
+	st->nal_open = false;
+	st->tid.skip = false;
+	
 	if (h264_hdr.f)
 		return EBADMSG;
 	
@@ -232,11 +634,9 @@ int h264_parse_nal_units(struct viddec_state *st, struct mbuf *src)
 			}
 		}
 
-		/* prepend H.264 NAL start sequence */
-		mbuf_write_mem(st->mb, nal_seq, 3);
-
-		/* encode NAL header back to buffer */
-		err = h264_hdr_encode(&h264_hdr, st->mb);
+		/* prepend H.264 NAL start sequence, the NAL header is copied with the payload */
+		err = au_write(st, nal_seq, sizeof(nal_seq));
+		--src->pos;
 	}
 	else if (H264_NAL_FU_A == h264_hdr.type) 
 	{
@@ -246,25 +646,36 @@ int h264_parse_nal_units(struct viddec_state *st, struct mbuf *src)
 		if (err)
 			return err;
 		h264_hdr.type = fu.type;
+		st->nal_open = !fu.e;
 
 		if (fu.s) 
-		{
-			/* prepend H.264 NAL start sequence */
-			mbuf_write_mem(st->mb, nal_seq, 3);
-			/* encode NAL header back to buffer */
-			err = h264_hdr_encode(&h264_hdr, st->mb);
-		}
+			err = au_nal_start(st, &h264_hdr);
+	}
+	else if (H264_NAL_STAP_A == h264_hdr.type) 
+	{
+		err = h264_stap_a_unpack(st, src);
 	}
 	else if (31 == h264_hdr.type) 
 	{
-		TL0D tl0d;
 		struct h264_hdr h264_hdr_STAP_A;
 
-		memset(&tl0d, 0, sizeof(tl0d));
-		h264_tl0d_decode(&tl0d, src->buf, src->pos);
+		//the TL0D header starts with the NAL header just read
+		err = h264_tl0d_parse(&st->tl0d, mbuf_buf(src) - 1, mbuf_get_left(src) + 1);
+		if (err)
+			return err;
 		
-		//advance reading position to skip PACSI header
-		src->pos = src->pos + TL0D_SIZE -1;
+		if (st->tl0d.SVCheader.temporalID > st->tid.seen_tid)
+			st->tid.seen_tid = st->tl0d.SVCheader.temporalID;
+		
+		//temporal layers above max_tid are not decoded, see tid_adapt()
+		if (st->tl0d.SVCheader.temporalID > st->tid.max_tid)
+		{
+			st->tid.skip = true;
+			src->pos = src->end;
+			return 0;
+		}
+		
+		src->pos += TL0D_SIZE - 1;
 
 		err = h264_hdr_decode(&h264_hdr_STAP_A, src);
 		if (err)
@@ -285,10 +696,31 @@ int h264_parse_nal_units(struct viddec_state *st, struct mbuf *src)
 				}
 			}
 			
-			/* prepend H.264 NAL start sequence */
-			mbuf_write_mem(st->mb, nal_seq, 3);
-			/* encode NAL header back to buffer */
-			err = h264_hdr_encode(&h264_hdr_STAP_A, st->mb);
+			/* prepend H.264 NAL start sequence, the NAL header is copied with the payload */
+			err = au_write(st, nal_seq, sizeof(nal_seq));
+			--src->pos;
+		}
+		else if (H264_NAL_STAP_A == h264_hdr_STAP_A.type)
+		{
+			err = h264_stap_a_unpack(st, src);
+		}
+		else if (H264_NAL_FU_A == h264_hdr_STAP_A.type)
+		{
+			struct fu fu;
+			
+			err = fu_hdr_decode(&fu, src);
+			if (err)
+				return err;
+			h264_hdr_STAP_A.type = fu.type;
+			st->nal_open = !fu.e;
+			
+			if (fu.s) 
+			{
+				if (!st->got_keyframe && (fu.type == H264_NAL_SPS || fu.type == H264_NAL_PPS))
+					st->got_keyframe = true;
+				
+				err = au_nal_start(st, &h264_hdr_STAP_A);
+			}
 		}
 	}
 	else 
@@ -301,17 +733,65 @@ int h264_parse_nal_units(struct viddec_state *st, struct mbuf *src)
 }
 
 
+/*
+ * Measures the decoder load once per window and moves the highest
+ * decoded temporal layer, called at the end of every access unit so the
+ * limit never changes within one
+ */
+static void tid_adapt(struct viddec_state *st)
+{
+	struct tid_adapt *ta = &st->tid;
+	uint64_t now = dec_now_us();
+	unsigned long long busy   = __atomic_load_n(&st->stats.busy, __ATOMIC_RELAXED);
+	unsigned long long frames = __atomic_load_n(&st->stats.n_frames, __ATOMIC_RELAXED);
+	uint64_t win;
+
+	if (!ta->win_start) {
+		ta->win_start  = now;
+		ta->win_busy   = busy;
+		ta->win_frames = frames;
+		return;
+	}
+
+	win = now - ta->win_start;
+	if (win < TID_WINDOW)
+		return;
+
+	ta->load = (uint32_t)((busy - ta->win_busy) * 100 / win);
+	ta->fps  = (uint32_t)((frames - ta->win_frames) * 1000000 / win);
+
+	ta->win_start  = now;
+	ta->win_busy   = busy;
+	ta->win_frames = frames;
+
+	if (!ta->enabled || ta->forced)
+		return;
+
+	if (ta->max_tid > ta->seen_tid)
+		ta->max_tid = ta->seen_tid;
+
+	if (ta->load > TID_LOAD_HIGH && ta->max_tid > 0) {
+		--ta->max_tid;
+		ta->last_change = now;
+		ta->n_down++;
+		debug("openh264: decoder load %u%%, decoding up to TID %u\n", ta->load, ta->max_tid);
+	}
+	else if (ta->load < TID_LOAD_LOW && ta->max_tid < ta->seen_tid &&
+		 now - ta->last_change >= TID_HOLD) {
+		++ta->max_tid;
+		ta->last_change = now;
+		ta->n_up++;
+		debug("openh264: decoder load %u%%, decoding up to TID %u\n", ta->load, ta->max_tid);
+	}
+}
+
+
 int openh264_decode(struct viddec_state *st, struct vidframe *frame,
 		bool eof, uint16_t seq, struct mbuf *src)
 {
 	int err;
 	
-	//For TL0 Mechanism
-	if(!src && seq == 0)
-	{
-		mbuf_rewind(st->mb);
-		return 0;
-	}
+	(void)seq;
 
 	if (!src)
 		return 0;
@@ -321,6 +801,86 @@ int openh264_decode(struct viddec_state *st, struct vidframe *frame,
 	if(err)
 		return err;
 	
-	return openh264_decoder_decode(st, frame, eof, src);
+	if (st->tid.skip)
+	{
+		if (eof)
+		{
+			st->tid.n_skipped++;
+			au_rewind(st);
+			tid_adapt(st);
+		}
+		
+		return 0;
+	}
+	
+	err = openh264_decoder_decode(st, frame, eof, src);
+	
+	if (eof)
+		tid_adapt(st);
+	
+	return err;
+}
+
+
+
+/*
+ * Decoder control from the TL0 receiver, replaces the skip signalling
+ * through empty packets
+ */
+int openh264_decode_ctrl(struct viddec_state *st, enum openh264_dec_ctrl ctrl)
+{
+	if (!st)
+		return EINVAL;
+
+	switch (ctrl)
+	{
+		case OPENH264_DEC_DISCARD:
+			au_rewind(st);
+			break;
+
+		case OPENH264_DEC_RESYNC:
+			/* the FIR answer starts with parameter sets */
+			au_rewind(st);
+			st->got_keyframe = false;
+			break;
+
+		default:
+			return EINVAL;
+	}
+
+	return 0;
 }
 
+
+/* prints the access unit reassembly counters of a decoder */
+int openh264_decoder_debug(struct re_printf *pf, const struct viddec_state *st)
+{
+	unsigned long long n_frames, lat_sum;
+	int err;
+
+	if (!st)
+		return 0;
+
+	n_frames = __atomic_load_n(&st->stats.n_frames, __ATOMIC_RELAXED);
+	lat_sum  = __atomic_load_n(&st->stats.lat_sum, __ATOMIC_RELAXED);
+
+	err = re_hprintf(pf, "openh264 decoder: AUs=%llu largest=%zu bytes"
+			  " buffer=%zu bytes copied=%llu reallocs=%u moved=%llu"
+			  " frames=%llu decode calls=%llu%s"
+			  " latency avg=%llu us max=%llu us\n",
+			  st->stats.n_au, st->stats.au_max, st->mb->size,
+			  st->stats.n_copied, st->stats.n_realloc, st->stats.n_moved,
+			  n_frames, __atomic_load_n(&st->stats.n_feed, __ATOMIC_RELAXED),
+			  st->low_latency ? " (low latency)" : "",
+			  n_frames ? lat_sum / n_frames : 0ULL,
+			  __atomic_load_n(&st->stats.lat_max, __ATOMIC_RELAXED));
+	err |= re_hprintf(pf, "openh264 decoder: max TID=%u%s load=%u%% fps=%u"
+			  " layers dropped=%u restored=%u AUs skipped=%llu busy=%llu us\n",
+			  st->tid.max_tid, st->tid.forced ? " (forced)" : "",
+			  st->tid.load, st->tid.fps, st->tid.n_down, st->tid.n_up,
+			  st->tid.n_skipped,
+			  __atomic_load_n(&st->stats.busy, __ATOMIC_RELAXED));
+	err |= dec_worker_debug(pf, st->worker);
+
+	return err;
+}
@@ -17,7 +17,6 @@
 #include <wels/codec_api.h>
 #include <wels/codec_app_def.h>
 
-#define	MIN_BUFFER_SIZE      16384
 #define SPATIAL_LAYER_NUM    1
 #define TEMPORAL_LAYER_NUM   3
 #define MAXIMUM_NAL_SIZE     1500
@@ -25,6 +24,15 @@
 
 enum { DEFAULT_GOP_SIZE = 120 };
 
+/* pacer and RTX defaults, overridden by openh264_pacing_* and openh264_rtx_* in the config */
+enum {
+	DEFAULT_PACING_FACTOR  = 250,	/* pacing rate in percent of the target bitrate */
+	DEFAULT_PACING_BURST   = 4,	/* bucket depth in packets */
+	DEFAULT_PACING_BUDGET  = 50,	/* an AU is spread over this percentage of the frame interval */
+	DEFAULT_PACING_BACKLOG = 8,	/* packets sent late before enhancement AUs are skipped */
+	DEFAULT_RTX_HISTORY    = 512,	/* base layer packets kept for retransmission */
+};
+
 
 
 struct videnc_state 
@@ -36,16 +44,16 @@ struct videnc_state
 
 	int64_t 	 pts;
 	uint32_t	 enc_input_size;
-	uint8_t		*enc_frame_whole;
-	uint32_t	 enc_frame_size;
-	uint32_t	 enc_processed;
-	int		 ilayer;
 
 	struct  vidsz encsize;
 	struct  videnc_param encprm;
 
-	struct mbuf *mb;
-	size_t  sz_max; /* todo: figure out proper buffer size */
+	struct tl0d_packetizer *tl0d;
+	struct pacer *pacer;
+	pthread_mutex_t rtx_lock;	/* hist, rtxh and rtx_arg, read by the RTCP thread */
+	struct tl0_hist *hist;
+	videnc_packet_h *rtxh;
+	void *rtx_arg;
 
 	struct 
 	{
@@ -69,7 +77,11 @@ static void destructor(void *arg)
 	if (st->SourcPict)
 		mem_deref(st->SourcPict);
 		
-	mem_deref(st->mb);
+	mem_deref(st->pacer);
+	mem_deref(st->hist);
+	mem_deref(st->tl0d);
+
+	pthread_mutex_destroy(&st->rtx_lock);
 }
 
 
@@ -89,7 +101,7 @@ int decode_sdpparam_h264(struct videnc_state *st, const struct pl *name,
 	{
 		st->h264.packetization_mode = pl_u32(val);
 
-		if (st->h264.packetization_mode != 0) 
+		if (st->h264.packetization_mode > 1) 
 		{
 			warning("avcodec: illegal packetization-mode %u\n",
 				st->h264.packetization_mode);
@@ -123,6 +135,20 @@ int decode_sdpparam_h264(struct videnc_state *st, const struct pl *name,
 }
 
 
+/*
+ * Largest NAL unit the encoder may produce. In packetization-mode 0 a NAL
+ * unit cannot be fragmented, so every slice has to fit into one packet
+ * behind the TL0D header.
+ */
+static uint32_t openh264_max_nal_size(const struct videnc_state *st, const struct videnc_param *encparam)
+{
+	if (st->h264.packetization_mode == 0 && encparam->pktsize > TL0D_SIZE)
+		return min(encparam->pktsize - TL0D_SIZE, MAXIMUM_NAL_SIZE);
+
+	return MAXIMUM_NAL_SIZE;
+}
+
+
 /* Init encoder parameters
 	//this should be initialized in video.c when calling video_encoder_set
 	//encparam->full_frame = true; 
@@ -130,6 +156,7 @@ int decode_sdpparam_h264(struct videnc_state *st, const struct pl *name,
 */
 static int openh264_set_encoder_params(struct videnc_state *st, const struct videnc_param *encparam, const struct vidsz *encsize)
 {
+	uint32_t max_nal_size = openh264_max_nal_size(st, encparam);
 	int i;
 
 	st->param = (SEncParamExt){ 0 };
@@ -172,6 +199,7 @@ static int openh264_set_encoder_params(struct videnc_state *st, const struct vid
 		//since uiMaxNalSize != 0 then uiSliceMod = SM_DYN_SLICE
 		Layer->sSliceCfg.uiSliceMode 		   = SM_DYN_SLICE ; //SM_SINGLE_SLICE; 
 		Layer->sSliceCfg.sSliceArgument.uiSliceNum = 1;
+		Layer->sSliceCfg.sSliceArgument.uiSliceSizeConstraint = max_nal_size;
 	}
 
 
@@ -200,7 +228,7 @@ static int openh264_set_encoder_params(struct videnc_state *st, const struct vid
 	//the minimum QP encoder supports
 	//st->param.iMinQp			 = ;
 	// the maximum NAL size, should be not 0 for dynamic slice mode
-	st->param.uiMaxNalSize			 = MAXIMUM_NAL_SIZE;
+	st->param.uiMaxNalSize			 = max_nal_size;
 
 
 	/* LTR (Long Term Reference) settings */
@@ -312,9 +340,121 @@ static int openh264_encoder_open(struct videnc_state *st, const struct videnc_pa
 }
 
 
+/*
+ * (Re)creates the packet pacer if openh264_pacing is enabled in the config,
+ * the pacing rate follows the target bitrate and the budget of an access
+ * unit follows the frame interval. Pacing runs on the encoding thread.
+ */
+static int openh264_pacer_update(struct videnc_state *st, const struct videnc_param *prm)
+{
+	uint32_t factor = DEFAULT_PACING_FACTOR;
+	uint32_t burst  = DEFAULT_PACING_BURST * prm->pktsize;
+	uint32_t budget = DEFAULT_PACING_BUDGET;
+	uint32_t backlog = DEFAULT_PACING_BACKLOG;
+	uint32_t rate;
+	bool enable = false;
+	int err;
+
+	(void)conf_get_bool(conf_cur(), "openh264_pacing", &enable);
+	if (!enable)
+		return 0;
+
+	(void)conf_get_u32(conf_cur(), "openh264_pacing_factor", &factor);
+	(void)conf_get_u32(conf_cur(), "openh264_pacing_burst", &burst);
+	(void)conf_get_u32(conf_cur(), "openh264_pacing_budget", &budget);
+	(void)conf_get_u32(conf_cur(), "openh264_pacing_backlog", &backlog);
+
+	rate = (uint32_t)((uint64_t)prm->bitrate / 8 * factor / 100);
+
+	//[us], the encoder has to keep up with the frame rate
+	budget = min(budget, 90) * 10000 / (prm->fps ? prm->fps : 30);
+
+	if (st->pacer && st->encprm.pktsize == prm->pktsize)
+	{
+		pacer_set_rate(st->pacer, rate, budget);
+		return 0;
+	}
+
+	st->tl0d->pacer = NULL;
+	st->pacer = mem_deref(st->pacer);
+
+	err = pacer_alloc(&st->pacer, rate, burst, budget, backlog * prm->pktsize, prm->pktsize);
+	if (err)
+	{
+		warning("openh264_encoder: could not allocate pacer (%m)\n", err);
+		return err;
+	}
+
+	st->tl0d->pacer = st->pacer;
+
+	debug("openh264_encoder: pacing at %u bytes/s, burst %u bytes, %u us per access unit\n",
+	      rate, burst, budget);
+
+	return 0;
+}
+
+
+/*
+ * Replaces the base layer history. openh264_encoder_rtcp() holds its own
+ * reference while it resends, so the old one is released outside the lock.
+ */
+static void openh264_rtx_swap(struct videnc_state *st, struct tl0_hist *hist)
+{
+	struct tl0_hist *old;
+
+	pthread_mutex_lock(&st->rtx_lock);
+	old = st->hist;
+	st->hist = hist;
+	pthread_mutex_unlock(&st->rtx_lock);
+
+	st->tl0d->hist = hist;
+	mem_deref(old);
+}
+
+/*
+ * (Re)creates the base layer history if openh264_rtx is enabled in the
+ * config and the video layer registered an RTX sender, NACKed TL0 packets
+ * are then resent through it. Without a sender the history is released.
+ */
+static int openh264_rtx_update(struct videnc_state *st, const struct videnc_param *prm)
+{
+	struct tl0_hist *hist = NULL;
+	uint32_t size = DEFAULT_RTX_HISTORY;
+	bool enable = false;
+	int err;
+
+	(void)conf_get_bool(conf_cur(), "openh264_rtx", &enable);
+	if (!enable || !st->rtxh)
+	{
+		openh264_rtx_swap(st, NULL);
+		return 0;
+	}
+
+	if (st->hist && st->encprm.pktsize == prm->pktsize)
+		return 0;
+
+	(void)conf_get_u32(conf_cur(), "openh264_rtx_history", &size);
+
+	err = tl0_hist_alloc(&hist, size, prm->pktsize);
+
+	openh264_rtx_swap(st, hist);
+
+	if (err)
+	{
+		warning("openh264_encoder: could not allocate RTX history (%m)\n", err);
+		return err;
+	}
+
+	debug("openh264_encoder: keeping %u base layer packets for RTX\n", size);
+
+	return 0;
+}
+
+
 int openh264_encoder_update(struct videnc_state **vesp, const struct vidcodec *vc, struct videnc_param *prm, const char *fmtp)
 {
 	struct videnc_state *st;
+	uint32_t pmode;
 	int err = 0;
 
 	if (!vesp || !vc || !prm)
@@ -327,6 +467,8 @@ int openh264_encoder_update(struct videnc_state **vesp, const struct vidcodec *v
 		st = mem_zalloc(sizeof(*st), destructor);
 		if (!st)
 			return ENOMEM;
+
+		pthread_mutex_init(&st->rtx_lock, NULL);
 			
 		st->SourcPict = mem_zalloc(sizeof(*st->SourcPict), NULL);
 		if (!st->SourcPict)
@@ -335,12 +477,9 @@ int openh264_encoder_update(struct videnc_state **vesp, const struct vidcodec *v
 			goto out;
 		}
 		
-		st->mb  = mbuf_alloc(MIN_BUFFER_SIZE * 20);
-		if (!st->mb)
-		{
-			err = ENOMEM;
+		err = tl0d_packetizer_alloc(&st->tl0d);
+		if (err)
 			goto out;
-		}
 	}
 	//else close the encoder and initialize to NULL if params have changed
 	else
@@ -352,9 +491,14 @@ int openh264_encoder_update(struct videnc_state **vesp, const struct vidcodec *v
 			st->encoder = NULL;
 		} 
 	}
+	//without a pacer the packets are sent unpaced
+	(void)openh264_pacer_update(st, prm);
+	(void)openh264_rtx_update(st, prm);
+
 	//set parameters
 	st->encprm = *prm;
-	st->sz_max = st->mb->size;
+
+	pmode = st->h264.packetization_mode;
 
 	if (str_isset(fmtp)) 
 	{
@@ -364,6 +508,13 @@ int openh264_encoder_update(struct videnc_state **vesp, const struct vidcodec *v
 		fmt_param_apply(&sdp_fmtp, param_handler, st);
 	}
 
+	//the slice size limit depends on the packetization mode
+	if (st->encoder && st->h264.packetization_mode != pmode)
+	{
+		WelsDestroySVCEncoder(st->encoder);
+		st->encoder = NULL;
+	}
+
 	debug("openh264_codec: video encoder %s: %d fps, %d bit/s, pktsize=%u\n",
 	      vc->name, prm->fps, prm->bitrate, prm->pktsize);
 	      
@@ -376,6 +527,92 @@ int openh264_encoder_update(struct videnc_state **vesp, const struct vidcodec *v
 	return err;
 }
 
+/* prints the packetizer and pacer counters of an encoder */
+int openh264_encoder_debug(struct re_printf *pf, const struct videnc_state *st)
+{
+	int err;
+
+	if (!st)
+		return 0;
+
+	err  = h264_tl0d_debug(pf, st->tl0d);
+	err |= pacer_debug(pf, st->pacer);
+	err |= tl0_hist_debug(pf, st->hist);
+
+	return err;
+}
+
+/*
+ * A transport that can send a whole access unit at once (sendmmsg, GSO)
+ * registers its batch handler here, packets then bypass the per packet
+ * handler passed to openh264_encode
+ */
+void openh264_encoder_set_batch(struct videnc_state *st, videnc_batch_h *batchh, void *arg)
+{
+	if (!st)
+		return;
+
+	h264_tl0d_set_batch(st->tl0d, batchh, arg);
+}
+
+/*
+ * Sets the handler for retransmissions, called with the RTX payload
+ * (original sequence number and payload). The transport sends it with the
+ * RTX payload type and SSRC. The base layer history is only kept while a
+ * handler is set; set it after openh264_encoder_update(), from the thread
+ * that encodes or before the first frame.
+ */
+void openh264_encoder_set_rtx(struct videnc_state *st, videnc_packet_h *rtxh, void *arg)
+{
+	if (!st)
+		return;
+
+	pthread_mutex_lock(&st->rtx_lock);
+	st->rtxh = rtxh;
+	st->rtx_arg = arg;
+	pthread_mutex_unlock(&st->rtx_lock);
+
+	(void)openh264_rtx_update(st, &st->encprm);
+}
+
+/*
+ * Handles RTCP feedback for the encoded stream, Generic NACKs are
+ * answered from the base layer history. The vidcodec interface has no
+ * RTCP hook, the video layer calls this from the RTCP handler of its
+ * stream; that may be another thread than the encoding one.
+ */
+int openh264_encoder_rtcp(struct videnc_state *st, const struct rtcp_msg *msg)
+{
+	struct tl0_hist *hist;
+	videnc_packet_h *rtxh;
+	void *rtx_arg;
+	uint32_t i;
+	int err = 0;
+
+	if (!st || !msg)
+		return EINVAL;
+
+	if (msg->hdr.pt != RTCP_RTPFB || msg->hdr.count != RTCP_RTPFB_GNACK)
+		return 0;
+
+	//the encoding thread may replace the history meanwhile
+	pthread_mutex_lock(&st->rtx_lock);
+	hist    = mem_ref(st->hist);
+	rtxh    = st->rtxh;
+	rtx_arg = st->rtx_arg;
+	pthread_mutex_unlock(&st->rtx_lock);
+
+	for (i = 0; hist && rtxh && i < msg->r.fb.n; i++) {
+		const struct gnack *fci = &msg->r.fb.fci.gnackv[i];
+
+		err |= tl0_hist_resend(hist, fci->pid, fci->blp, rtxh, rtx_arg);
+	}
+
+	mem_deref(hist);
+
+	return err;
+}
+
 /*
 *Input:
 *	Pointer NalUnit points at the begnning of a nal unit start code
@@ -474,6 +711,51 @@ static void openh264_BitStreamInfo(SFrameBSInfo *BitStreamInfo)
 	re_printf("\n\n");
 }
 
+/*
+ * Fills the NAL unit table straight from the NAL lengths reported by the
+ * encoder, the bitstream is neither copied nor scanned for start codes
+*/
+static int openh264_BitStreamInfo_nalus(H264Info *h264Info, const SFrameBSInfo *BitStreamInfo)
+{
+	int i;
+	int err = 0;
+	
+	h264Info->numNALUs = 0;
+	
+	for (i = 0; i < BitStreamInfo->iLayerNum; i++) 
+	{
+		const SLayerBSInfo *Layer = &BitStreamInfo->sLayerInfo[i];
+		uint8_t *bitstream = Layer->pBsBuf;
+		int inal;
+		
+		for(inal = 0; inal < Layer->iNalCount; inal++)
+		{
+			int nalLength, startCodeLength;
+			
+			nalLength = Layer->pNalLengthInByte[inal];
+			//bitstream points at the nal start code
+			startCodeLength = find_start_code_length(bitstream);
+			if(!startCodeLength || nalLength <= startCodeLength)
+			{
+				warning("openh264_encode: malformed NAL unit in layer %d\n", i);
+				return EBADMSG;
+			}
+			
+			err = h264_tl0d_nalu_add(h264Info, bitstream + startCodeLength, nalLength - startCodeLength);
+			if(err)
+				return err;
+			
+			//temporal id as reported by the encoder for the whole layer
+			h264Info->nalu[h264Info->numNALUs - 1].SVCheader.temporalID = Layer->uiTemporalId;
+			
+			//bitstream points at next nalus start code 
+			bitstream += nalLength;
+		}
+	}
+	
+	return err;
+}
+
 //For TL0 Mechanism
 void update_tl0_pic_idx(void *arg1, void *arg2)
 {
@@ -518,8 +800,6 @@ void update_tl0_pic_idx(void *arg1, void *arg2)
 int openh264_encode(struct videnc_state *st, bool update, const struct vidframe *frame, videnc_packet_h *pkth, void *arg)
 {
 	int i, err, ret;
-	SLayerBSInfo* pLayerBsInfo;
-	unsigned int payload_size = 0;
 
 	if (!st || !frame || !pkth || frame->fmt != VID_FMT_YUV420P)
 			return EINVAL;
@@ -548,7 +828,6 @@ int openh264_encode(struct videnc_state *st, bool update, const struct vidframe
 		(*st->encoder)->ForceIntraFrame(st->encoder, true);
 	}
 
-	mbuf_rewind(st->mb);
 	st->BitStreamInfo = (SFrameBSInfo){ 0 };
 	
 	//encode frame
@@ -565,41 +844,23 @@ int openh264_encode(struct videnc_state *st, bool update, const struct vidframe
 		return 0;
 	}
 
-	st->ilayer = 0;
-	st->enc_frame_size = 0;
-	st->enc_processed = 0;
+	//Normal frames have one single layer, IDR frames have two layers: 
+	//the first layer contains the SPS/PPS.
+	err = openh264_BitStreamInfo_nalus(&st->tl0d->h264Info, &st->BitStreamInfo);
+	if(err)
+		return err;
 
-	if (true) 
+	//openh264_BitStreamInfo(&st->BitStreamInfo);
+	
+	//For TL0 Mechanism
+	update_tl0_pic_idx(&st->BitStreamInfo, arg);
+	
+	err = h264_tl0d_send_au(st->tl0d, st->encprm.pktsize, st->h264.packetization_mode, pkth, arg);
+	if (err == EAGAIN)
 	{
-		//Normal frames have one single layer, IDR frames have two layers: 
-		//the first layer contains the SPS/PPS.
-		st->ilayer = 0;
-		pLayerBsInfo = &st->BitStreamInfo.sLayerInfo[st->ilayer];
-		if (!pLayerBsInfo) 
-			return 0;
-					
-		for (i = st->ilayer;  i < st->BitStreamInfo.iLayerNum; i++) 
-		{
-			int j;
-			payload_size = 0;
-			pLayerBsInfo = &st->BitStreamInfo.sLayerInfo[i];
-			for (j=0; j < pLayerBsInfo->iNalCount; j++)
-				payload_size += pLayerBsInfo->pNalLengthInByte[j];
-
-			err = mbuf_write_mem(st->mb, pLayerBsInfo->pBsBuf, payload_size);
-			if(err)
-			{
-				warning("openh264_encode: can not copy to memory: %m\n", err);
-				return err;
-			}
-		}
-
-		//openh264_BitStreamInfo(&st->BitStreamInfo);
-		
-		//For TL0 Mechanism
-		update_tl0_pic_idx(&st->BitStreamInfo, arg);
-		
-		err = h264_tl0d_packetize(st->mb, st->encprm.pktsize, pkth, arg);
+		debug("openh264: enhancement frame skipped\n");
+		return 0;
 	}
+	
 	return err;
 }
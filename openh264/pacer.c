@@ -0,0 +1,340 @@
+/**
+ * @file pacer.c  Token bucket packet pacer between the packetizers and the transport
+ *
+ * Packets are paced on the thread that hands them over, the encoder's.
+ * The packet handler and the per-stream send state behind its argument
+ * are only ever used from that thread, in the same order as get_seq()
+ * and set_tl0() of the packetizer. An access unit holds up its caller
+ * for at most the budget, packets that do not fit in it are sent back
+ * to back. While the bucket owes more than the backlog for them,
+ * pacer_admit() turns away enhancement layer access units.
+ *
+ * Copyright (C) 2015 SeNSE Project
+ */
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "h264_packetize.h"
+#include "openh264_codec.h"
+
+
+struct pacer
+{
+	pthread_mutex_t mutex;	/* rate, budget and stats, read and set from other threads */
+
+	uint32_t rate;		/* bytes per second */
+	uint32_t burst;		/* bucket depth in bytes */
+	uint32_t budget;	/* [us] an access unit may hold up the caller */
+	uint32_t backlog;	/* bytes the bucket may owe before AUs are refused */
+	double tokens;
+	uint64_t last;		/* last token refill in [us] */
+
+	size_t pktsize;
+
+	struct pacer_stats stats;
+};
+
+
+static uint64_t pacer_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static void pacer_refill(struct pacer *p, uint32_t rate, uint64_t now)
+{
+	p->tokens += (double)(now - p->last) * rate / 1000000.0;
+	if (p->tokens > p->burst)
+		p->tokens = p->burst;
+
+	p->last = now;
+}
+
+
+static void pacer_sleep(uint64_t us)
+{
+	struct timespec ts;
+
+	ts.tv_sec  = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+
+static void destructor(void *arg)
+{
+	struct pacer *p = arg;
+
+	pthread_mutex_destroy(&p->mutex);
+}
+
+
+/*
+ * Allocates a pacer
+ *
+ * rate:    pacing rate in bytes per second
+ * burst:   bucket depth in bytes, sent back to back at line rate
+ * budget:  time in [us] one access unit may be spread over
+ * backlog: bytes sent late the bucket may owe before pacer_admit() refuses
+ * pktsize: largest payload handed to pacer_send()
+ */
+int pacer_alloc(struct pacer **pp, uint32_t rate, uint32_t burst,
+		uint32_t budget, uint32_t backlog, size_t pktsize)
+{
+	struct pacer *p;
+
+	if (!pp || !rate || !pktsize)
+		return EINVAL;
+
+	p = mem_zalloc(sizeof(*p), destructor);
+	if (!p)
+		return ENOMEM;
+
+	pthread_mutex_init(&p->mutex, NULL);
+
+	p->rate    = rate;
+	p->burst   = burst > pktsize ? burst : pktsize;
+	p->budget  = budget;
+	p->backlog = backlog;
+	p->tokens  = p->burst;
+	p->last    = pacer_now();
+	p->pktsize = pktsize;
+
+	*pp = p;
+
+	return 0;
+}
+
+
+void pacer_set_rate(struct pacer *p, uint32_t rate, uint32_t budget)
+{
+	if (!p || !rate)
+		return;
+
+	pthread_mutex_lock(&p->mutex);
+	p->rate   = rate;
+	p->budget = budget;
+	pthread_mutex_unlock(&p->mutex);
+}
+
+
+/*
+ * Tells whether the next access unit is to be sent. A base layer AU
+ * always is, an enhancement AU only while the late packets of earlier
+ * AUs have not put the bucket deeper in debt than the backlog.
+ */
+bool pacer_admit(struct pacer *p, bool base)
+{
+	uint32_t rate;
+	bool admit;
+
+	if (!p)
+		return true;
+
+	pthread_mutex_lock(&p->mutex);
+	rate = p->rate;
+	pthread_mutex_unlock(&p->mutex);
+
+	pacer_refill(p, rate, pacer_now());
+
+	admit = base || p->tokens >= -(double)p->backlog;
+
+	if (!admit) {
+		pthread_mutex_lock(&p->mutex);
+		p->stats.n_refused++;
+		pthread_mutex_unlock(&p->mutex);
+	}
+
+	return admit;
+}
+
+
+/*
+ * Spreads the packets of an access unit at the pacing rate, passing each
+ * to pkth, or with batchh every run of packets sent without a pause in
+ * one call before the pacer sleeps.
+ */
+static int pacer_pace(struct pacer *p, const struct videnc_pkt *pktv,
+		      size_t pktc, videnc_packet_h *pkth,
+		      videnc_batch_h *batchh, void *arg)
+{
+	struct pacer_stats st;
+	uint64_t start, now, deadline;
+	uint32_t rate;
+	size_t i, first = 0;
+	int err = 0;
+
+	for (i = 0; i < pktc; i++) {
+		if (pktv[i].pld_len > p->pktsize)
+			return EMSGSIZE;
+	}
+
+	pthread_mutex_lock(&p->mutex);
+	rate     = p->rate;
+	deadline = p->budget;
+	pthread_mutex_unlock(&p->mutex);
+
+	memset(&st, 0, sizeof(st));
+
+	start    = pacer_now();
+	deadline += start;
+
+	for (i = 0; i < pktc; i++) {
+		const struct videnc_pkt *pkt = &pktv[i];
+		uint64_t delay;
+
+		now = pacer_now();
+		pacer_refill(p, rate, now);
+
+		/* the bucket may go into debt by one packet */
+		if (p->tokens <= 0 && now < deadline) {
+
+			/* the run so far leaves before the pause, not after it */
+			if (batchh && i > first) {
+				err |= batchh(pktv + first, i - first, arg);
+				first = i;
+
+				now = pacer_now();
+				pacer_refill(p, rate, now);
+			}
+
+			if (p->tokens <= 0 && now < deadline) {
+				delay = (uint64_t)(-p->tokens * 1000000.0 / rate) + 1;
+				pacer_sleep(min(delay, deadline - now));
+
+				now = pacer_now();
+				pacer_refill(p, rate, now);
+			}
+		}
+
+		if (p->tokens <= 0)
+			st.n_late++;
+
+		p->tokens -= pkt->hdr_len + pkt->pld_len;
+
+		delay = now - start;
+		st.delay_sum += delay;
+		if (delay > st.delay_max)
+			st.delay_max = delay;
+		st.n_pkt++;
+		st.n_bytes += pkt->hdr_len + pkt->pld_len;
+
+		if (pkth)
+			err |= pkth(pkt->marker, pkt->hdr, pkt->hdr_len,
+				    pkt->pld, pkt->pld_len, arg);
+	}
+
+	if (batchh && pktc > first)
+		err |= batchh(pktv + first, pktc - first, arg);
+
+	pthread_mutex_lock(&p->mutex);
+	p->stats.n_pkt     += st.n_pkt;
+	p->stats.n_bytes   += st.n_bytes;
+	p->stats.delay_sum += st.delay_sum;
+	p->stats.n_late    += st.n_late;
+	if (st.delay_max > p->stats.delay_max)
+		p->stats.delay_max = st.delay_max;
+	pthread_mutex_unlock(&p->mutex);
+
+	return err;
+}
+
+
+/*
+ * Sends the packets of an access unit through pkth, spread at the pacing
+ * rate. Returns when the last packet has been passed to pkth, at the
+ * latest after the budget plus the time pkth takes.
+ */
+int pacer_send_batch(struct pacer *p, const struct videnc_pkt *pktv,
+		     size_t pktc, videnc_packet_h *pkth, void *arg)
+{
+	if (!p || !pktv || !pkth)
+		return EINVAL;
+
+	return pacer_pace(p, pktv, pktc, pkth, NULL, arg);
+}
+
+
+/*
+ * Paces an access unit for a batching transport. The packets the bucket
+ * lets through back to back are passed to batchh in one call, so a batch
+ * is split where the pacer has to wait. Without a pacer the whole batch
+ * goes to batchh at once.
+ */
+int pacer_send_chunks(struct pacer *p, const struct videnc_pkt *pktv,
+		      size_t pktc, videnc_batch_h *batchh, void *arg)
+{
+	if (!pktv || !batchh)
+		return EINVAL;
+
+	if (!p)
+		return batchh(pktv, pktc, arg);
+
+	return pacer_pace(p, pktv, pktc, NULL, batchh, arg);
+}
+
+
+/* Sends one packet, paced like a batch of one */
+int pacer_send(struct pacer *p, bool marker,
+	       const uint8_t *hdr, size_t hdr_len,
+	       const uint8_t *pld, size_t pld_len,
+	       videnc_packet_h *pkth, void *arg)
+{
+	struct videnc_pkt pkt;
+
+	pkt.marker  = marker;
+	pkt.hdr     = hdr;
+	pkt.hdr_len = hdr_len;
+	pkt.pld     = pld;
+	pkt.pld_len = pld_len;
+
+	return pacer_send_batch(p, &pkt, 1, pkth, arg);
+}
+
+
+void pacer_stats(struct pacer *p, struct pacer_stats *stats)
+{
+	if (!p || !stats)
+		return;
+
+	pthread_mutex_lock(&p->mutex);
+	*stats = p->stats;
+	pthread_mutex_unlock(&p->mutex);
+}
+
+
+int pacer_debug(struct re_printf *pf, struct pacer *p)
+{
+	struct pacer_stats stats;
+	uint32_t rate, budget;
+
+	if (!p)
+		return 0;
+
+	/* pacer_set_rate() may change the rate from another thread */
+	pthread_mutex_lock(&p->mutex);
+	stats  = p->stats;
+	rate   = p->rate;
+	budget = p->budget;
+	pthread_mutex_unlock(&p->mutex);
+
+	return re_hprintf(pf, "pacer: rate=%u B/s burst=%u budget=%u us"
+			  " backlog=%u B packets=%llu bytes=%llu"
+			  " delay avg=%llu us max=%llu us late=%llu"
+			  " refused AUs=%llu\n",
+			  rate, p->burst, budget, p->backlog,
+			  stats.n_pkt, stats.n_bytes,
+			  stats.n_pkt ? stats.delay_sum / stats.n_pkt : 0ULL,
+			  stats.delay_max, stats.n_late, stats.n_refused);
+}
@@ -0,0 +1,219 @@
+/**
+ * @file tl0_history.c  Sender history of base layer packets for RTX - RFC 4588
+ *
+ * Packets are stored by the encoding thread and resent from the thread
+ * that receives RTCP. A slot is copied under the lock on both sides, the
+ * RTX handler is called outside of it with a private copy.
+ *
+ * Copyright (C) 2015 SeNSE Project
+ */
+#include <re.h>
+#include <rem.h>
+#include <baresip.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "h264_packetize.h"
+#include "openh264_codec.h"
+
+
+/* RTX payload header: original sequence number */
+#define RTX_OSN_SIZE 2
+
+/* largest packet header stored (TL0D + FU-A) */
+#define TL0_HIST_HDR_SIZE 16
+
+
+struct tl0_hist_pkt
+{
+	uint16_t seq;
+	bool valid;
+	bool marker;
+	size_t hdr_len;
+	size_t pld_len;
+	uint8_t *buf;		/* OSN, header, payload; points into hist->buf */
+};
+
+
+/*
+ * Direct mapped by RTP sequence number, a newer packet overwrites the slot
+ * of the packet size sequence numbers before it
+ */
+struct tl0_hist
+{
+	pthread_mutex_t mutex;	/* slots and stats */
+	struct tl0_hist_pkt *slotv;
+	uint8_t *buf;
+	uint32_t size;
+	size_t pktsize;
+	uint8_t *rtx;		/* copy of the slot being resent, resend side only */
+
+	struct tl0_hist_stats stats;
+};
+
+
+static void destructor(void *arg)
+{
+	struct tl0_hist *h = arg;
+
+	mem_deref(h->slotv);
+	mem_deref(h->buf);
+	mem_deref(h->rtx);
+	pthread_mutex_destroy(&h->mutex);
+}
+
+
+/*
+ * Allocates a history of size packets of up to pktsize payload bytes
+ */
+int tl0_hist_alloc(struct tl0_hist **hp, uint32_t size, size_t pktsize)
+{
+	struct tl0_hist *h;
+	size_t slotsz = RTX_OSN_SIZE + TL0_HIST_HDR_SIZE + pktsize;
+	uint32_t i;
+	int err = 0;
+
+	if (!hp || !size || !pktsize)
+		return EINVAL;
+
+	h = mem_zalloc(sizeof(*h), destructor);
+	if (!h)
+		return ENOMEM;
+
+	pthread_mutex_init(&h->mutex, NULL);
+
+	h->size    = size;
+	h->pktsize = pktsize;
+
+	h->slotv = mem_zalloc(size * sizeof(*h->slotv), NULL);
+	h->buf   = mem_alloc(size * slotsz, NULL);
+	h->rtx   = mem_alloc(slotsz, NULL);
+	if (!h->slotv || !h->buf || !h->rtx) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < size; i++)
+		h->slotv[i].buf = h->buf + i * slotsz;
+
+ out:
+	if (err)
+		mem_deref(h);
+	else
+		*hp = h;
+
+	return err;
+}
+
+
+/* stores a copy of one sent packet */
+void tl0_hist_put(struct tl0_hist *h, uint16_t seq, bool marker,
+		  const uint8_t *hdr, size_t hdr_len,
+		  const uint8_t *pld, size_t pld_len)
+{
+	struct tl0_hist_pkt *pkt;
+
+	if (!h)
+		return;
+
+	pthread_mutex_lock(&h->mutex);
+
+	if (hdr_len > TL0_HIST_HDR_SIZE || pld_len > h->pktsize) {
+		h->stats.n_toobig++;
+		goto out;
+	}
+
+	pkt = &h->slotv[seq % h->size];
+
+	pkt->seq     = seq;
+	pkt->valid   = true;
+	pkt->marker  = marker;
+	pkt->hdr_len = hdr_len;
+	pkt->pld_len = pld_len;
+	memcpy(pkt->buf + RTX_OSN_SIZE, hdr, hdr_len);
+	memcpy(pkt->buf + RTX_OSN_SIZE + hdr_len, pld, pld_len);
+
+	h->stats.n_stored++;
+
+ out:
+	pthread_mutex_unlock(&h->mutex);
+}
+
+
+static int tl0_hist_resend_seq(struct tl0_hist *h, uint16_t seq,
+			       videnc_packet_h *rtxh, void *arg)
+{
+	const struct tl0_hist_pkt *pkt;
+	size_t hdr_len, pld_len;
+	bool marker;
+
+	pthread_mutex_lock(&h->mutex);
+
+	pkt = &h->slotv[seq % h->size];
+
+	if (!pkt->valid || pkt->seq != seq) {
+		h->stats.n_miss++;
+		pthread_mutex_unlock(&h->mutex);
+		return 0;
+	}
+
+	marker  = pkt->marker;
+	hdr_len = pkt->hdr_len;
+	pld_len = pkt->pld_len;
+	memcpy(h->rtx + RTX_OSN_SIZE, pkt->buf + RTX_OSN_SIZE, hdr_len + pld_len);
+
+	h->stats.n_resent++;
+
+	pthread_mutex_unlock(&h->mutex);
+
+	h->rtx[0] = seq >> 8;
+	h->rtx[1] = seq & 0xff;
+
+	return rtxh(marker, h->rtx, RTX_OSN_SIZE + hdr_len,
+		    h->rtx + RTX_OSN_SIZE + hdr_len, pld_len, arg);
+}
+
+
+/*
+ * Resends the packets of one Generic NACK FCI (RFC 4585) as RTX payloads,
+ * the original sequence number followed by the original payload.
+ * Sequence numbers that are not in the history are skipped, these were
+ * not base layer packets or are too old. Resends are made from one
+ * thread at a time, which may be another one than the encoding thread.
+ */
+int tl0_hist_resend(struct tl0_hist *h, uint16_t pid, uint16_t blp,
+		    videnc_packet_h *rtxh, void *arg)
+{
+	int i, err;
+
+	if (!h || !rtxh)
+		return EINVAL;
+
+	err = tl0_hist_resend_seq(h, pid, rtxh, arg);
+
+	for (i = 0; i < 16; i++) {
+		if (blp & (1 << i))
+			err |= tl0_hist_resend_seq(h, pid + i + 1, rtxh, arg);
+	}
+
+	return err;
+}
+
+
+int tl0_hist_debug(struct re_printf *pf, struct tl0_hist *h)
+{
+	struct tl0_hist_stats stats;
+
+	if (!h)
+		return 0;
+
+	pthread_mutex_lock(&h->mutex);
+	stats = h->stats;
+	pthread_mutex_unlock(&h->mutex);
+
+	return re_hprintf(pf, "tl0 history: size=%u stored=%llu resent=%llu"
+			  " missed=%llu too big=%llu\n",
+			  h->size, stats.n_stored, stats.n_resent,
+			  stats.n_miss, stats.n_toobig);
+}
@@ -0,0 +1,403 @@
+/**
+ * @file batch_bench.c  Per-packet versus batched hand-off into a local UDP sink
+ *
+ * A generated temporally layered stream is packetized by the TL0D
+ * packetizer and sent over loopback UDP to a sink thread, once with the
+ * per-packet handler and one sendmsg() per packet, once with the batch
+ * handler and one sendmmsg() per access unit. Packets per second are
+ * given per core of the sending thread. A last, shorter run paces the
+ * batches at 32 Mbit/s with an access unit every 5 ms, which the TL0 AUs
+ * exceed: every packet has to pass the pacer, and batches are split into
+ * one sendmmsg() per run of packets sent back to back.
+ *
+ *   batch_bench [access units]
+ *
+ * Copyright (C) 2015 SeNSE Project
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <re.h>
+#include <baresip.h>
+#include "h264_packetize.h"
+#include "h264_tl0d.h"
+#include "openh264_codec.h"
+#include "stub.h"
+
+
+enum {
+	DEFAULT_AUS     = 20000,
+	PKTSIZE         = 1200,
+	RTP_HDR         = 12,
+	AU_SLICES       = 4,
+	TEMPORAL_LAYERS = 3,
+	PACED_AUS       = 200,
+	PACED_RATE      = 4000000,	/* bytes/s */
+	PACED_BUDGET    = 3000,		/* us */
+	PACED_FRAME_US  = 5000,
+};
+
+/* bytes of one slice per temporal ID, about 2 Mbit/s at 30 fps */
+static const size_t slice_size[3] = {4000, 1800, 900};
+static const uint8_t tid_pattern[4] = {0, 2, 1, 2};
+
+
+struct sink
+{
+	int fd;
+	volatile bool stop;
+	volatile unsigned long long n_pkt;	/* read by the sender after a pause */
+};
+
+struct sender
+{
+	int fd;
+	uint16_t seq;
+	uint8_t tl0;
+	bool tl0_au;
+	unsigned long long n_pkt;
+	unsigned long long n_batch;	/* batch handler calls */
+	unsigned long long n_err;
+};
+
+
+/* TL0 mechanism hooks of video.c */
+void get_tl0_pic_idx(bool *dup, bool *idr, uint8_t *tl0, void *arg)
+{
+	struct sender *s = arg;
+
+	if (s->tl0_au)
+		++s->tl0;
+
+	*dup = s->tl0_au;
+	*idr = false;
+	*tl0 = s->tl0;
+}
+
+
+void set_tl0(bool dup, bool idr, int x, uint16_t fsn, uint16_t lsn, void *arg)
+{
+}
+
+
+void get_seq(uint16_t *seq, void *arg)
+{
+	const struct sender *s = arg;
+
+	*seq = s->seq;
+}
+
+
+static void rtp_hdr_write(uint8_t *p, struct sender *s, bool marker)
+{
+	p[0] = 0x80;
+	p[1] = (marker ? 0x80 : 0) | 96;
+	p[2] = s->seq >> 8;
+	p[3] = s->seq & 0xff;
+	memset(p + 4, 0, 8);
+
+	++s->seq;
+}
+
+
+/* what the transport does today, one system call per packet */
+static int pkt_handler(bool marker, const uint8_t *hdr, size_t hdr_len,
+		       const uint8_t *pld, size_t pld_len, void *arg)
+{
+	struct sender *s = arg;
+	uint8_t rtp[RTP_HDR];
+	struct iovec iov[3];
+	struct msghdr msg;
+
+	rtp_hdr_write(rtp, s, marker);
+
+	iov[0].iov_base = rtp;
+	iov[0].iov_len  = RTP_HDR;
+	iov[1].iov_base = (void *)hdr;
+	iov[1].iov_len  = hdr_len;
+	iov[2].iov_base = (void *)pld;
+	iov[2].iov_len  = pld_len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov    = iov;
+	msg.msg_iovlen = 3;
+
+	if (sendmsg(s->fd, &msg, 0) < 0)
+		++s->n_err;
+
+	++s->n_pkt;
+
+	return 0;
+}
+
+
+/* what a batching transport does, one system call per access unit */
+static int batch_handler(const struct videnc_pkt *pktv, size_t pktc, void *arg)
+{
+	static uint8_t rtpv[TL0D_BATCH_SIZE][RTP_HDR];
+	static struct iovec iov[TL0D_BATCH_SIZE][3];
+	static struct mmsghdr msgv[TL0D_BATCH_SIZE];
+	struct sender *s = arg;
+	size_t i, sent = 0;
+
+	for (i = 0; i < pktc; i++) {
+
+		rtp_hdr_write(rtpv[i], s, pktv[i].marker);
+
+		iov[i][0].iov_base = rtpv[i];
+		iov[i][0].iov_len  = RTP_HDR;
+		iov[i][1].iov_base = (void *)pktv[i].hdr;
+		iov[i][1].iov_len  = pktv[i].hdr_len;
+		iov[i][2].iov_base = (void *)pktv[i].pld;
+		iov[i][2].iov_len  = pktv[i].pld_len;
+
+		memset(&msgv[i], 0, sizeof(msgv[i]));
+		msgv[i].msg_hdr.msg_iov    = iov[i];
+		msgv[i].msg_hdr.msg_iovlen = 3;
+	}
+
+	while (sent < pktc) {
+		int n = sendmmsg(s->fd, msgv + sent, pktc - sent, 0);
+
+		if (n <= 0) {
+			s->n_err += pktc - sent;
+			break;
+		}
+
+		sent += n;
+	}
+
+	s->n_pkt += pktc;
+	s->n_batch++;
+
+	return 0;
+}
+
+
+static void *sink_thread(void *arg)
+{
+	static uint8_t bufv[64][PKTSIZE + 64];
+	struct mmsghdr msgv[64];
+	struct iovec iov[64];
+	struct sink *sk = arg;
+	int i;
+
+	for (i = 0; i < 64; i++) {
+		iov[i].iov_base = bufv[i];
+		iov[i].iov_len  = sizeof(bufv[i]);
+		memset(&msgv[i], 0, sizeof(msgv[i]));
+		msgv[i].msg_hdr.msg_iov    = &iov[i];
+		msgv[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (!sk->stop) {
+		int n = recvmmsg(sk->fd, msgv, 64, MSG_DONTWAIT, NULL);
+
+		if (n > 0)
+			sk->n_pkt += n;
+		else
+			usleep(50);
+	}
+
+	return NULL;
+}
+
+
+static int sockets_open(int *sinkfd, int *sendfd)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	int rcvbuf = 8 << 20;
+
+	*sinkfd = socket(AF_INET, SOCK_DGRAM, 0);
+	*sendfd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (*sinkfd < 0 || *sendfd < 0)
+		return errno;
+
+	(void)setsockopt(*sinkfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family      = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(*sinkfd, (struct sockaddr *)&sin, sizeof(sin)) ||
+	    getsockname(*sinkfd, (struct sockaddr *)&sin, &len) ||
+	    connect(*sendfd, (struct sockaddr *)&sin, sizeof(sin)))
+		return errno;
+
+	return 0;
+}
+
+
+/* one slice of random data, sent behind a prefix NAL unit with its TID */
+static uint8_t *stream_alloc(void)
+{
+	size_t i, size = slice_size[0] + 4;
+	uint8_t *buf = malloc(size);
+
+	if (!buf)
+		return NULL;
+
+	srand(1);
+	for (i = 0; i < size; i++)
+		buf[i] = (uint8_t)rand();
+
+	buf[0] = 0x41;	/* non-IDR slice, NRI 2 */
+
+	return buf;
+}
+
+
+static double cpu_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static int run(const char *name, bool batch, struct pacer *pacer,
+	       unsigned aus, int sendfd, struct sink *sk, const uint8_t *slice)
+{
+	struct pacer_stats pst;
+	struct tl0d_packetizer *tp;
+	struct sender s;
+	unsigned long long rx;
+	uint8_t prefix[TEMPORAL_LAYERS][4];
+	double t;
+	unsigned i;
+	int err;
+
+	err = tl0d_packetizer_alloc(&tp);
+	if (err)
+		return err;
+
+	memset(&s, 0, sizeof(s));
+	s.fd = sendfd;
+
+	if (batch)
+		h264_tl0d_set_batch(tp, batch_handler, &s);
+
+	tp->pacer = pacer;
+
+	for (i = 0; i < TEMPORAL_LAYERS; i++) {
+		prefix[i][0] = 0x6e;
+		prefix[i][1] = 0x80;
+		prefix[i][2] = 0x00;
+		prefix[i][3] = i << 5;
+	}
+
+	rx = sk->n_pkt;
+	t  = cpu_s();
+
+	for (i = 0; i < aus && !err; i++) {
+		uint8_t tid = tid_pattern[i % RE_ARRAY_SIZE(tid_pattern)];
+		int k;
+
+		tp->h264Info.numNALUs = 0;
+
+		for (k = 0; k < AU_SLICES && !err; k++) {
+			err  = h264_tl0d_nalu_add(&tp->h264Info, prefix[tid], 4);
+			err |= h264_tl0d_nalu_add(&tp->h264Info, slice, slice_size[tid]);
+		}
+
+		s.tl0_au = tid == 0;
+
+		if (!err)
+			err = h264_tl0d_send_au(tp, PKTSIZE, 1,
+						batch ? NULL : pkt_handler, &s);
+
+		/* a paced enhancement AU may be skipped */
+		if (err == EAGAIN)
+			err = 0;
+
+		if (pacer)
+			usleep(PACED_FRAME_US);
+	}
+
+	t = cpu_s() - t;
+
+	/* let the sink drain what is still queued */
+	usleep(100000);
+	rx = sk->n_pkt - rx;
+
+	if (!err)
+		printf("%-10s %9.0f packets/s per core  %6.2f us/AU  "
+		       "%llu packets, %llu received, %llu send errors\n",
+		       name, s.n_pkt / t, t * 1e6 / aus, s.n_pkt, rx, s.n_err);
+
+	if (!err && pacer) {
+		unsigned long long sent = tp->stats.n_au;
+
+		pacer_stats(pacer, &pst);
+
+		printf("%-10s %llu AUs sent, %llu skipped, %.2f sendmmsg()/AU,"
+		       " %llu packets paced, %llu late\n", name, sent,
+		       tp->stats.n_skipped, sent ? (double)s.n_batch / sent : 0.0,
+		       pst.n_pkt, pst.n_late);
+
+		if (pst.n_pkt != s.n_pkt || s.n_batch <= sent) {
+			fprintf(stderr, "%s: the pacer saw %llu of %llu packets in"
+				" %llu batches\n", name, pst.n_pkt, s.n_pkt,
+				s.n_batch);
+			err = EPROTO;
+		}
+	}
+
+	mem_deref(tp);
+
+	return err;
+}
+
+
+int main(int argc, char **argv)
+{
+	unsigned aus = argc > 1 ? (unsigned)atoi(argv[1]) : DEFAULT_AUS;
+	struct pacer *pacer = NULL;
+	struct sink sk;
+	pthread_t thread;
+	uint8_t *slice;
+	int sendfd, err;
+
+	memset(&sk, 0, sizeof(sk));
+
+	err = sockets_open(&sk.fd, &sendfd);
+	if (err) {
+		printf("batch_bench: no loopback UDP here (%s), skipped\n", strerror(err));
+		return 0;
+	}
+
+	slice = stream_alloc();
+	if (!slice || pthread_create(&thread, NULL, sink_thread, &sk))
+		return 1;
+
+	printf("%u access units, %d slices each, %d byte packets\n",
+	       aus, AU_SLICES, PKTSIZE);
+
+	err  = run("per-packet", false, NULL, aus, sendfd, &sk, slice);
+	err |= run("batch", true, NULL, aus, sendfd, &sk, slice);
+
+	err |= pacer_alloc(&pacer, PACED_RATE, PKTSIZE, PACED_BUDGET,
+			   1 << 20, PKTSIZE);
+	if (!err)
+		err = run("paced", true, pacer, min(aus, PACED_AUS), sendfd,
+			  &sk, slice);
+	mem_deref(pacer);
+
+	sk.stop = true;
+	pthread_join(thread, NULL);
+
+	close(sendfd);
+	close(sk.fd);
+	free(slice);
+
+	return err ? 1 : 0;
+}
@@ -0,0 +1,138 @@
+/**
+ * @file dec_worker_test.c  Decoder worker queue on a stalled decoder
+ *
+ * The decode handler holds the worker until the test releases it, so the
+ * queue fills up. dec_worker_push() must return at once: enhancement AUs
+ * with ENOSPC as soon as they would take the slot reserved for base layer
+ * AUs, a base layer AU with EOVERFLOW only once that slot is taken too,
+ * after which the queued enhancement AUs are skipped instead of decoded.
+ *
+ * Copyright (C) 2015 SeNSE Project
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include <re.h>
+#include <baresip.h>
+#include "h264_packetize.h"
+#include "openh264_codec.h"
+#include "stub.h"
+
+
+enum {
+	QDEPTH  = 4,
+	RESERVE = 1,
+};
+
+struct decoder
+{
+	sem_t gate;
+	sem_t entered;
+	volatile unsigned n_au;
+	uint64_t last;		/* au_start of the last decoded AU */
+};
+
+static unsigned n_fail;
+
+
+static void decode_h(struct mbuf *mb, uint64_t au_start, void *arg)
+{
+	struct decoder *d = arg;
+
+	sem_post(&d->entered);
+
+	while (sem_wait(&d->gate))
+		;
+
+	d->last = au_start;
+	d->n_au++;
+}
+
+
+static void check(bool ok, const char *what)
+{
+	if (ok)
+		return;
+
+	fprintf(stderr, "FAIL: %s\n", what);
+	n_fail++;
+}
+
+
+static int push(struct dec_worker *w, bool base, uint64_t id)
+{
+	(void)mbuf_write_u8(dec_worker_buf(w), (uint8_t)id);
+
+	return dec_worker_push(w, base, id);
+}
+
+
+int main(void)
+{
+	struct dec_worker_stats stats;
+	struct dec_worker *w = NULL;
+	struct decoder d;
+	int i, err;
+
+	memset(&d, 0, sizeof(d));
+	sem_init(&d.gate, 0, 0);
+	sem_init(&d.entered, 0, 0);
+
+	err = dec_worker_alloc(&w, QDEPTH, RESERVE, 64, decode_h, &d);
+	if (err) {
+		fprintf(stderr, "dec_worker_alloc: %s\n", strerror(err));
+		return 1;
+	}
+
+	/* AU 1 is taken by the worker, which stalls in the decoder */
+	check(push(w, true, 1) == 0, "base AU queued");
+	sem_wait(&d.entered);
+
+	/* AU 1 keeps its slot while it is decoded, AUs 2 and 3 fill up to the reserve */
+	check(push(w, false, 2) == 0, "enhancement AU queued");
+	check(push(w, true, 3) == 0, "base AU queued");
+
+	check(push(w, false, 4) == ENOSPC, "enhancement AU kept out of the reserve");
+	check(push(w, true, 5) == 0, "base AU queued into the reserve");
+	check(push(w, false, 6) == ENOSPC, "enhancement AU dropped on a full queue");
+	check(push(w, true, 7) == EOVERFLOW, "base AU dropped on a full queue");
+	check(push(w, false, 8) == ENOSPC, "enhancement AU after a base drop");
+
+	/* the decoder catches up, AUs 3 and 5 are left to decode, AU 2 is skipped */
+	for (i = 0; i < 3; i++)
+		sem_post(&d.gate);
+
+	while (d.n_au < 3)
+		usleep(1000);
+	usleep(20000);
+
+	dec_worker_stats(w, &stats);
+
+	check(d.n_au == 3, "queued enhancement AU skipped");
+	check(d.last == 5, "base AUs decoded");
+	check(stats.n_dropped == 3, "enhancement AUs counted as dropped");
+	check(stats.n_base_dropped == 1, "base AU counted as dropped");
+	check(stats.n_skipped == 1, "skipped AU counted");
+
+	/* the keyframe after the drop is queued and decoded */
+	sem_post(&d.gate);
+	check(push(w, true, 20) == 0, "keyframe queued");
+	while (d.n_au < 4)
+		usleep(1000);
+	check(d.last == 20, "keyframe decoded");
+
+	mem_deref(w);
+	sem_destroy(&d.entered);
+	sem_destroy(&d.gate);
+
+	if (n_fail) {
+		fprintf(stderr, "dec_worker_test: %u checks failed\n", n_fail);
+		return 1;
+	}
+
+	printf("dec_worker_test: the producer never waited for a stalled decoder\n");
+
+	return 0;
+}
@@ -0,0 +1,426 @@
+/**
+ * @file packetize_bench.c  Packetizer benchmark over an Annex-B corpus
+ *
+ * Loads an SVC Annex-B stream into memory, one buffer per access unit,
+ * and runs h264_packetize() and h264_tl0d_packetize() over it with a
+ * packet handler that only counts. Access unit boundaries are found as
+ * in H.264 7.4.1.2.3, the temporal ID of an access unit comes from its
+ * prefix or SVC extension NAL units. Without a file a layered stream is
+ * generated:
+ *
+ *   packetize_bench [stream.264]
+ *
+ * Copyright (C) 2015 SeNSE Project
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <re.h>
+#include <baresip.h>
+#include "h264_packetize.h"
+#include "h264_tl0d.h"
+#include "openh264_codec.h"
+#include "stub.h"
+
+
+enum {
+	BENCH_AUS   = 200000,	/* packetized per run, the corpus is repeated */
+	PKTSIZE     = 1200,
+	MAX_TID     = 7,
+	SYNTH_AUS   = 600,
+	SYNTH_GOP   = 120,
+};
+
+struct au
+{
+	struct mbuf *mb;
+	uint8_t tid;
+};
+
+struct corpus
+{
+	struct au *auv;
+	size_t auc;
+	size_t bytes;
+	size_t nalus;
+	size_t n_tid[MAX_TID + 1];
+};
+
+struct counter
+{
+	uint8_t tl0;
+	bool tl0_au;
+	unsigned long long n_pkt;
+	unsigned long long n_bytes;
+	unsigned long long n_marker;
+};
+
+
+/* TL0 mechanism hooks of video.c */
+void get_tl0_pic_idx(bool *dup, bool *idr, uint8_t *tl0, void *arg)
+{
+	struct counter *c = arg;
+
+	if (c->tl0_au)
+		++c->tl0;
+
+	*dup = c->tl0_au;
+	*idr = false;
+	*tl0 = c->tl0;
+}
+
+
+void set_tl0(bool dup, bool idr, int x, uint16_t fsn, uint16_t lsn, void *arg)
+{
+}
+
+
+void get_seq(uint16_t *seq, void *arg)
+{
+	const struct counter *c = arg;
+
+	*seq = (uint16_t)c->n_pkt;
+}
+
+
+static int count_handler(bool marker, const uint8_t *hdr, size_t hdr_len,
+			 const uint8_t *pld, size_t pld_len, void *arg)
+{
+	struct counter *c = arg;
+
+	++c->n_pkt;
+	c->n_bytes += hdr_len + pld_len;
+	c->n_marker += marker;
+
+	return 0;
+}
+
+
+static bool nal_is_vcl(uint8_t type)
+{
+	return type == 1 || type == 5 || type == 20;
+}
+
+
+/* ue(v) first_mb_in_slice is 0, coded as the single bit 1 */
+static bool slice_first_mb(const uint8_t *p, size_t len)
+{
+	size_t hdr = (p[0] & 0x1f) == 20 ? 4 : 1;
+
+	return len > hdr && (p[hdr] & 0x80);
+}
+
+
+static int corpus_add(struct corpus *cp, const uint8_t *p, size_t len,
+		      uint8_t tid)
+{
+	struct au *auv;
+	struct au *au;
+
+	auv = realloc(cp->auv, (cp->auc + 1) * sizeof(*auv));
+	if (!auv)
+		return ENOMEM;
+
+	cp->auv = auv;
+	au = &auv[cp->auc];
+
+	au->mb = mbuf_alloc(len);
+	if (!au->mb)
+		return ENOMEM;
+
+	(void)mbuf_write_mem(au->mb, p, len);
+	au->tid = tid;
+
+	cp->auc++;
+	cp->bytes += len;
+	cp->n_tid[tid]++;
+
+	return 0;
+}
+
+
+/*
+ * Splits an Annex-B stream into access units. After a slice, SEI, SPS,
+ * PPS or an access unit delimiter start the next access unit, a slice
+ * with first_mb_in_slice 0 does so too. Prefix NAL units belong to the
+ * slice behind them, the cut is made before the first non-VCL NAL unit
+ * that follows the last slice.
+ */
+static int corpus_load(struct corpus *cp, const uint8_t *buf, size_t len)
+{
+	const uint8_t *end = buf + len;
+	const uint8_t *au_start, *cand = NULL, *r;
+	bool have_vcl = false;
+	uint8_t tid = 0, prefix_tid = 0, prev_type = 0;
+	int err = 0;
+
+	au_start = r = h264_find_startcode(buf, end);
+
+	while (r < end && !err) {
+		const uint8_t *nal = r + 3, *next;
+		/* a 4 byte start code belongs to the NAL unit behind it */
+		const uint8_t *sc = r > au_start && !r[-1] ? r - 1 : r;
+		uint8_t type;
+		bool cut;
+
+		next = h264_find_startcode(nal, end);
+		if (nal >= next)
+			break;
+
+		type = nal[0] & 0x1f;
+
+		if (have_vcl && !cand && !nal_is_vcl(type))
+			cand = sc;
+
+		cut = have_vcl && ((type >= 6 && type <= 9) ||
+				   (nal_is_vcl(type) && slice_first_mb(nal, next - nal)));
+		if (cut) {
+			const uint8_t *at = cand ? cand : sc;
+
+			err = corpus_add(cp, au_start, at - au_start, tid);
+			au_start = at;
+			have_vcl = false;
+			tid = 0;
+		}
+
+		if (nal_is_vcl(type)) {
+			if (type == 20 && next - nal >= 4)
+				tid = max(tid, (nal[3] >> 5) & 0x7);
+			else if (prev_type == 14)
+				tid = max(tid, prefix_tid);
+
+			have_vcl = true;
+			cand = NULL;
+		}
+		else if (type == 14 && next - nal >= 4) {
+			prefix_tid = (nal[3] >> 5) & 0x7;
+		}
+
+		prev_type = type;
+		cp->nalus++;
+		r = next;
+	}
+
+	if (!err && have_vcl)
+		err = corpus_add(cp, au_start, end - au_start, tid);
+
+	return err;
+}
+
+
+static void nal_put(uint8_t *buf, size_t *pos, uint8_t hdr, bool first_mb,
+		    size_t size)
+{
+	uint8_t *p = buf + *pos;
+	size_t i;
+
+	p[0] = 0;
+	p[1] = 0;
+	p[2] = 1;
+	p[3] = hdr;
+	p[4] = first_mb ? 0x88 : 0x24;
+
+	for (i = 5; i < size + 3; i++) {
+		p[i] = (uint8_t)rand();
+
+		/* emulation prevention */
+		if (p[i - 2] == 0 && p[i - 1] == 0 && p[i] <= 3)
+			p[i] = 3;
+	}
+
+	/* no trailing zero, it would read as part of the next start code */
+	p[i - 1] |= 0x80;
+
+	*pos += size + 3;
+}
+
+
+/*
+ * A three layer stream like the encoder sends it: TIDs 0,2,1,2, slices
+ * of decreasing size per layer, each behind a prefix NAL unit, and SPS
+ * and PPS before every IDR picture
+ */
+static uint8_t *synth(size_t *lenp)
+{
+	static const uint8_t tidv[4] = {0, 2, 1, 2};
+	static const size_t slice_max[3] = {6000, 2500, 900};
+	uint8_t *buf = malloc(SYNTH_AUS * 4 * (6000 + 64));
+	size_t pos = 0;
+	int i, k;
+
+	if (!buf)
+		return NULL;
+
+	srand(3);
+
+	for (i = 0; i < SYNTH_AUS; i++) {
+		uint8_t tid = tidv[i % 4];
+		bool idr = i % SYNTH_GOP == 0;
+		int slices = 1 + rand() % 4;
+
+		if (idr) {
+			nal_put(buf, &pos, 0x67, false, 12);
+			nal_put(buf, &pos, 0x68, false, 4);
+		}
+
+		for (k = 0; k < slices; k++) {
+			size_t size = 40 + rand() % slice_max[tid];
+
+			nal_put(buf, &pos, 0x6e, false, 4);
+			buf[pos - 3] = (idr ? 0x40 : 0) | 0x80;
+			buf[pos - 2] = 0;
+			buf[pos - 1] = tid << 5 | 0x03;
+
+			nal_put(buf, &pos, idr ? 0x65 : (tid ? 0x21 : 0x41),
+				k == 0, size);
+		}
+	}
+
+	*lenp = pos;
+
+	return buf;
+}
+
+
+static uint8_t *load(const char *path, size_t *lenp)
+{
+	uint8_t *buf;
+	FILE *f;
+	long len;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return NULL;
+
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	buf = len > 0 ? malloc(len) : NULL;
+	if (buf && fread(buf, 1, len, f) != (size_t)len) {
+		free(buf);
+		buf = NULL;
+	}
+
+	fclose(f);
+
+	*lenp = len > 0 ? (size_t)len : 0;
+
+	return buf;
+}
+
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static int run(const char *name, bool tl0d, const struct corpus *cp)
+{
+	struct tl0d_packetizer *tp = NULL;
+	unsigned long long n_alloc;
+	struct counter c;
+	size_t i, aus = 0;
+	double t;
+	int err = 0;
+
+	if (tl0d) {
+		err = tl0d_packetizer_alloc(&tp);
+		if (err)
+			return err;
+	}
+
+	memset(&c, 0, sizeof(c));
+
+	n_alloc = stub_n_alloc;
+	t = now_s();
+
+	while (aus < BENCH_AUS && !err) {
+		for (i = 0; i < cp->auc; i++) {
+			const struct au *au = &cp->auv[i];
+
+			c.tl0_au = au->tid == 0;
+
+			if (tl0d)
+				err |= h264_tl0d_packetize(tp, au->mb, PKTSIZE, 1,
+							   count_handler, &c);
+			else
+				err |= h264_packetize(au->mb, PKTSIZE, 1,
+						      count_handler, &c);
+		}
+
+		aus += cp->auc;
+	}
+
+	t = now_s() - t;
+	n_alloc = stub_n_alloc - n_alloc;
+
+	mem_deref(tp);
+
+	if (err) {
+		fprintf(stderr, "%s: failed (%d)\n", name, err);
+		return err;
+	}
+
+	/* exactly the last packet of every access unit carries the marker */
+	if (c.n_marker != aus) {
+		fprintf(stderr, "%s: %llu markers for %zu access units\n",
+			name, c.n_marker, aus);
+		return EPROTO;
+	}
+
+	printf("%-20s %7.0f ns/AU  %5.0f ns/packet  %5.2f packets/AU"
+	       "  %.3f allocations/AU\n", name,
+	       t * 1e9 / aus, t * 1e9 / c.n_pkt, (double)c.n_pkt / aus,
+	       (double)n_alloc / aus);
+
+	return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+	struct corpus cp;
+	size_t i, len;
+	uint8_t *buf;
+	int err;
+
+	h264_startcode_init();
+
+	memset(&cp, 0, sizeof(cp));
+
+	buf = argc > 1 ? load(argv[1], &len) : synth(&len);
+	if (!buf || !len) {
+		fprintf(stderr, "could not read %s\n", argc > 1 ? argv[1] : "generated stream");
+		return 1;
+	}
+
+	err = corpus_load(&cp, buf, len);
+	free(buf);
+	if (err || !cp.auc) {
+		fprintf(stderr, "no access units in %s\n", argc > 1 ? argv[1] : "generated stream");
+		return 1;
+	}
+
+	printf("corpus: %s, %zu access units, %zu NAL units, %zu bytes, AUs per TID",
+	       argc > 1 ? argv[1] : "generated", cp.auc, cp.nalus, cp.bytes);
+	for (i = 0; i <= MAX_TID; i++) {
+		if (cp.n_tid[i])
+			printf(" %zu:%zu", i, cp.n_tid[i]);
+	}
+	printf("\n");
+
+	err  = run("h264_packetize", false, &cp);
+	err |= run("h264_tl0d_packetize", true, &cp);
+
+	for (i = 0; i < cp.auc; i++)
+		mem_deref(cp.auv[i].mb);
+	free(cp.auv);
+
+	return err ? 1 : 0;
+}
@@ -0,0 +1,256 @@
+/**
+ * @file startcode_bench.c  Start code scanner check and benchmark
+ *
+ * Every scanner built for this CPU is compared with a byte by byte
+ * reference on random buffers, then timed over an Annex-B file given on
+ * the command line, or over a generated stream without one:
+ *
+ *   startcode_bench [stream.264]
+ *
+ * Copyright (C) 2015 SeNSE Project
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* the scanners are static, the bench reaches them through the source */
+#include "../openh264/h264_startcode.c"
+
+
+enum {
+	CHECK_ROUNDS = 200000,
+	BENCH_BYTES  = 1 << 30,		/* scanned per implementation */
+	SYNTH_SIZE   = 4 << 20,
+	SYNTH_NALU   = 1200,		/* average NAL unit size of the generated stream */
+};
+
+
+struct scanner
+{
+	const char *name;
+	startcode_h *h;
+	bool supported;
+};
+
+
+static const uint8_t *find_startcode_ref(const uint8_t *p, const uint8_t *end)
+{
+	for (; p + 2 < end; p++) {
+		if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+			return p;
+	}
+
+	return end;
+}
+
+
+static size_t scanners_get(struct scanner *sv)
+{
+	size_t n = 0;
+
+	sv[n++] = (struct scanner){"c", find_startcode_c, true};
+#ifdef HAVE_SSE2
+	sv[n++] = (struct scanner){"sse2", find_startcode_sse2, true};
+#endif
+#ifdef HAVE_AVX2
+	__builtin_cpu_init();
+	sv[n++] = (struct scanner){"avx2", find_startcode_avx2,
+				   __builtin_cpu_supports("avx2")};
+#endif
+#ifdef HAVE_NEON
+	sv[n++] = (struct scanner){"neon", find_startcode_neon, true};
+#endif
+
+	return n;
+}
+
+
+/*
+ * The scalar scanner may return end instead of a start code in the last
+ * three bytes, where no complete NAL unit can follow, both are accepted
+ */
+static bool result_ok(const struct scanner *sc, const uint8_t *r,
+		      const uint8_t *ref, const uint8_t *end)
+{
+	if (r == ref)
+		return true;
+
+	return sc->h == find_startcode_c && r == end && ref + 3 >= end;
+}
+
+
+static int check(const struct scanner *sv, size_t sc)
+{
+	static uint8_t buf[4096 + 64];
+	int i, k;
+	size_t s;
+
+	srand(1);
+
+	for (i = 0; i < CHECK_ROUNDS; i++) {
+		uint8_t *b = buf + rand() % 16;
+		int n = rand() % 300;
+		const uint8_t *ref;
+
+		/* dense in 00 and 01 so that partial matches are frequent */
+		for (k = 0; k < n; k++) {
+			int r = rand() % 8;
+			b[k] = r < 3 ? 0 : r < 5 ? 1 : (uint8_t)rand();
+		}
+
+		ref = find_startcode_ref(b, b + n);
+
+		for (s = 0; s < sc; s++) {
+			const uint8_t *r;
+
+			if (!sv[s].supported)
+				continue;
+
+			r = sv[s].h(b, b + n);
+			if (!result_ok(&sv[s], r, ref, b + n)) {
+				fprintf(stderr, "%s: start code at %td, expected %td (len %d)\n",
+					sv[s].name, r - b, ref - b, n);
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+static uint8_t *load(const char *path, size_t *lenp)
+{
+	uint8_t *buf;
+	FILE *f;
+	long len;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return NULL;
+
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	buf = len > 0 ? malloc(len) : NULL;
+	if (buf && fread(buf, 1, len, f) != (size_t)len) {
+		free(buf);
+		buf = NULL;
+	}
+
+	fclose(f);
+
+	*lenp = len > 0 ? (size_t)len : 0;
+
+	return buf;
+}
+
+
+/* random slice data with start codes at NAL unit sized distances */
+static uint8_t *synth(size_t *lenp)
+{
+	uint8_t *buf = malloc(SYNTH_SIZE);
+	size_t i = 0;
+
+	if (!buf)
+		return NULL;
+
+	srand(2);
+
+	while (i + 4 < SYNTH_SIZE) {
+		size_t n = SYNTH_NALU / 2 + rand() % SYNTH_NALU;
+
+		buf[i++] = 0;
+		buf[i++] = 0;
+		buf[i++] = 1;
+
+		for (; n-- && i < SYNTH_SIZE; i++) {
+			buf[i] = (uint8_t)rand();
+
+			/* keep the emulation prevention rule of the payload */
+			if (i >= 2 && buf[i - 2] == 0 && buf[i - 1] == 0 && buf[i] <= 3)
+				buf[i] = 3;
+		}
+	}
+
+	*lenp = i;
+
+	return buf;
+}
+
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* walks the stream from start code to start code, like the packetizer */
+static size_t scan_stream(startcode_h *h, const uint8_t *buf, size_t len)
+{
+	const uint8_t *p = buf, *end = buf + len;
+	size_t n = 0;
+
+	while ((p = h(p, end)) < end) {
+		p += 3;
+		n++;
+	}
+
+	return n;
+}
+
+
+int main(int argc, char **argv)
+{
+	struct scanner sv[4];
+	size_t sc, s, len, nalus = 0;
+	uint8_t *buf;
+
+	sc = scanners_get(sv);
+
+	if (check(sv, sc))
+		return 1;
+
+	printf("check: %d random buffers, all scanners agree\n", CHECK_ROUNDS);
+
+	buf = argc > 1 ? load(argv[1], &len) : synth(&len);
+	if (!buf || !len) {
+		fprintf(stderr, "could not read %s\n", argc > 1 ? argv[1] : "generated stream");
+		return 1;
+	}
+
+	printf("stream: %s, %zu bytes\n", argc > 1 ? argv[1] : "generated", len);
+
+	for (s = 0; s < sc; s++) {
+		size_t i, rounds = BENCH_BYTES / len + 1, n = 0;
+		double t;
+
+		if (!sv[s].supported) {
+			printf("%-5s not supported by this CPU\n", sv[s].name);
+			continue;
+		}
+
+		t = now_s();
+		for (i = 0; i < rounds; i++)
+			n = scan_stream(sv[s].h, buf, len);
+		t = now_s() - t;
+
+		if (s && n != nalus) {
+			fprintf(stderr, "%s: %zu start codes, expected %zu\n", sv[s].name, n, nalus);
+			return 1;
+		}
+		nalus = n;
+
+		printf("%-5s %6.2f GB/s  (%zu NAL units)\n", sv[s].name,
+		       (double)rounds * len / t / 1e9, n);
+	}
+
+	free(buf);
+
+	return 0;
+}
@@ -0,0 +1,61 @@
+/**
+ * @file baresip.h  Minimal baresip declarations for the standalone test programs
+ *
+ * Copyright (C) 2015 SeNSE Project
+ */
+#ifndef TEST_STUB_BARESIP_H
+#define TEST_STUB_BARESIP_H
+
+#include <re.h>
+
+void warning(const char *fmt, ...);
+void debug(const char *fmt, ...);
+void info(const char *fmt, ...);
+
+
+/* conf, every key reads as unset unless stub_conf_set() gave it a value */
+struct conf;
+
+struct conf *conf_cur(void);
+int conf_get_u32(const struct conf *conf, const char *name, uint32_t *num);
+int conf_get_bool(const struct conf *conf, const char *name, bool *val);
+
+
+/* video */
+struct vidcodec;
+
+struct vidsz
+{
+	unsigned w, h;
+};
+
+enum vidfmt {
+	VID_FMT_YUV420P = 0,
+};
+
+struct vidframe
+{
+	uint8_t *data[4];
+	uint16_t linesize[4];
+	struct vidsz size;
+	enum vidfmt fmt;
+};
+
+struct videnc_param
+{
+	unsigned bitrate;
+	unsigned pktsize;
+	unsigned fps;
+	uint32_t max_fs;
+};
+
+typedef int (videnc_packet_h)(bool marker, const uint8_t *hdr, size_t hdr_len,
+			      const uint8_t *pld, size_t pld_len, void *arg);
+
+
+/* TL0 mechanism hooks of video.c */
+void get_tl0_pic_idx(bool *dup, bool *idr, uint8_t *tl0, void *arg);
+void set_tl0(bool dup, bool idr, int x, uint16_t fsn, uint16_t lsn, void *arg);
+void get_seq(uint16_t *seq, void *arg);
+
+#endif
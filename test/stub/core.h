@@ -0,0 +1,52 @@
+/**
+ * @file core.h  The parts of baresip's struct stream the TL0 receiver uses
+ *
+ * The functions are left to the test program, which decides what a FIR
+ * or a jitter buffer does.
+ *
+ * Copyright (C) 2015 SeNSE Project
+ */
+#ifndef TEST_STUB_CORE_H
+#define TEST_STUB_CORE_H
+
+#include <baresip.h>
+
+struct sdp_media;
+struct jbuf;
+
+enum { SDP_RECVONLY = 1 };
+
+struct metric
+{
+	uint32_t n_err;
+};
+
+typedef void (stream_rtp_h)(const struct rtp_header *hdr, struct mbuf *mb, void *arg);
+
+struct tl0_rx;
+
+struct stream
+{
+	struct sdp_media *sdp;
+	struct rtp_sock *rtp;
+	struct metric metric_rx;
+	uint32_t ssrc_rx;
+	struct jbuf *jbuf;
+	bool jbuf_started;
+	bool requested_fir;
+	stream_rtp_h *rtph;
+	void *arg;
+	struct tl0_rx *tl0;
+};
+
+int  sdp_media_ldir(const struct sdp_media *m);
+const char *sdp_media_name(const struct sdp_media *m);
+void metric_add_packet(struct metric *metric, size_t len);
+bool isVideo(struct stream *s);
+void stream_send_fir(struct stream *s, bool pli);
+
+int  jbuf_put(struct jbuf *jb, const struct rtp_header *hdr, void *mem);
+int  jbuf_get(struct jbuf *jb, struct rtp_header *hdr, void **mem);
+void jbuf_flush(struct jbuf *jb);
+
+#endif
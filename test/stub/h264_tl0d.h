@@ -0,0 +1,6 @@
+/**
+ * @file h264_tl0d.h  TL0D packetizer declarations, as baresip's include dir provides them
+ *
+ * Copyright (C) 2015 SeNSE Project
+ */
+#include "h264_tl0d_packetize.h"
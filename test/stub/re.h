@@ -0,0 +1,208 @@
+/**
+ * @file re.h  Minimal libre declarations for the standalone test programs
+ *
+ * Only what the openh264 and tl0_mechanism sources use. The
+ * implementations are in stub.c.
+ *
+ * Copyright (C) 2015 SeNSE Project
+ */
+#ifndef TEST_STUB_RE_H
+#define TEST_STUB_RE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+#ifndef min
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+#define RE_ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define EXPORT_SYM
+#define DECL_EXPORTS(x) exports_ ##x
+
+
+/* mem */
+typedef void (mem_destroy_h)(void *data);
+
+void *mem_zalloc(size_t size, mem_destroy_h *dh);
+void *mem_alloc(size_t size, mem_destroy_h *dh);
+void *mem_ref(void *data);
+void *mem_deref(void *data);
+
+
+/* mbuf */
+struct mbuf
+{
+	uint8_t *buf;
+	size_t size;
+	size_t pos;
+	size_t end;
+};
+
+struct mbuf *mbuf_alloc(size_t size);
+int mbuf_resize(struct mbuf *mb, size_t size);
+void mbuf_rewind(struct mbuf *mb);
+int mbuf_write_mem(struct mbuf *mb, const uint8_t *buf, size_t size);
+int mbuf_write_u8(struct mbuf *mb, uint8_t v);
+int mbuf_write_u16(struct mbuf *mb, uint16_t v);
+uint8_t mbuf_read_u8(struct mbuf *mb);
+
+#define mbuf_buf(mb) ((mb)->buf + (mb)->pos)
+#define mbuf_get_left(mb) (((mb) && (mb)->end > (mb)->pos) ? ((mb)->end - (mb)->pos) : 0)
+#define mbuf_get_space(mb) (((mb) && (mb)->size > (mb)->pos) ? ((mb)->size - (mb)->pos) : 0)
+
+
+/* fmt */
+struct pl
+{
+	const char *p;
+	size_t l;
+};
+
+struct re_printf;
+
+int re_printf(const char *fmt, ...);
+int re_hprintf(struct re_printf *pf, const char *fmt, ...);
+int pl_strcasecmp(const struct pl *pl, const char *str);
+uint32_t pl_u32(const struct pl *pl);
+uint32_t pl_x32(const struct pl *pl);
+void pl_set_str(struct pl *pl, const char *str);
+bool str_isset(const char *s);
+
+typedef void (fmt_param_h)(const struct pl *name, const struct pl *val, void *arg);
+
+bool fmt_param_get(const struct pl *pl, const char *pname, struct pl *val);
+void fmt_param_apply(const struct pl *pl, fmt_param_h *ph, void *arg);
+
+
+/* list */
+struct le
+{
+	struct le *prev;
+	struct le *next;
+	struct list *list;
+	void *data;
+};
+
+struct list
+{
+	struct le *head;
+	struct le *tail;
+};
+
+#define LIST_INIT {NULL, NULL}
+
+void list_init(struct list *list);
+void list_flush(struct list *list);
+void list_clear(struct list *list);
+void list_append(struct list *list, struct le *le, void *data);
+void list_prepend(struct list *list, struct le *le, void *data);
+void list_insert_after(struct list *list, struct le *le, struct le *ile, void *data);
+void list_unlink(struct le *le);
+uint32_t list_count(const struct list *list);
+
+#define list_head(l) ((l) ? (l)->head : NULL)
+
+
+/* tmr, driven by the virtual clock of stub.c */
+typedef void (tmr_h)(void *arg);
+
+struct tmr
+{
+	struct le le;
+	tmr_h *th;
+	void *arg;
+	uint64_t jfs;
+};
+
+void tmr_init(struct tmr *tmr);
+void tmr_start(struct tmr *tmr, uint64_t delay, tmr_h *th, void *arg);
+void tmr_cancel(struct tmr *tmr);
+uint64_t tmr_get_expire(const struct tmr *tmr);
+bool tmr_isrunning(const struct tmr *tmr);
+uint64_t tmr_jiffies(void);
+
+
+/* rtp / rtcp */
+struct sa
+{
+	int unused;
+};
+
+struct rtp_header
+{
+	uint8_t ver;
+	bool pad;
+	bool ext;
+	uint8_t cc;
+	bool m;
+	uint8_t pt;
+	uint16_t seq;
+	uint32_t ts;
+	uint32_t ssrc;
+	uint32_t csrc[16];
+};
+
+struct rtp_sock;
+
+struct rtcp_stats
+{
+	struct {
+		uint32_t sent;
+		int lost;
+		uint32_t jit;
+	} tx, rx;
+	uint32_t rtt;		/* [us] */
+};
+
+enum rtcp_type {
+	RTCP_RTPFB = 205,
+	RTCP_PSFB  = 206,
+};
+
+enum rtcp_rtpfb {
+	RTCP_RTPFB_GNACK = 1,
+};
+
+struct gnack
+{
+	uint16_t pid;
+	uint16_t blp;
+};
+
+struct rtcp_msg
+{
+	struct {
+		uint8_t count;
+		uint8_t pt;
+	} hdr;
+	union {
+		struct {
+			uint32_t ssrc_packet;
+			uint32_t ssrc_media;
+			uint32_t n;
+			union {
+				struct gnack *gnackv;
+			} fci;
+		} fb;
+	} r;
+};
+
+typedef int (rtcp_encode_h)(struct mbuf *mb, void *arg);
+
+int rtcp_encode(struct mbuf *mb, enum rtcp_type type, uint32_t count, ...);
+int rtcp_send(struct rtp_sock *rs, struct mbuf *mb);
+int rtcp_stats(struct rtp_sock *rs, uint32_t ssrc, struct rtcp_stats *stats);
+uint32_t rtp_sess_ssrc(const struct rtp_sock *rs);
+
+#endif
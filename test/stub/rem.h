@@ -0,0 +1,3 @@
+/**
+ * @file rem.h  librem is not used by the tested sources
+ */
@@ -0,0 +1,595 @@
+/**
+ * @file stub.c  libre/baresip stand-ins for the standalone test programs
+ *
+ * Reference counted memory, mbuf, list and timers behave like libre's.
+ * Time is virtual: tmr_jiffies() returns what stub_clock_set() was given
+ * and timers only fire from stub_tmr_poll().
+ *
+ * Copyright (C) 2015 SeNSE Project
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+#include "stub.h"
+
+
+unsigned long long stub_n_alloc;
+unsigned stub_n_fir;
+bool stub_verbose;
+
+
+/*
+ * mem
+ */
+
+/* 16 bytes, the data behind it stays aligned for any type */
+struct mem
+{
+	size_t nrefs;
+	mem_destroy_h *dh;
+};
+
+
+void *mem_zalloc(size_t size, mem_destroy_h *dh)
+{
+	struct mem *m = calloc(1, sizeof(*m) + size);
+
+	if (!m)
+		return NULL;
+
+	++stub_n_alloc;
+
+	m->nrefs = 1;
+	m->dh    = dh;
+
+	return m + 1;
+}
+
+
+void *mem_alloc(size_t size, mem_destroy_h *dh)
+{
+	return mem_zalloc(size, dh);
+}
+
+
+void *mem_ref(void *data)
+{
+	if (data)
+		((struct mem *)data - 1)->nrefs++;
+
+	return data;
+}
+
+
+void *mem_deref(void *data)
+{
+	struct mem *m;
+
+	if (!data)
+		return NULL;
+
+	m = (struct mem *)data - 1;
+
+	if (--m->nrefs > 0)
+		return NULL;
+
+	if (m->dh)
+		m->dh(data);
+
+	free(m);
+
+	return NULL;
+}
+
+
+/*
+ * mbuf
+ */
+
+static void mbuf_destructor(void *arg)
+{
+	struct mbuf *mb = arg;
+
+	free(mb->buf);
+}
+
+
+struct mbuf *mbuf_alloc(size_t size)
+{
+	struct mbuf *mb = mem_zalloc(sizeof(*mb), mbuf_destructor);
+
+	if (!mb)
+		return NULL;
+
+	if (mbuf_resize(mb, size ? size : 1))
+		return mem_deref(mb);
+
+	return mb;
+}
+
+
+int mbuf_resize(struct mbuf *mb, size_t size)
+{
+	uint8_t *buf = realloc(mb->buf, size);
+
+	if (!buf)
+		return ENOMEM;
+
+	++stub_n_alloc;
+
+	mb->buf  = buf;
+	mb->size = size;
+
+	return 0;
+}
+
+
+void mbuf_rewind(struct mbuf *mb)
+{
+	mb->pos = mb->end = 0;
+}
+
+
+int mbuf_write_mem(struct mbuf *mb, const uint8_t *buf, size_t size)
+{
+	if (mb->pos + size > mb->size) {
+		int err = mbuf_resize(mb, (mb->pos + size) * 2);
+		if (err)
+			return err;
+	}
+
+	memcpy(mb->buf + mb->pos, buf, size);
+	mb->pos += size;
+
+	if (mb->pos > mb->end)
+		mb->end = mb->pos;
+
+	return 0;
+}
+
+
+int mbuf_write_u8(struct mbuf *mb, uint8_t v)
+{
+	return mbuf_write_mem(mb, &v, 1);
+}
+
+
+int mbuf_write_u16(struct mbuf *mb, uint16_t v)
+{
+	return mbuf_write_mem(mb, (const uint8_t *)&v, 2);
+}
+
+
+uint8_t mbuf_read_u8(struct mbuf *mb)
+{
+	return mb->pos < mb->end ? mb->buf[mb->pos++] : 0;
+}
+
+
+/*
+ * list
+ */
+
+void list_init(struct list *list)
+{
+	list->head = list->tail = NULL;
+}
+
+
+void list_append(struct list *list, struct le *le, void *data)
+{
+	le->data = data;
+	le->list = list;
+	le->next = NULL;
+	le->prev = list->tail;
+
+	if (list->tail)
+		list->tail->next = le;
+	else
+		list->head = le;
+
+	list->tail = le;
+}
+
+
+void list_prepend(struct list *list, struct le *le, void *data)
+{
+	le->data = data;
+	le->list = list;
+	le->prev = NULL;
+	le->next = list->head;
+
+	if (list->head)
+		list->head->prev = le;
+	else
+		list->tail = le;
+
+	list->head = le;
+}
+
+
+void list_insert_after(struct list *list, struct le *le, struct le *ile, void *data)
+{
+	ile->data = data;
+	ile->list = list;
+	ile->prev = le;
+	ile->next = le->next;
+
+	if (le->next)
+		le->next->prev = ile;
+	else
+		list->tail = ile;
+
+	le->next = ile;
+}
+
+
+void list_unlink(struct le *le)
+{
+	struct list *list = le->list;
+
+	if (!list)
+		return;
+
+	if (le->prev)
+		le->prev->next = le->next;
+	else
+		list->head = le->next;
+
+	if (le->next)
+		le->next->prev = le->prev;
+	else
+		list->tail = le->prev;
+
+	le->next = le->prev = NULL;
+	le->list = NULL;
+}
+
+
+void list_clear(struct list *list)
+{
+	while (list->head)
+		list_unlink(list->head);
+}
+
+
+void list_flush(struct list *list)
+{
+	while (list->head) {
+		void *data = list->head->data;
+
+		list_unlink(list->head);
+		mem_deref(data);
+	}
+}
+
+
+uint32_t list_count(const struct list *list)
+{
+	const struct le *le;
+	uint32_t n = 0;
+
+	for (le = list->head; le; le = le->next)
+		n++;
+
+	return n;
+}
+
+
+/*
+ * tmr
+ */
+
+static uint64_t now_ms;
+static struct list tmrl;
+
+
+void stub_clock_set(uint64_t ms)
+{
+	now_ms = ms;
+}
+
+
+uint64_t tmr_jiffies(void)
+{
+	return now_ms;
+}
+
+
+void tmr_init(struct tmr *tmr)
+{
+	memset(tmr, 0, sizeof(*tmr));
+}
+
+
+void tmr_cancel(struct tmr *tmr)
+{
+	list_unlink(&tmr->le);
+	tmr->th = NULL;
+}
+
+
+void tmr_start(struct tmr *tmr, uint64_t delay, tmr_h *th, void *arg)
+{
+	list_unlink(&tmr->le);
+
+	tmr->th  = th;
+	tmr->arg = arg;
+	tmr->jfs = now_ms + delay;
+
+	if (th)
+		list_append(&tmrl, &tmr->le, tmr);
+}
+
+
+bool tmr_isrunning(const struct tmr *tmr)
+{
+	return tmr->th != NULL;
+}
+
+
+uint64_t tmr_get_expire(const struct tmr *tmr)
+{
+	return tmr->jfs > now_ms ? tmr->jfs - now_ms : 0;
+}
+
+
+/* expiry of the earliest running timer, UINT64_MAX if there is none */
+uint64_t stub_tmr_next(void)
+{
+	uint64_t next = UINT64_MAX;
+	struct le *le;
+
+	for (le = tmrl.head; le; le = le->next) {
+		const struct tmr *tmr = le->data;
+
+		if (tmr->jfs < next)
+			next = tmr->jfs;
+	}
+
+	return next;
+}
+
+
+/* fires the timers that are due */
+void stub_tmr_poll(void)
+{
+	struct le *le = tmrl.head;
+
+	while (le) {
+		struct tmr *tmr = le->data;
+		tmr_h *th = tmr->th;
+
+		le = le->next;
+
+		if (tmr->jfs > now_ms)
+			continue;
+
+		tmr_cancel(tmr);
+		th(tmr->arg);
+
+		/* the handler may have started or cancelled other timers */
+		le = tmrl.head;
+	}
+}
+
+
+/*
+ * fmt
+ */
+
+int re_printf(const char *fmt, ...)
+{
+	(void)fmt;
+
+	return 0;
+}
+
+
+/* prints like printf, libre's %m and %H are not supported */
+int re_hprintf(struct re_printf *pf, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	(void)pf;
+
+	va_start(ap, fmt);
+	n = vprintf(fmt, ap);
+	va_end(ap);
+
+	return n < 0 ? EIO : 0;
+}
+
+
+void warning(const char *fmt, ...)
+{
+	va_list ap;
+
+	if (!stub_verbose)
+		return;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+
+void debug(const char *fmt, ...)
+{
+	(void)fmt;
+}
+
+
+void info(const char *fmt, ...)
+{
+	(void)fmt;
+}
+
+
+/*
+ * conf
+ */
+
+struct conf_val
+{
+	const char *name;
+	uint32_t val;
+};
+
+static struct conf_val confv[32];
+static size_t confc;
+
+
+void stub_conf_set(const char *name, uint32_t val)
+{
+	size_t i;
+
+	for (i = 0; i < confc; i++) {
+		if (!strcmp(confv[i].name, name)) {
+			confv[i].val = val;
+			return;
+		}
+	}
+
+	if (confc == RE_ARRAY_SIZE(confv))
+		abort();
+
+	confv[confc].name  = name;
+	confv[confc++].val = val;
+}
+
+
+struct conf *conf_cur(void)
+{
+	return NULL;
+}
+
+
+int conf_get_u32(const struct conf *conf, const char *name, uint32_t *num)
+{
+	size_t i;
+
+	(void)conf;
+
+	for (i = 0; i < confc; i++) {
+		if (!strcmp(confv[i].name, name)) {
+			*num = confv[i].val;
+			return 0;
+		}
+	}
+
+	return ENOENT;
+}
+
+
+int conf_get_bool(const struct conf *conf, const char *name, bool *val)
+{
+	uint32_t v;
+	int err;
+
+	err = conf_get_u32(conf, name, &v);
+	if (!err)
+		*val = v != 0;
+
+	return err;
+}
+
+
+/*
+ * rtcp, only the Generic NACK encoder used by the TL0 receiver
+ */
+
+int rtcp_encode(struct mbuf *mb, enum rtcp_type type, uint32_t count, ...)
+{
+	rtcp_encode_h *ench;
+	void *arg;
+	va_list ap;
+
+	(void)count;
+
+	if (type != RTCP_RTPFB)
+		return ENOTSUP;
+
+	va_start(ap, count);
+	(void)va_arg(ap, uint32_t);	/* sender SSRC */
+	(void)va_arg(ap, uint32_t);	/* media SSRC */
+	ench = va_arg(ap, rtcp_encode_h *);
+	arg  = va_arg(ap, void *);
+	va_end(ap);
+
+	return ench ? ench(mb, arg) : 0;
+}
+
+
+/*
+ * stream, a receive-only video stream without jitter buffer
+ */
+
+int sdp_media_ldir(const struct sdp_media *m)
+{
+	(void)m;
+
+	return SDP_RECVONLY;
+}
+
+
+const char *sdp_media_name(const struct sdp_media *m)
+{
+	(void)m;
+
+	return "video";
+}
+
+
+void metric_add_packet(struct metric *metric, size_t len)
+{
+	(void)metric;
+	(void)len;
+}
+
+
+bool isVideo(struct stream *s)
+{
+	(void)s;
+
+	return true;
+}
+
+
+/* counts the requests, the test program plays the sender's answer */
+void stream_send_fir(struct stream *s, bool pli)
+{
+	(void)s;
+	(void)pli;
+
+	++stub_n_fir;
+}
+
+
+int jbuf_put(struct jbuf *jb, const struct rtp_header *hdr, void *mem)
+{
+	(void)jb;
+	(void)hdr;
+	(void)mem;
+
+	return ENOSYS;
+}
+
+
+int jbuf_get(struct jbuf *jb, struct rtp_header *hdr, void **mem)
+{
+	(void)jb;
+	(void)hdr;
+	(void)mem;
+
+	return ENOENT;
+}
+
+
+void jbuf_flush(struct jbuf *jb)
+{
+	(void)jb;
+}
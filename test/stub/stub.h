@@ -0,0 +1,22 @@
+/**
+ * @file stub.h  Controls of the libre/baresip stand-ins, for the test programs
+ *
+ * Copyright (C) 2015 SeNSE Project
+ */
+
+/* virtual clock behind tmr_jiffies() and the timers, in [ms] */
+void     stub_clock_set(uint64_t ms);
+uint64_t stub_tmr_next(void);
+void     stub_tmr_poll(void);
+
+/* config values returned by conf_get_u32() and conf_get_bool() */
+void stub_conf_set(const char *name, uint32_t val);
+
+/* counts mem_zalloc(), mem_alloc() and mbuf_alloc() calls */
+extern unsigned long long stub_n_alloc;
+
+/* stream_send_fir() calls */
+extern unsigned stub_n_fir;
+
+/* warning() prints only when set */
+extern bool stub_verbose;
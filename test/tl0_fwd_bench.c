@@ -0,0 +1,409 @@
+/**
+ * @file tl0_fwd_bench.c  TL0D selective forwarding to many legs
+ *
+ * A three layer TL0D stream is passed through tl0_fwd_recv() to a number
+ * of legs, in virtual time. The legs either have a fixed temporal layer
+ * limit of 0, 1 or 2, or a capacity of 300 kbit/s, 500 kbit/s or none,
+ * with the limit following the measured layer rates. Every packet a leg
+ * gets is checked: contiguous sequence numbers, no temporal ID above the
+ * limit, and fsn/lsn rewritten to the leg's sequence numbers of the TL0
+ * access unit. Every fourth leg loses two TL0 packets every 50 groups and
+ * NACKs them: tl0_fwd_leg_nack() has to map them back to the incoming
+ * sequence numbers, and the packets resent with tl0_fwd_leg_resend() have
+ * to arrive with the sequence numbers and fsn/lsn the leg lost. Throughput
+ * is given in received and forwarded packets per second:
+ *
+ *   tl0_fwd_bench [legs] [groups]
+ *
+ * Copyright (C) 2015 SeNSE Project
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+#include "tl0.h"
+#include "stub.h"
+
+
+enum {
+	DEFAULT_LEGS   = 60,
+	DEFAULT_GROUPS = 20000,
+	PKT_LEN        = 1200,
+	GROUP_MS       = 133,
+	LOSS_INTERVAL  = 50,		/* groups */
+};
+
+/* decode and sending order of one TL0 group */
+static const struct {
+	uint8_t tid;
+	uint8_t seq_id;
+	uint8_t npkt;
+} groupv[] = {
+	{0, 0, 4},
+	{2, 0, 2},
+	{1, 0, 2},
+	{2, 1, 2},
+};
+
+/* with a capacity, the layers that fit the stream above */
+static const uint32_t capv[3] = {300000, 500000, 0};
+static const uint8_t cap_tid[3] = {0, 1, 2};
+
+struct leg
+{
+	struct tl0_fwd_leg *l;
+	uint8_t max_tid;
+
+	bool started;
+	uint16_t next;			/* expected sequence number */
+	bool in_tl0;
+	uint8_t tl0;
+	uint16_t tl0_first, tl0_last;	/* of the current TL0 AU, leg numbering */
+
+	unsigned long long n_pkt;
+	unsigned long long n_seq;	/* gaps or jumps in the sequence numbers */
+	unsigned long long n_tid;	/* packets above the layer limit */
+	unsigned long long n_fsn;	/* fsn/lsn not matching the leg numbering */
+
+	bool lossy;
+	bool resending;
+	unsigned lostc;
+	struct {
+		uint16_t seq, src;	/* leg and incoming sequence number */
+		uint16_t fsn, lsn;	/* as the leg would have seen them */
+	} lostv[2];
+	unsigned long long n_rtx;	/* retransmissions as lost */
+	unsigned long long n_rtx_bad;	/* NACKs mapped wrong, or resent packets not as lost */
+};
+
+/* the packet being forwarded, lost on the lossy legs */
+static uint16_t cur_src;
+static bool cur_lose;
+
+
+int rtcp_send(struct rtp_sock *rs, struct mbuf *mb)
+{
+	return 0;
+}
+
+
+int rtcp_stats(struct rtp_sock *rs, uint32_t ssrc, struct rtcp_stats *stats)
+{
+	return ENOENT;
+}
+
+
+uint32_t rtp_sess_ssrc(const struct rtp_sock *rs)
+{
+	return 1;
+}
+
+
+static int send_handler(const struct rtp_header *hdr, const uint8_t *t,
+			size_t tl0d_len, const uint8_t *pld, size_t pld_len,
+			void *arg)
+{
+	struct leg *g = arg;
+	uint16_t fsn = t[6] << 8 | t[7];
+	uint16_t lsn = t[8] << 8 | t[9];
+	uint8_t tid = t[3] >> 5;
+
+	/* a retransmission, of the packet the leg lost */
+	if (g->resending) {
+		const unsigned i = g->lostc++;
+
+		if (i < RE_ARRAY_SIZE(g->lostv) && hdr->seq == g->lostv[i].seq &&
+		    fsn == g->lostv[i].fsn && lsn == g->lostv[i].lsn && tid == 0) {
+			g->n_rtx++;
+			g->n_pkt++;
+		}
+		else {
+			g->n_rtx_bad++;
+		}
+
+		return 0;
+	}
+
+	if (g->started && hdr->seq != g->next)
+		g->n_seq++;
+
+	g->started = true;
+	g->next    = hdr->seq + 1;
+
+	if (tid > g->max_tid)
+		g->n_tid++;
+
+	if (tid == 0) {
+		if (!g->in_tl0 || g->tl0 != t[5]) {
+			g->in_tl0    = true;
+			g->tl0       = t[5];
+			g->tl0_first = hdr->seq;
+		}
+
+		g->tl0_last = hdr->seq;
+
+		if (fsn != g->tl0_first || (hdr->m && lsn != hdr->seq))
+			g->n_fsn++;
+	}
+	else {
+		g->in_tl0 = false;
+
+		/* enhancement packets carry the fsn/lsn of their TL0 AU */
+		if (fsn != g->tl0_first || lsn != g->tl0_last)
+			g->n_fsn++;
+	}
+
+	if (g->lossy && cur_lose && g->lostc < RE_ARRAY_SIZE(g->lostv)) {
+		g->lostv[g->lostc].seq = hdr->seq;
+		g->lostv[g->lostc].src = cur_src;
+		g->lostv[g->lostc].fsn = fsn;
+		g->lostv[g->lostc].lsn = lsn;
+		g->lostc++;
+		return 0;
+	}
+
+	g->n_pkt++;
+
+	return 0;
+}
+
+
+/* packet k of AU i of TL0 group g, with the fsn/lsn of the group's TL0 AU */
+static void pkt_build(struct mbuf *mb, struct rtp_header *hdr, unsigned g,
+		      size_t i, int k, uint16_t fsn, uint16_t lsn)
+{
+	uint8_t n = groupv[i].npkt;
+	uint8_t *p = mb->buf;
+	size_t j;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->seq = fsn + k;
+	for (j = 0; j < i; j++)
+		hdr->seq += groupv[j].npkt;
+	hdr->m = k == n - 1;
+
+	p[0] = 0x60 | 31;
+	p[1] = 0x80;
+	p[2] = 0x00;
+	p[3] = groupv[i].tid << 5 | 0x03;
+	p[4] = (n & 0x7f) | groupv[i].seq_id << 7;
+	p[5] = (uint8_t)g;
+	p[6] = fsn >> 8;
+	p[7] = fsn & 0xff;
+	p[8] = lsn >> 8;
+	p[9] = lsn & 0xff;
+
+	mb->pos = 0;
+	mb->end = PKT_LEN;
+}
+
+
+/*
+ * The lossy leg NACKs the two TL0 packets it lost and the packet after
+ * the TL0 AU, which is no TL0 packet and must not be mapped. The mapped
+ * packets are rebuilt and resent to the leg.
+ */
+static int leg_nack(struct leg *leg, struct mbuf *mb, unsigned g,
+		    uint16_t fsn, uint16_t lsn)
+{
+	uint16_t seqv[17];
+	size_t n = RE_ARRAY_SIZE(seqv), j;
+	uint16_t pid, blp;
+	int err;
+
+	if (leg->lostc != RE_ARRAY_SIZE(leg->lostv)) {
+		leg->n_rtx_bad++;
+		return 0;
+	}
+
+	pid = leg->lostv[0].seq;
+	blp = 1 << (uint16_t)(leg->lostv[1].seq - pid - 1) |
+	      1 << (uint16_t)(leg->lostv[1].seq - pid);
+
+	err = tl0_fwd_leg_nack(leg->l, pid, blp, seqv, &n);
+	if (err)
+		return err;
+
+	if (n != RE_ARRAY_SIZE(leg->lostv)) {
+		leg->n_rtx_bad++;
+		n = 0;
+	}
+
+	leg->lostc = 0;
+	leg->resending = true;
+
+	for (j = 0; j < n && !err; j++) {
+		struct rtp_header hdr;
+
+		if (seqv[j] != leg->lostv[j].src) {
+			leg->n_rtx_bad++;
+			continue;
+		}
+
+		pkt_build(mb, &hdr, g, 0, (uint16_t)(seqv[j] - fsn), fsn, lsn);
+		err = tl0_fwd_leg_resend(leg->l, &hdr, mb);
+	}
+
+	leg->resending = false;
+	leg->lostc = 0;
+
+	return err;
+}
+
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static int run(const char *name, bool capacity, unsigned legc, unsigned groups)
+{
+	struct tl0_fwd *fwd = NULL;
+	struct leg *legv;
+	struct mbuf *mb;
+	unsigned long long n_in = 0, n_out = 0, n_bad = 0, n_loss = 0;
+	uint16_t seq = 65000;
+	uint64_t now = 1000;
+	unsigned g, i;
+	double t;
+	int k, err;
+
+	legv = calloc(legc, sizeof(*legv));
+	mb   = mbuf_alloc(PKT_LEN);
+	if (!legv || !mb) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	memset(mb->buf, 0x65, PKT_LEN);
+	stub_clock_set(now);
+
+	err = tl0_fwd_alloc(&fwd);
+	if (err)
+		goto out;
+
+	for (i = 0; i < legc; i++) {
+		struct leg *leg = &legv[i];
+
+		leg->max_tid = capacity ? cap_tid[i % 3] : i % 3;
+		leg->lossy   = i % 4 == 0;
+
+		err = tl0_fwd_leg_add(&leg->l, fwd, capacity ? capv[i % 3] : 0,
+				      send_handler, leg);
+		if (err)
+			goto out;
+
+		if (!capacity)
+			tl0_fwd_leg_set_max_tid(leg->l, leg->max_tid);
+	}
+
+	t = now_s();
+
+	for (g = 0; g < groups; g++) {
+		uint16_t fsn = seq, lsn = seq + groupv[0].npkt - 1;
+		bool loss = g % LOSS_INTERVAL == LOSS_INTERVAL / 2;
+
+		for (i = 0; i < RE_ARRAY_SIZE(groupv); i++) {
+			for (k = 0; k < groupv[i].npkt; k++) {
+				struct rtp_header hdr;
+
+				pkt_build(mb, &hdr, g, i, k, fsn, lsn);
+				seq++;
+
+				/* TL0 packets 1 and 3 */
+				cur_src  = hdr.seq;
+				cur_lose = loss && i == 0 && k % 2;
+
+				err |= tl0_fwd_recv(fwd, &hdr, mb);
+				n_in++;
+			}
+		}
+
+		cur_lose = false;
+
+		for (i = 0; loss && i < legc; i++) {
+			if (legv[i].lossy)
+				err |= leg_nack(&legv[i], mb, g, fsn, lsn);
+		}
+
+		n_loss += loss;
+
+		now += GROUP_MS;
+		stub_clock_set(now);
+	}
+
+	t = now_s() - t;
+
+	for (i = 0; i < legc; i++) {
+		const struct leg *leg = &legv[i];
+		unsigned long long want = 0;
+		size_t j;
+
+		for (j = 0; j < RE_ARRAY_SIZE(groupv); j++) {
+			if (groupv[j].tid <= leg->max_tid)
+				want += groupv[j].npkt;
+		}
+		want *= groups;
+
+		/* with a capacity the limit follows the measured rates */
+		if ((capacity && leg->max_tid < 2) ? leg->n_pkt > want : leg->n_pkt != want) {
+			fprintf(stderr, "%s: leg %u got %llu packets, expected %s%llu\n",
+				name, i, leg->n_pkt, capacity ? "at most " : "", want);
+			n_bad++;
+		}
+
+		if (leg->lossy && (leg->n_rtx != 2 * n_loss || leg->n_rtx_bad)) {
+			fprintf(stderr, "%s: leg %u: %llu of %llu lost packets resent"
+				" as lost, %llu NACKs mapped or resent wrong\n", name, i,
+				leg->n_rtx, 2 * n_loss, leg->n_rtx_bad);
+			n_bad++;
+		}
+
+		if (leg->n_seq || leg->n_tid || leg->n_fsn) {
+			fprintf(stderr, "%s: leg %u: %llu sequence gaps, %llu packets"
+				" above TID %u, %llu wrong fsn/lsn\n", name, i,
+				leg->n_seq, leg->n_tid, leg->max_tid, leg->n_fsn);
+			n_bad++;
+		}
+
+		n_out += leg->n_pkt;
+	}
+
+	printf("%-10s %3u legs  %9.0f packets/s in  %10.0f packets/s out"
+	       "  %5.0f ns/packet in\n", name, legc, n_in / t, n_out / t,
+	       t * 1e9 / n_in);
+
+	if (n_bad)
+		err = EPROTO;
+
+ out:
+	for (i = 0; legv && i < legc; i++)
+		mem_deref(legv[i].l);
+	mem_deref(fwd);
+	mem_deref(mb);
+	free(legv);
+
+	return err;
+}
+
+
+int main(int argc, char **argv)
+{
+	unsigned legc   = argc > 1 ? (unsigned)atoi(argv[1]) : DEFAULT_LEGS;
+	unsigned groups = argc > 2 ? (unsigned)atoi(argv[2]) : DEFAULT_GROUPS;
+	int err;
+
+	printf("%u TL0 groups, %d byte packets\n", groups, PKT_LEN);
+
+	err  = run("layers", false, legc, groups);
+	err |= run("capacity", true, legc, groups);
+
+	return err ? 1 : 0;
+}
@@ -0,0 +1,548 @@
+/**
+ * @file tl0_rx_sim.c  TL0 receiver over simulated lossy channels
+ *
+ * A TL0D stream of three temporal layers is sent through a seeded channel
+ * model into rtp_recv_tl0(), in virtual time. The sender answers every
+ * Generic NACK with a retransmission one RTT later, which passes the
+ * channel again. Per channel the program reports how many of the lost
+ * base layer packets were recovered, the NACK FCIs and FIRs it took, the
+ * time to complete a TL0 access unit, the hand-offs to the decoder and
+ * the time spent per packet in the receiver. A FIR is answered with a
+ * stream that starts over at TL0PICIDX 0:
+ *
+ *   tl0_rx_sim [groups] [seed]
+ *
+ * It fails when the receiver NACKs a packet that is not base layer, hands
+ * a packet off twice or out of order, or loses anything on a clean channel.
+ *
+ * Copyright (C) 2015 SeNSE Project
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+#include "tl0.h"
+#include "stub.h"
+
+
+enum {
+	DEFAULT_GROUPS = 2000,
+	FRAME_MS       = 33,
+	DELAY_MS       = 25,	/* one way, the RTT is twice that */
+	PKT_LEN        = 64,
+	MAX_EVENTS     = 8192,
+	DRAIN_MS       = 2000,
+};
+
+/* decode and sending order of one TL0 group */
+static const struct {
+	uint8_t tid;
+	uint8_t seq_id;
+	uint8_t npkt;
+} groupv[] = {
+	{0, 0, 6},
+	{2, 0, 2},
+	{1, 0, 3},
+	{2, 1, 2},
+};
+
+enum model {
+	BERNOULLI,
+	GILBERT_ELLIOTT,
+	REORDER,
+};
+
+/*
+ * Bernoulli loses every packet with probability p. Gilbert-Elliott moves
+ * from the good to the bad state with p and back with r, and loses with
+ * h in the bad state only. Reorder starts a burst with probability burst,
+ * the next burst_len packets arrive burst_ms late; on top of that packets
+ * are lost with p.
+ */
+struct channel
+{
+	const char *name;
+	enum model model;
+	double p;
+	double r;
+	double h;
+	double burst;
+	unsigned burst_len;
+	unsigned burst_ms;
+
+	/* state */
+	bool bad;
+	unsigned burst_left;
+};
+
+/* what the sender knows about a sequence number */
+struct pkt
+{
+	bool sent;
+	bool lost;		/* in the first transmission */
+	bool marker;
+	uint8_t tid;
+	uint8_t seq_id;
+	uint8_t n_enh;
+	uint8_t tl0;
+	uint16_t fsn, lsn;
+	uint32_t au;
+	uint8_t n_handoff;
+};
+
+struct event
+{
+	uint64_t t;
+	uint64_t n;		/* keeps the sending order at equal times */
+	uint16_t seq;
+};
+
+struct sim
+{
+	struct channel *ch;
+	uint64_t rng;
+	uint64_t now;
+
+	uint16_t seq;
+	uint8_t tl0;
+	uint16_t fsn, lsn;	/* of the current TL0 AU */
+	uint32_t au;
+
+	struct event evv[MAX_EVENTS];
+	size_t evc;
+	uint64_t ev_n;
+
+	unsigned long long n_sent;
+	unsigned long long n_lost;
+	unsigned long long n_tl0_lost;
+	unsigned long long n_tl0_recovered;
+	unsigned long long n_rtx;
+	unsigned long long n_tl0_au;
+	unsigned long long n_tl0_au_done;
+	unsigned n_bad_nack;
+	unsigned n_dup;
+	unsigned n_order;
+	unsigned n_overflow;
+	uint16_t last_seq;
+	bool started;
+
+	uint8_t *au_npkt;	/* packets per access unit, and handed off */
+	uint8_t *au_handed;
+};
+
+static struct pkt pktv[65536];
+static struct stream strm;
+static struct sim sim;
+
+
+static double rnd(void)
+{
+	/* xorshift64*, the same stream for a seed on every platform */
+	sim.rng ^= sim.rng >> 12;
+	sim.rng ^= sim.rng << 25;
+	sim.rng ^= sim.rng >> 27;
+
+	return (sim.rng * 2685821657736338717ULL >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/* true if the packet gets through, *late is its extra delay in [ms] */
+static bool channel_pass(struct channel *ch, uint64_t *late)
+{
+	*late = 0;
+
+	switch (ch->model) {
+
+	case BERNOULLI:
+		return rnd() >= ch->p;
+
+	case GILBERT_ELLIOTT:
+		if (ch->bad)
+			ch->bad = rnd() >= ch->r;
+		else
+			ch->bad = rnd() < ch->p;
+
+		return !ch->bad || rnd() >= ch->h;
+
+	case REORDER:
+		if (!ch->burst_left && rnd() < ch->burst)
+			ch->burst_left = ch->burst_len;
+
+		if (ch->burst_left) {
+			--ch->burst_left;
+			*late = ch->burst_ms;
+		}
+
+		return rnd() >= ch->p;
+	}
+
+	return true;
+}
+
+
+static void ev_push(uint64_t t, uint16_t seq)
+{
+	struct event ev;
+	size_t i;
+
+	if (sim.evc == MAX_EVENTS) {
+		sim.n_overflow++;
+		return;
+	}
+
+	ev.t   = t;
+	ev.n   = sim.ev_n++;
+	ev.seq = seq;
+
+	/* binary heap on (t, n) */
+	for (i = sim.evc++; i > 0; i = (i - 1) / 2) {
+		const struct event *up = &sim.evv[(i - 1) / 2];
+
+		if (up->t < ev.t || (up->t == ev.t && up->n < ev.n))
+			break;
+
+		sim.evv[i] = *up;
+	}
+
+	sim.evv[i] = ev;
+}
+
+
+static bool ev_before(const struct event *a, const struct event *b)
+{
+	return a->t < b->t || (a->t == b->t && a->n < b->n);
+}
+
+
+static struct event ev_pop(void)
+{
+	struct event top = sim.evv[0];
+	struct event last = sim.evv[--sim.evc];
+	size_t i = 0;
+
+	for (;;) {
+		size_t c = 2 * i + 1;
+
+		if (c >= sim.evc)
+			break;
+
+		if (c + 1 < sim.evc && ev_before(&sim.evv[c + 1], &sim.evv[c]))
+			c++;
+
+		if (!ev_before(&sim.evv[c], &last))
+			break;
+
+		sim.evv[i] = sim.evv[c];
+		i = c;
+	}
+
+	sim.evv[i] = last;
+
+	return top;
+}
+
+
+int rtcp_stats(struct rtp_sock *rs, uint32_t ssrc, struct rtcp_stats *stats)
+{
+	stats->rtt = 2 * DELAY_MS * 1000;
+
+	return 0;
+}
+
+
+uint32_t rtp_sess_ssrc(const struct rtp_sock *rs)
+{
+	return 1;
+}
+
+
+static void retransmit(uint16_t seq)
+{
+	const struct pkt *p = &pktv[seq];
+	uint64_t late;
+
+	if (!p->sent || p->tid) {
+		sim.n_bad_nack++;
+		return;
+	}
+
+	sim.n_rtx++;
+
+	/* the NACK travels up, the retransmission down */
+	if (channel_pass(sim.ch, &late))
+		ev_push(sim.now + 2 * DELAY_MS + late, seq);
+}
+
+
+/* the sender side of a Generic NACK, FCIs as encoded by the receiver */
+int rtcp_send(struct rtp_sock *rs, struct mbuf *mb)
+{
+	size_t i;
+	int k;
+
+	for (i = 0; i + 4 <= mb->end; i += 4) {
+		uint16_t pid = mb->buf[i] << 8 | mb->buf[i + 1];
+		uint16_t blp = mb->buf[i + 2] << 8 | mb->buf[i + 3];
+
+		retransmit(pid);
+
+		for (k = 0; k < 16; k++) {
+			if (blp & (1 << k))
+				retransmit(pid + k + 1);
+		}
+	}
+
+	return 0;
+}
+
+
+static void handoff(const struct rtp_header *hdr, struct mbuf *mb, void *arg)
+{
+	struct pkt *p = &pktv[hdr->seq];
+
+	if (p->n_handoff++)
+		sim.n_dup++;
+
+	if (sim.started && (int16_t)(hdr->seq - sim.last_seq) <= 0)
+		sim.n_order++;
+
+	sim.started  = true;
+	sim.last_seq = hdr->seq;
+
+	if (p->tid == 0 && p->lost)
+		sim.n_tl0_recovered++;
+
+	if (++sim.au_handed[p->au] == sim.au_npkt[p->au] && p->tid == 0)
+		sim.n_tl0_au_done++;
+}
+
+
+static void deliver(uint16_t seq)
+{
+	const struct pkt *p = &pktv[seq];
+	struct rtp_header hdr;
+	struct mbuf *mb;
+	uint8_t b[PKT_LEN];
+
+	memset(b, 0xab, sizeof(b));
+	b[0] = 0x60 | 31;
+	b[1] = 0x80;
+	b[2] = 0x00;
+	b[3] = p->tid << 5 | 0x03;
+	b[4] = (p->n_enh & 0x7f) | p->seq_id << 7;
+	b[5] = p->tl0;
+	b[6] = p->fsn >> 8;
+	b[7] = p->fsn & 0xff;
+	b[8] = p->lsn >> 8;
+	b[9] = p->lsn & 0xff;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.ssrc = 0x1234;
+	hdr.seq  = seq;
+	hdr.m    = p->marker;
+
+	mb = mbuf_alloc(sizeof(b));
+	if (!mb)
+		return;
+
+	(void)mbuf_write_mem(mb, b, sizeof(b));
+	mb->pos = 0;
+
+	rtp_recv_tl0(NULL, &hdr, mb, &strm);
+
+	mem_deref(mb);
+}
+
+
+/* runs arrivals and receiver timers up to end, in time order */
+static void advance(uint64_t end)
+{
+	for (;;) {
+		uint64_t te = sim.evc ? sim.evv[0].t : UINT64_MAX;
+		uint64_t tt = stub_tmr_next();
+
+		if (te > end && tt > end)
+			break;
+
+		if (tt <= te) {
+			sim.now = tt;
+			stub_clock_set(tt);
+			stub_tmr_poll();
+		}
+		else {
+			struct event ev = ev_pop();
+
+			sim.now = ev.t;
+			stub_clock_set(ev.t);
+			deliver(ev.seq);
+		}
+	}
+
+	sim.now = end;
+	stub_clock_set(end);
+}
+
+
+static void send_au(uint8_t tid, uint8_t seq_id, uint8_t npkt)
+{
+	int k;
+
+	if (tid == 0) {
+		++sim.tl0;
+		sim.fsn = sim.seq;
+		sim.lsn = sim.seq + npkt - 1;
+		sim.n_tl0_au++;
+	}
+
+	sim.au_npkt[sim.au] = npkt;
+
+	for (k = 0; k < npkt; k++) {
+		struct pkt *p = &pktv[sim.seq];
+		uint64_t late;
+
+		memset(p, 0, sizeof(*p));
+		p->sent   = true;
+		p->marker = k == npkt - 1;
+		p->tid    = tid;
+		p->seq_id = seq_id;
+		p->n_enh  = npkt;
+		p->tl0    = sim.tl0;
+		p->fsn    = sim.fsn;
+		p->lsn    = sim.lsn;
+		p->au     = sim.au;
+
+		if (channel_pass(sim.ch, &late)) {
+			ev_push(sim.now + DELAY_MS + late, sim.seq);
+		}
+		else {
+			p->lost = true;
+			sim.n_lost++;
+			if (tid == 0)
+				sim.n_tl0_lost++;
+		}
+
+		sim.n_sent++;
+		sim.seq++;
+	}
+
+	sim.au++;
+}
+
+
+static int run(struct channel *ch, unsigned groups, uint64_t seed)
+{
+	struct tl0_rx_stats st;
+	unsigned g, fir = 0;
+	size_t i;
+	bool clean = ch->model == BERNOULLI && ch->p == 0;
+	int err = 0;
+
+	mem_deref(strm.tl0);
+	memset(&strm, 0, sizeof(strm));
+	memset(&sim, 0, sizeof(sim));
+	memset(pktv, 0, sizeof(pktv));
+
+	strm.rtph = handoff;
+	stub_n_fir = 0;
+
+	sim.ch   = ch;
+	sim.rng  = seed * 0x9e3779b97f4a7c15ULL | 1;
+	sim.seq  = 65000;
+	sim.now  = 1000;
+	ch->bad  = false;
+	ch->burst_left = 0;
+	stub_clock_set(sim.now);
+
+	sim.au_npkt   = calloc(groups * RE_ARRAY_SIZE(groupv), 1);
+	sim.au_handed = calloc(groups * RE_ARRAY_SIZE(groupv), 1);
+	if (!sim.au_npkt || !sim.au_handed) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	for (g = 0; g < groups; g++) {
+
+		/* a FIR is answered with an IDR picture at TL0PICIDX 0 */
+		if (stub_n_fir != fir) {
+			fir = stub_n_fir;
+			sim.tl0 = 255;
+		}
+
+		for (i = 0; i < RE_ARRAY_SIZE(groupv); i++) {
+			send_au(groupv[i].tid, groupv[i].seq_id, groupv[i].npkt);
+			advance(sim.now + FRAME_MS);
+		}
+	}
+
+	advance(sim.now + DRAIN_MS);
+
+	tl0_rx_stats(strm.tl0, &st);
+
+	printf("%-16s %5.2f%% lost  TL0 recovered %6.2f%%  TL0 AUs %6.2f%%"
+	       "  NACK FCIs %6llu  FIRs %3u  complete avg %3llu max %3llu ms"
+	       "  handoffs %6llu  %4llu ns/packet\n",
+	       ch->name, 100.0 * sim.n_lost / sim.n_sent,
+	       sim.n_tl0_lost ? 100.0 * sim.n_tl0_recovered / sim.n_tl0_lost : 100.0,
+	       100.0 * sim.n_tl0_au_done / sim.n_tl0_au,
+	       st.n_nack_fci, stub_n_fir,
+	       st.n_au_complete ? st.complete_ms_sum / st.n_au_complete : 0ULL,
+	       st.complete_ms_max, st.n_handoff,
+	       st.n_pkt ? st.ns_sum / st.n_pkt : 0ULL);
+
+	if (sim.n_bad_nack)
+		fprintf(stderr, "%s: %u NACKs for enhancement or unsent packets\n",
+			ch->name, sim.n_bad_nack);
+	if (sim.n_dup)
+		fprintf(stderr, "%s: %u packets handed off twice\n", ch->name, sim.n_dup);
+	if (sim.n_order)
+		fprintf(stderr, "%s: %u packets handed off out of order\n",
+			ch->name, sim.n_order);
+	if (sim.n_overflow)
+		fprintf(stderr, "%s: %u packets beyond the channel queue\n",
+			ch->name, sim.n_overflow);
+	if (clean && (st.n_handoff != sim.n_sent || st.n_nack_fci))
+		fprintf(stderr, "%s: %llu of %llu packets decoded, %llu NACK FCIs\n",
+			ch->name, st.n_handoff, sim.n_sent, st.n_nack_fci);
+
+	if (sim.n_bad_nack || sim.n_dup || sim.n_order || sim.n_overflow ||
+	    (clean && (st.n_handoff != sim.n_sent || st.n_nack_fci)))
+		err = EPROTO;
+
+ out:
+	free(sim.au_npkt);
+	free(sim.au_handed);
+
+	return err;
+}
+
+
+int main(int argc, char **argv)
+{
+	static struct channel chv[] = {
+		{"clean",          BERNOULLI,       0,    0,    0,   0,    0, 0, false, 0},
+		{"bernoulli 2%",   BERNOULLI,       0.02, 0,    0,   0,    0, 0, false, 0},
+		{"bernoulli 10%",  BERNOULLI,       0.10, 0,    0,   0,    0, 0, false, 0},
+		{"gilbert-elliott", GILBERT_ELLIOTT, 0.01, 0.25, 0.5, 0,    0, 0, false, 0},
+		{"g-e bursts",     GILBERT_ELLIOTT, 0.02, 0.10, 0.8, 0,    0, 0, false, 0},
+		{"reorder bursts", REORDER,         0.01, 0,    0,   0.02, 4, 15, false, 0},
+	};
+	unsigned groups = argc > 1 ? (unsigned)atoi(argv[1]) : DEFAULT_GROUPS;
+	uint64_t seed = argc > 2 ? strtoull(argv[2], NULL, 0) : 1;
+	unsigned npkt = 0;
+	size_t i;
+	int err = 0;
+
+	for (i = 0; i < RE_ARRAY_SIZE(groupv); i++)
+		npkt += groupv[i].npkt;
+
+	printf("%u TL0 groups, %u packets each, %d ms one way delay, seed %llu\n",
+	       groups, npkt, DELAY_MS, (unsigned long long)seed);
+
+	for (i = 0; i < RE_ARRAY_SIZE(chv); i++)
+		err |= run(&chv[i], groups, seed);
+
+	mem_deref(strm.tl0);
+
+	return err ? 1 : 0;
+}
@@ -0,0 +1,304 @@
+/**
+ * @file tl0_rx_test.c  TL0 receiver tests: joining a stream and FIR resets
+ *
+ * A lossless TL0D stream is fed to rtp_recv_tl0() in sending order, one
+ * access unit per 33 ms of virtual time. Every packet has to reach the
+ * decoder in order, and no NACK may be sent, also when the stream is
+ * joined at any TL0PICIDX or restarts at 0 after a FIR.
+ *
+ * Copyright (C) 2015 SeNSE Project
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+#include "tl0.h"
+#include "stub.h"
+
+
+enum {
+	FRAME_MS = 33,
+	PKT_LEN  = 16,
+};
+
+/* decode and sending order of one TL0 group */
+static const struct {
+	uint8_t tid;
+	uint8_t seq_id;
+	uint8_t npkt;
+} groupv[] = {
+	{0, 0, 3},
+	{2, 0, 1},
+	{1, 0, 2},
+	{2, 1, 1},
+};
+
+struct sender
+{
+	uint16_t seq;
+	uint8_t tl0;
+	uint16_t fsn, lsn;	/* of the current TL0 AU */
+	uint64_t now;
+	unsigned long long n_sent;
+	bool drop;		/* the channel loses everything */
+};
+
+struct decoder
+{
+	unsigned long long n_pkt;
+	uint16_t last_seq;
+	bool started;
+	unsigned n_order;
+};
+
+static struct stream strm;
+static struct decoder dec;
+static unsigned n_fci;
+static unsigned n_fail;
+
+
+int rtcp_send(struct rtp_sock *rs, struct mbuf *mb)
+{
+	(void)rs;
+
+	n_fci += mb->end / 4;
+
+	return 0;
+}
+
+
+int rtcp_stats(struct rtp_sock *rs, uint32_t ssrc, struct rtcp_stats *stats)
+{
+	return ENOENT;
+}
+
+
+uint32_t rtp_sess_ssrc(const struct rtp_sock *rs)
+{
+	return 1;
+}
+
+
+static void handoff(const struct rtp_header *hdr, struct mbuf *mb, void *arg)
+{
+	struct decoder *d = arg;
+
+	if (d->started && (int16_t)(hdr->seq - d->last_seq) <= 0)
+		d->n_order++;
+
+	d->started  = true;
+	d->last_seq = hdr->seq;
+	d->n_pkt++;
+}
+
+
+static void clock_advance(struct sender *snd, uint64_t ms)
+{
+	uint64_t end = snd->now + ms;
+
+	while (stub_tmr_next() <= end) {
+		snd->now = stub_tmr_next();
+		stub_clock_set(snd->now);
+		stub_tmr_poll();
+	}
+
+	snd->now = end;
+	stub_clock_set(end);
+}
+
+
+static void send_pkt(struct sender *snd, uint8_t tid, uint8_t seq_id,
+		     uint8_t n_enh, bool marker)
+{
+	struct rtp_header hdr;
+	struct mbuf *mb;
+	uint8_t p[PKT_LEN];
+
+	memset(p, 0xab, sizeof(p));
+	p[0] = 0x60 | 31;
+	p[1] = 0x80;
+	p[2] = 0x00;
+	p[3] = tid << 5 | 0x03;
+	p[4] = (n_enh & 0x7f) | seq_id << 7;
+	p[5] = snd->tl0;
+	p[6] = snd->fsn >> 8;
+	p[7] = snd->fsn & 0xff;
+	p[8] = snd->lsn >> 8;
+	p[9] = snd->lsn & 0xff;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.ssrc = 0x1234;
+	hdr.seq  = snd->seq++;
+	hdr.m    = marker;
+
+	if (snd->drop)
+		return;
+
+	mb = mbuf_alloc(sizeof(p));
+	(void)mbuf_write_mem(mb, p, sizeof(p));
+	mb->pos = 0;
+
+	rtp_recv_tl0(NULL, &hdr, mb, &strm);
+	snd->n_sent++;
+
+	mem_deref(mb);
+}
+
+
+/* one TL0 group, the TL0 AU numbered with the next TL0PICIDX */
+static void send_group(struct sender *snd)
+{
+	size_t i;
+	int k;
+
+	for (i = 0; i < RE_ARRAY_SIZE(groupv); i++) {
+		uint8_t n = groupv[i].npkt;
+
+		if (groupv[i].tid == 0) {
+			++snd->tl0;
+			snd->fsn = snd->seq;
+			snd->lsn = snd->seq + n - 1;
+		}
+
+		for (k = 0; k < n; k++)
+			send_pkt(snd, groupv[i].tid, groupv[i].seq_id, n, k == n - 1);
+
+		clock_advance(snd, FRAME_MS);
+	}
+}
+
+
+static void check(bool ok, const char *what)
+{
+	if (ok)
+		return;
+
+	fprintf(stderr, "FAIL: %s\n", what);
+	n_fail++;
+}
+
+
+static void stream_reset(void)
+{
+	mem_deref(strm.tl0);
+	memset(&strm, 0, sizeof(strm));
+	memset(&dec, 0, sizeof(dec));
+
+	strm.rtph = handoff;
+	strm.arg  = &dec;
+
+	n_fci = 0;
+	stub_n_fir = 0;
+}
+
+
+/* the first packet arrives at TL0PICIDX first + 1, the stream then wraps */
+static void test_join(uint8_t first)
+{
+	uint8_t at = first + 1;
+	struct sender snd;
+	char what[64];
+	int g;
+
+	stream_reset();
+
+	memset(&snd, 0, sizeof(snd));
+	snd.tl0 = first;
+	snd.seq = 65000;
+	snd.now = 1000;
+	stub_clock_set(snd.now);
+
+	for (g = 0; g < 300; g++)
+		send_group(&snd);
+
+	clock_advance(&snd, 1000);
+
+	snprintf(what, sizeof(what), "join at %u: all packets decoded", at);
+	check(dec.n_pkt == snd.n_sent, what);
+	snprintf(what, sizeof(what), "join at %u: decode order", at);
+	check(dec.n_order == 0, what);
+	snprintf(what, sizeof(what), "join at %u: no NACKs", at);
+	check(n_fci == 0, what);
+	snprintf(what, sizeof(what), "join at %u: no FIR", at);
+	check(stub_n_fir == 0, what);
+}
+
+
+/*
+ * A TL0 AU is lost for good at TL0PICIDX lost, the receiver asks for a
+ * FIR and the sender answers with a stream that starts over at 0
+ */
+static void test_fir_reset(uint8_t lost)
+{
+	unsigned long long sent, decoded;
+	struct sender snd;
+	char what[64];
+	int g;
+
+	stream_reset();
+
+	memset(&snd, 0, sizeof(snd));
+	snd.seq = 100;
+	snd.now = 1000;
+	stub_clock_set(snd.now);
+
+	while (snd.tl0 != (uint8_t)(lost - 1))
+		send_group(&snd);
+
+	snd.drop = true;
+	send_group(&snd);
+	snd.drop = false;
+
+	for (g = 0; g < 10 && !stub_n_fir; g++)
+		send_group(&snd);
+
+	snprintf(what, sizeof(what), "FIR after losing TL0 AU %u", lost);
+	check(stub_n_fir > 0, what);
+
+	clock_advance(&snd, 200);
+
+	sent    = snd.n_sent;
+	decoded = dec.n_pkt;
+	n_fci   = 0;
+
+	/* the answer, an IDR picture with TL0PICIDX 0 */
+	snd.tl0 = 255;
+	for (g = 0; g < 300; g++)
+		send_group(&snd);
+
+	clock_advance(&snd, 1000);
+
+	snprintf(what, sizeof(what), "reset after %u: all packets decoded", lost);
+	check(dec.n_pkt - decoded == snd.n_sent - sent, what);
+	snprintf(what, sizeof(what), "reset after %u: no NACKs", lost);
+	check(n_fci == 0, what);
+	snprintf(what, sizeof(what), "reset after %u: decode order", lost);
+	check(dec.n_order == 0, what);
+}
+
+
+int main(void)
+{
+	static const uint8_t joinv[] = {255, 0, 100, 127, 128, 199, 254};
+	static const uint8_t lostv[] = {10, 100, 127, 128, 200};
+	size_t i;
+
+	for (i = 0; i < RE_ARRAY_SIZE(joinv); i++)
+		test_join(joinv[i]);
+
+	for (i = 0; i < RE_ARRAY_SIZE(lostv); i++)
+		test_fir_reset(lostv[i]);
+
+	stream_reset();
+
+	if (n_fail) {
+		fprintf(stderr, "tl0_rx_test: %u checks failed\n", n_fail);
+		return 1;
+	}
+
+	printf("tl0_rx_test: %zu joins and %zu FIR resets passed\n",
+	       RE_ARRAY_SIZE(joinv), RE_ARRAY_SIZE(lostv));
+
+	return 0;
+}
@@ -0,0 +1,330 @@
+/**
+ * @file tl0_skip_test.c  Enhancement AUs skipped by the pacer, end to end
+ *
+ * The TL0D packetizer sends a three layer stream straight into
+ * rtp_recv_tl0(). The pacer here is a stand-in that refuses the access
+ * units the test names, as the real one does when it is behind. Every
+ * access unit the packetizer did send has to reach the decoder in full,
+ * whichever enhancement AU of a TL0 group was skipped. The same goes for
+ * access units of more packets than NUM_ENH_NALUS counts: a TL0 AU is sent
+ * with the count capped, an enhancement AU is refused.
+ *
+ * Copyright (C) 2015 SeNSE Project
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+#include "tl0.h"
+#include "h264_packetize.h"
+#include "h264_tl0d.h"
+#include "openh264_codec.h"
+#include "stub.h"
+
+
+enum {
+	FRAME_MS = 33,
+	GROUPS   = 40,
+	PKTSIZE  = 1200,
+	SLICE    = 600,
+	SLICE_LONG = 200000,	/* more than 127 packets */
+	MAX_AUS  = GROUPS * 4,
+};
+
+/* decode and sending order of one TL0 group */
+static const uint8_t tidv[4] = {0, 2, 1, 2};
+
+struct pacer
+{
+	bool refuse;		/* turn away the next enhancement AU */
+	unsigned n_refused;
+};
+
+struct sender
+{
+	struct tl0d_packetizer *tp;
+	struct pacer pacer;
+	uint16_t seq;
+	uint8_t tl0;
+	bool tl0_au;
+	uint64_t now;
+	unsigned au;		/* index of the AU being sent */
+};
+
+struct au
+{
+	bool sent;
+	unsigned npkt;
+	unsigned handed;
+};
+
+static struct stream strm;
+static struct sender snd;
+static struct au auv[MAX_AUS];
+static unsigned au_of_seq[65536];
+static unsigned n_fci;
+static unsigned n_fail;
+
+
+int rtcp_send(struct rtp_sock *rs, struct mbuf *mb)
+{
+	n_fci += mb->end / 4;
+
+	return 0;
+}
+
+
+int rtcp_stats(struct rtp_sock *rs, uint32_t ssrc, struct rtcp_stats *stats)
+{
+	return ENOENT;
+}
+
+
+uint32_t rtp_sess_ssrc(const struct rtp_sock *rs)
+{
+	return 1;
+}
+
+
+bool pacer_admit(struct pacer *p, bool base)
+{
+	if (base || !p->refuse)
+		return true;
+
+	p->refuse = false;
+	p->n_refused++;
+
+	return false;
+}
+
+
+int pacer_send_batch(struct pacer *p, const struct videnc_pkt *pktv,
+		     size_t pktc, videnc_packet_h *pkth, void *arg)
+{
+	size_t i;
+	int err = 0;
+
+	for (i = 0; i < pktc; i++)
+		err |= pkth(pktv[i].marker, pktv[i].hdr, pktv[i].hdr_len,
+			    pktv[i].pld, pktv[i].pld_len, arg);
+
+	return err;
+}
+
+
+int pacer_send_chunks(struct pacer *p, const struct videnc_pkt *pktv,
+		      size_t pktc, videnc_batch_h *batchh, void *arg)
+{
+	return batchh(pktv, pktc, arg);
+}
+
+
+/* TL0 mechanism hooks of video.c */
+void get_tl0_pic_idx(bool *dup, bool *idr, uint8_t *tl0, void *arg)
+{
+	struct sender *s = arg;
+
+	if (s->tl0_au)
+		++s->tl0;
+
+	*dup = s->tl0_au;
+	*idr = false;
+	*tl0 = s->tl0;
+}
+
+
+void set_tl0(bool dup, bool idr, int x, uint16_t fsn, uint16_t lsn, void *arg)
+{
+}
+
+
+void get_seq(uint16_t *seq, void *arg)
+{
+	const struct sender *s = arg;
+
+	*seq = s->seq;
+}
+
+
+static int pkt_handler(bool marker, const uint8_t *hdr, size_t hdr_len,
+		       const uint8_t *pld, size_t pld_len, void *arg)
+{
+	struct sender *s = arg;
+	struct rtp_header rtp;
+	struct mbuf *mb;
+
+	memset(&rtp, 0, sizeof(rtp));
+	rtp.ssrc = 0x1234;
+	rtp.seq  = s->seq++;
+	rtp.m    = marker;
+
+	au_of_seq[rtp.seq] = s->au;
+	auv[s->au].sent = true;
+	auv[s->au].npkt++;
+
+	mb = mbuf_alloc(hdr_len + pld_len);
+	if (!mb)
+		return ENOMEM;
+
+	(void)mbuf_write_mem(mb, hdr, hdr_len);
+	(void)mbuf_write_mem(mb, pld, pld_len);
+	mb->pos = 0;
+
+	rtp_recv_tl0(NULL, &rtp, mb, &strm);
+
+	mem_deref(mb);
+
+	return 0;
+}
+
+
+static void handoff(const struct rtp_header *hdr, struct mbuf *mb, void *arg)
+{
+	auv[au_of_seq[hdr->seq]].handed++;
+}
+
+
+static void clock_advance(uint64_t ms)
+{
+	uint64_t end = snd.now + ms;
+
+	while (stub_tmr_next() <= end) {
+		snd.now = stub_tmr_next();
+		stub_clock_set(snd.now);
+		stub_tmr_poll();
+	}
+
+	snd.now = end;
+	stub_clock_set(end);
+}
+
+
+/* one access unit: a prefix NAL unit with the TID, and a slice */
+static int send_au(uint8_t tid, bool refuse, bool big)
+{
+	static uint8_t slice[SLICE_LONG];
+	uint8_t prefix[4] = {0x6e, 0x80, 0x00, 0};
+	int err;
+
+	memset(slice, 0xab, sizeof(slice));
+	slice[0] = tid ? 0x21 : 0x41;
+	prefix[3] = tid << 5 | 0x03;
+
+	snd.tp->h264Info.numNALUs = 0;
+	err  = h264_tl0d_nalu_add(&snd.tp->h264Info, prefix, sizeof(prefix));
+	err |= h264_tl0d_nalu_add(&snd.tp->h264Info, slice, big ? SLICE_LONG : SLICE);
+	if (err)
+		return err;
+
+	snd.tl0_au = tid == 0;
+	snd.pacer.refuse = refuse;
+
+	err = h264_tl0d_send_au(snd.tp, PKTSIZE, 1, pkt_handler, &snd);
+
+	snd.au++;
+	clock_advance(FRAME_MS);
+
+	if (err == EMSGSIZE && big && tid)
+		return 0;
+
+	return err == EAGAIN ? 0 : err;
+}
+
+
+static void check(bool ok, const char *what)
+{
+	if (ok)
+		return;
+
+	fprintf(stderr, "FAIL: %s\n", what);
+	n_fail++;
+}
+
+
+/*
+ * In every other TL0 group the AU at position skip is refused by the pacer,
+ * and the AU at position big is too long for NUM_ENH_NALUS; -1 for none
+ */
+static void test_skip(const char *name, int skip, int big)
+{
+	unsigned g, i, n_sent = 0, n_done = 0;
+	char what[64];
+	int err = 0;
+
+	mem_deref(strm.tl0);
+	memset(&strm, 0, sizeof(strm));
+	memset(&snd, 0, sizeof(snd));
+	memset(auv, 0, sizeof(auv));
+	strm.rtph = handoff;
+	n_fci = 0;
+	stub_n_fir = 0;
+
+	snd.seq = 65000;
+	snd.now = 1000;
+	stub_clock_set(snd.now);
+
+	err = tl0d_packetizer_alloc(&snd.tp);
+	if (err)
+		goto out;
+
+	snd.tp->pacer = &snd.pacer;
+
+	for (g = 0; g < GROUPS && !err; g++) {
+		for (i = 0; i < RE_ARRAY_SIZE(tidv) && !err; i++)
+			err = send_au(tidv[i], g % 2 && (int)i == skip,
+				      g % 2 && (int)i == big);
+	}
+
+	clock_advance(1000);
+
+	for (i = 0; i < snd.au; i++) {
+		if (!auv[i].sent)
+			continue;
+
+		n_sent++;
+		if (auv[i].handed == auv[i].npkt)
+			n_done++;
+	}
+
+	snprintf(what, sizeof(what), "%s: every AU sent was decoded", name);
+	check(n_done == n_sent, what);
+	snprintf(what, sizeof(what), "%s: AUs refused by the pacer", name);
+	check(snd.pacer.n_refused == (skip > 0 ? GROUPS / 2 : 0), what);
+	snprintf(what, sizeof(what), "%s: long AUs refused or capped", name);
+	check(snd.tp->stats.n_toolong == (big > 0 ? GROUPS / 2 : 0) &&
+	      snd.tp->stats.n_capped == (big == 0 ? GROUPS / 2 : 0), what);
+	snprintf(what, sizeof(what), "%s: no NACKs or FIR", name);
+	check(n_fci == 0 && stub_n_fir == 0, what);
+
+	if (n_done != n_sent)
+		fprintf(stderr, "%s: %u of %u AUs decoded\n", name, n_done, n_sent);
+
+ out:
+	check(err == 0, "sending");
+	snd.tp = mem_deref(snd.tp);
+}
+
+
+int main(void)
+{
+	h264_startcode_init();
+
+	test_skip("skip TID2", 1, -1);
+	test_skip("skip TID1", 2, -1);
+	test_skip("skip 2nd TID2", 3, -1);
+	test_skip("long TL0", -1, 0);
+	test_skip("long TID2", -1, 1);
+	test_skip("long TID1", -1, 2);
+
+	mem_deref(strm.tl0);
+
+	if (n_fail) {
+		fprintf(stderr, "tl0_skip_test: %u checks failed\n", n_fail);
+		return 1;
+	}
+
+	printf("tl0_skip_test: skipped and over-long AUs, the rest decoded\n");
+
+	return 0;
+}
@@ -0,0 +1,109 @@
+/**
+ * @file tl0.h  Interface to the TL0 retransmission mechanism
+ *
+ * Copyright (C) 2014 - 2015 SENSE
+ */
+
+
+/*
+ * Per stream receiver state. struct stream holds it in its tl0 member,
+ * it is created with the first video packet and released with
+ * mem_deref() when the stream is destroyed.
+ */
+struct tl0_rx;
+
+struct tl0_rx_stats
+{
+	unsigned long long n_pkt;		/* video packets received */
+	unsigned long long ns_sum;		/* time spent per packet in rtp_recv_tl0 */
+	unsigned long long n_au_complete;	/* TL0 AUs with all packets */
+	unsigned long long n_au_gave_up;	/* TL0 AUs that missed the playout deadline */
+	unsigned long long complete_ms_sum;	/* first packet to completion */
+	unsigned long long complete_ms_max;
+	unsigned long long n_nack_rtcp;		/* Generic NACK packets sent */
+	unsigned long long n_nack_fci;		/* FCIs in them */
+	unsigned long long n_nack_capped;	/* FCIs held back by the interval cap */
+	unsigned long long n_recovered;		/* NACKed packets that arrived */
+	unsigned long long n_handoff;		/* packets passed to the decoder */
+	unsigned long long n_au_dropped;	/* enhancement AUs dropped incomplete */
+	unsigned long long n_late;		/* packets of AUs already released or dropped */
+	unsigned long long n_resync;		/* decoder resynchronisations */
+	unsigned long long n_malformed;		/* packets without a valid TL0D header */
+};
+
+/*
+ * Decoder control, issued by the receiver next to the packets it hands
+ * off instead of signalling through RTP header fields
+ */
+enum tl0_dec_ctrl
+{
+	TL0_DEC_DISCARD,	/* an AU will not be handed off, drop its pending data */
+	TL0_DEC_RESYNC,		/* base layer lost, wait for the FIR answer */
+};
+
+typedef void (tl0_dec_ctrl_h)(enum tl0_dec_ctrl ctrl, void *arg);
+
+/* TL0D header of one packet, see tl0d_parse() */
+struct tl0d_desc
+{
+	uint8_t tid;		/* temporal ID */
+	uint8_t seq_id;		/* 1 for the second TID2 AU of a TL0 group */
+	uint8_t n_enh;		/* NUM_ENH_NALUS, packets of an enhancement AU */
+	uint8_t tl0;		/* TL0PICIDX */
+	uint16_t fsn;		/* first and last sequence number of the TL0 AU */
+	uint16_t lsn;
+};
+
+int  tl0d_parse(struct tl0d_desc *d, const struct mbuf *mb);
+
+int  tl0_rx_alloc(struct tl0_rx **rxp);
+void tl0_rx_flush(struct tl0_rx *rx);
+void tl0_rx_stats(const struct tl0_rx *rx, struct tl0_rx_stats *stats);
+int  tl0_rx_debug(struct re_printf *pf, const struct tl0_rx *rx);
+int  tl0_set_dec_ctrl(struct stream *s, tl0_dec_ctrl_h *ctrlh, void *arg);
+
+void rtp_recv_tl0(const struct sa *src, const struct rtp_header *hdr,
+		     struct mbuf *mb, void *arg);
+
+
+/*
+ * Selective forwarding of a TL0D stream to several legs, without
+ * decoding. Every leg gets the temporal layers that fit its capacity,
+ * with its own contiguous sequence numbers and matching fsn/lsn.
+ */
+struct tl0_fwd;
+struct tl0_fwd_leg;
+
+struct tl0_fwd_stats
+{
+	unsigned long long n_pkt;		/* packets received */
+	unsigned long long ns_sum;		/* time spent per packet in tl0_fwd_recv */
+	unsigned long long n_malformed;		/* packets without a valid TL0D header */
+};
+
+struct tl0_fwd_leg_stats
+{
+	unsigned long long n_fwd;		/* packets forwarded */
+	unsigned long long n_bytes;
+	unsigned long long n_drop;		/* packets above the layer limit */
+	unsigned long long n_nack;		/* sequence numbers NACKed on the leg */
+	unsigned long long n_nack_unmapped;	/* of these, not a known TL0 packet */
+	unsigned long long n_resent;		/* retransmissions passed on */
+	uint32_t n_switch;			/* layer limit changes */
+};
+
+typedef int (tl0_fwd_send_h)(const struct rtp_header *hdr, const uint8_t *tl0d, size_t tl0d_len,
+			     const uint8_t *pld, size_t pld_len, void *arg);
+
+int  tl0_fwd_alloc(struct tl0_fwd **fwdp);
+int  tl0_fwd_leg_add(struct tl0_fwd_leg **legp, struct tl0_fwd *fwd, uint32_t capacity,
+		     tl0_fwd_send_h *sendh, void *arg);
+void tl0_fwd_leg_set_capacity(struct tl0_fwd_leg *leg, uint32_t capacity);
+void tl0_fwd_leg_set_max_tid(struct tl0_fwd_leg *leg, int max_tid);
+void tl0_fwd_leg_stats(const struct tl0_fwd_leg *leg, struct tl0_fwd_leg_stats *stats);
+int  tl0_fwd_recv(struct tl0_fwd *fwd, const struct rtp_header *hdr, const struct mbuf *mb);
+int  tl0_fwd_leg_nack(struct tl0_fwd_leg *leg, uint16_t pid, uint16_t blp,
+		      uint16_t *seqv, size_t *seqc);
+int  tl0_fwd_leg_resend(struct tl0_fwd_leg *leg, const struct rtp_header *hdr,
+			const struct mbuf *mb);
+int  tl0_fwd_debug(struct re_printf *pf, const struct tl0_fwd *fwd);
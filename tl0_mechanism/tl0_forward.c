@@ -0,0 +1,445 @@
+/**
+ * @file tl0_forward.c  Temporal layer selective forwarding of TL0D streams
+ *
+ * A relay passes one incoming H264/SVC stream on to many legs without
+ * decoding it. Every leg gets the temporal layers its capacity allows;
+ * sequence numbers are rewritten per leg so that each leg sees a
+ * contiguous stream, and the fsn/lsn of the TL0D header are rewritten
+ * to match, so the TL0 retransmission mechanism works on every leg.
+ * NACKs from a leg are mapped back to the incoming sequence numbers,
+ * and the retransmitted packets are passed on to that leg only.
+ *
+ * Copyright (C) 2015 SeNSE Project
+ */
+
+#include <string.h>
+#include <time.h>
+#include <re.h>
+#include <baresip.h>
+#include "core.h"
+#include "tl0.h"
+
+#define TL0D_HDR_SIZE 10
+
+/* highest temporal ID tracked */
+#define TL0_FWD_MAX_TID 7
+
+/* layer bitrates are measured over this window, [ms] */
+#define TL0_FWD_WINDOW 1000
+
+struct tl0_fwd_leg
+{
+	struct le le;
+
+	uint32_t capacity;	/* [bit/s], 0 for no limit */
+	int forced_tid;		/* -1 to follow the capacity */
+	uint8_t max_tid;	/* highest temporal ID forwarded */
+
+	uint16_t offset;	/* packets dropped so far, in seq arithmetic */
+	uint16_t tl0_offset[256];	/* offset of each TL0 AU, by TL0PICIDX */
+	uint16_t tl0_fsn[256];		/* incoming fsn/lsn of each TL0 AU */
+	uint16_t tl0_lsn[256];
+	uint16_t tl0_count;	/* TL0 AUs in the tables, up to 256 */
+	uint8_t tl0_last;	/* newest TL0PICIDX seen */
+	bool tl0_valid;
+
+	tl0_fwd_send_h *sendh;
+	void *arg;
+
+	struct tl0_fwd_leg_stats stats;
+};
+
+struct tl0_fwd
+{
+	struct list legl;
+
+	bool au_start;		/* the next packet starts an access unit */
+
+	uint64_t win_start;	/* [ms] */
+	uint64_t win_bytes[TL0_FWD_MAX_TID + 1];
+	uint32_t rate[TL0_FWD_MAX_TID + 1];	/* cumulative, layers 0..i in [bit/s] */
+	uint8_t seen_tid;
+
+	struct tl0_fwd_stats stats;
+};
+
+static inline uint64_t tl0_fwd_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void tl0_fwd_destructor(void *arg)
+{
+	struct tl0_fwd *fwd = arg;
+
+	//legs may outlive the forwarder, they are only detached
+	list_clear(&fwd->legl);
+}
+
+int tl0_fwd_alloc(struct tl0_fwd **fwdp)
+{
+	struct tl0_fwd *fwd;
+
+	if(!fwdp)
+		return EINVAL;
+
+	fwd = mem_zalloc(sizeof(*fwd), tl0_fwd_destructor);
+	if(!fwd)
+		return ENOMEM;
+
+	list_init(&fwd->legl);
+	fwd->au_start = true;
+
+	*fwdp = fwd;
+
+	return 0;
+}
+
+static void tl0_fwd_leg_destructor(void *arg)
+{
+	struct tl0_fwd_leg *leg = arg;
+
+	list_unlink(&leg->le);
+}
+
+/*
+ * Adds an outgoing leg. capacity is the bitrate the leg can take, 0 for
+ * all layers. sendh is called for every forwarded packet with the
+ * rewritten RTP header and TL0D header, and the unchanged payload behind
+ * the TL0D header.
+ */
+int tl0_fwd_leg_add(struct tl0_fwd_leg **legp, struct tl0_fwd *fwd, uint32_t capacity,
+					tl0_fwd_send_h *sendh, void *arg)
+{
+	struct tl0_fwd_leg *leg;
+
+	if(!legp || !fwd || !sendh)
+		return EINVAL;
+
+	leg = mem_zalloc(sizeof(*leg), tl0_fwd_leg_destructor);
+	if(!leg)
+		return ENOMEM;
+
+	leg->capacity = capacity;
+	leg->forced_tid = -1;
+	leg->max_tid = 0;
+	leg->sendh = sendh;
+	leg->arg = arg;
+
+	list_append(&fwd->legl, &leg->le, leg);
+
+	*legp = leg;
+
+	return 0;
+}
+
+void tl0_fwd_leg_set_capacity(struct tl0_fwd_leg *leg, uint32_t capacity)
+{
+	if(!leg)
+		return;
+
+	leg->capacity = capacity;
+}
+
+/* fixes the highest forwarded temporal ID, -1 to follow the capacity again */
+void tl0_fwd_leg_set_max_tid(struct tl0_fwd_leg *leg, int max_tid)
+{
+	if(!leg)
+		return;
+
+	leg->forced_tid = max_tid > TL0_FWD_MAX_TID ? TL0_FWD_MAX_TID : max_tid;
+}
+
+/* highest temporal ID whose layers together fit into the leg */
+static uint8_t tl0_fwd_target(const struct tl0_fwd *fwd, const struct tl0_fwd_leg *leg)
+{
+	uint8_t tid;
+
+	if(leg->forced_tid >= 0)
+		return (uint8_t)leg->forced_tid;
+
+	if(!leg->capacity)
+		return TL0_FWD_MAX_TID;
+
+	//the base layer only, until the layer rates are measured
+	if(!fwd->rate[0])
+		return 0;
+
+	//the base layer is always forwarded
+	for(tid = 0; tid < fwd->seen_tid; tid++)
+	{
+		if(fwd->rate[tid + 1] > leg->capacity)
+			break;
+	}
+
+	return tid;
+}
+
+/*
+ * Moves the layer limit of a leg at an access unit boundary. A lower
+ * limit applies at once, layers do not reference layers above them. A
+ * higher limit waits for a TL0 AU, so the added layers start with the
+ * base picture they reference.
+ */
+static void tl0_fwd_leg_switch(struct tl0_fwd *fwd, struct tl0_fwd_leg *leg, uint8_t tid)
+{
+	uint8_t target = tl0_fwd_target(fwd, leg);
+
+	if(target < leg->max_tid || (target > leg->max_tid && tid == 0))
+	{
+		leg->max_tid = target;
+		leg->stats.n_switch++;
+	}
+}
+
+static void tl0_fwd_measure(struct tl0_fwd *fwd, uint8_t tid, size_t len)
+{
+	uint64_t now = tmr_jiffies();
+	uint64_t win;
+	uint32_t sum = 0;
+	int i;
+
+	if(tid > fwd->seen_tid)
+		fwd->seen_tid = tid;
+
+	fwd->win_bytes[tid] += len;
+
+	if(!fwd->win_start)
+		fwd->win_start = now;
+
+	win = now - fwd->win_start;
+	if(win < TL0_FWD_WINDOW)
+		return;
+
+	for(i = 0; i <= TL0_FWD_MAX_TID; i++)
+	{
+		sum += (uint32_t)(fwd->win_bytes[i] * 8 * 1000 / win);
+		fwd->rate[i] = sum;
+		fwd->win_bytes[i] = 0;
+	}
+
+	fwd->win_start = now;
+}
+
+static int tl0_fwd_leg_send(struct tl0_fwd_leg *leg, const struct tl0d_desc *d,
+							const struct rtp_header *hdr, const uint8_t *p, size_t len)
+{
+	struct rtp_header out = *hdr;
+	uint8_t tl0d[TL0D_HDR_SIZE];
+	uint16_t off;
+
+	//the first packet of a new TL0 group fixes the offset of its TL0 AU
+	if(!leg->tl0_valid || (int8_t)(d->tl0 - leg->tl0_last) > 0)
+	{
+		leg->tl0_offset[d->tl0] = leg->offset;
+		leg->tl0_fsn[d->tl0] = d->fsn;
+		leg->tl0_lsn[d->tl0] = d->lsn;
+		leg->tl0_last = d->tl0;
+		leg->tl0_valid = true;
+		if(leg->tl0_count < 256)
+			leg->tl0_count++;
+	}
+
+	//TL0 packets keep the offset of their AU, also when they are retransmitted later
+	off = d->tid == 0 ? leg->tl0_offset[d->tl0] : leg->offset;
+
+	out.seq = hdr->seq - off;
+
+	memcpy(tl0d, p, TL0D_HDR_SIZE);
+
+	off = leg->tl0_offset[d->tl0];
+	tl0d[6] = (uint8_t)((uint16_t)(d->fsn - off) >> 8);
+	tl0d[7] = (uint8_t)((uint16_t)(d->fsn - off) & 0xff);
+	tl0d[8] = (uint8_t)((uint16_t)(d->lsn - off) >> 8);
+	tl0d[9] = (uint8_t)((uint16_t)(d->lsn - off) & 0xff);
+
+	leg->stats.n_fwd++;
+	leg->stats.n_bytes += len;
+
+	return leg->sendh(&out, tl0d, TL0D_HDR_SIZE, p + TL0D_HDR_SIZE, len - TL0D_HDR_SIZE, leg->arg);
+}
+
+/*
+ * Forwards one packet of the incoming stream to every leg that takes
+ * its temporal layer. Packets are expected in sending order; a dropped
+ * packet shifts the sequence numbers of the leg by one, a gap in the
+ * incoming stream is passed on as a gap.
+ */
+int tl0_fwd_recv(struct tl0_fwd *fwd, const struct rtp_header *hdr, const struct mbuf *mb)
+{
+	struct tl0d_desc d;
+	struct le *le;
+	const uint8_t *p;
+	size_t len;
+	uint64_t t;
+	int err = 0;
+
+	if(!fwd || !hdr || !mb)
+		return EINVAL;
+
+	if(tl0d_parse(&d, mb))
+	{
+		fwd->stats.n_malformed++;
+		return EBADMSG;
+	}
+
+	t = tl0_fwd_now_ns();
+
+	p = mbuf_buf(mb);
+	len = mbuf_get_left(mb);
+
+	if(d.tid > TL0_FWD_MAX_TID)
+		d.tid = TL0_FWD_MAX_TID;
+
+	tl0_fwd_measure(fwd, d.tid, len);
+
+	for(le = fwd->legl.head; le; le = le->next)
+	{
+		struct tl0_fwd_leg *leg = le->data;
+
+		if(fwd->au_start)
+			tl0_fwd_leg_switch(fwd, leg, d.tid);
+
+		if(d.tid > leg->max_tid)
+		{
+			++leg->offset;
+			leg->stats.n_drop++;
+			continue;
+		}
+
+		err |= tl0_fwd_leg_send(leg, &d, hdr, p, len);
+	}
+
+	fwd->au_start = hdr->m;
+
+	fwd->stats.n_pkt++;
+	fwd->stats.ns_sum += tl0_fwd_now_ns() - t;
+
+	return err;
+}
+
+/* incoming sequence number of a TL0 packet the leg numbered seq, newest TL0 AU first */
+static bool tl0_fwd_leg_unmap(const struct tl0_fwd_leg *leg, uint16_t seq, uint16_t *src)
+{
+	uint16_t i;
+
+	for(i = 0; i < leg->tl0_count; i++)
+	{
+		uint8_t tl0 = leg->tl0_last - i;
+		uint16_t off = leg->tl0_offset[tl0];
+		uint16_t fsn = leg->tl0_fsn[tl0] - off;
+
+		if((uint16_t)(seq - fsn) <= (uint16_t)(leg->tl0_lsn[tl0] - leg->tl0_fsn[tl0]))
+		{
+			*src = seq + off;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Maps a Generic NACK received on a leg, PID and BLP in the leg's
+ * numbering, to the sequence numbers of the incoming stream. Only TL0
+ * packets are mapped, the receivers do not NACK the other layers, and
+ * only those of the last 256 TL0 AUs. seqv has room for *seqc entries,
+ * 17 cover a whole NACK; *seqc is set to the number mapped.
+ */
+int tl0_fwd_leg_nack(struct tl0_fwd_leg *leg, uint16_t pid, uint16_t blp,
+					 uint16_t *seqv, size_t *seqc)
+{
+	size_t n = 0;
+	int i;
+
+	if(!leg || !seqv || !seqc)
+		return EINVAL;
+
+	for(i = -1; i < 16; i++)
+	{
+		uint16_t seq = pid + i + 1;
+
+		if(i >= 0 && !(blp & (1 << i)))
+			continue;
+
+		leg->stats.n_nack++;
+
+		if(n == *seqc || !tl0_fwd_leg_unmap(leg, seq, &seqv[n]))
+		{
+			leg->stats.n_nack_unmapped++;
+			continue;
+		}
+
+		n++;
+	}
+
+	*seqc = n;
+
+	return 0;
+}
+
+/*
+ * Passes a retransmitted TL0 packet of the incoming stream on to one leg,
+ * after tl0_fwd_leg_nack(). It keeps the sequence number the leg gave it
+ * the first time, the layer state and rate measurement are left alone.
+ */
+int tl0_fwd_leg_resend(struct tl0_fwd_leg *leg, const struct rtp_header *hdr, const struct mbuf *mb)
+{
+	struct tl0d_desc d;
+
+	if(!leg || !hdr || !mb)
+		return EINVAL;
+
+	if(tl0d_parse(&d, mb))
+		return EBADMSG;
+
+	//only a TL0 AU the leg still has an offset for
+	if(d.tid != 0 || !leg->tl0_valid || (int8_t)(leg->tl0_last - d.tl0) < 0 ||
+	   (uint8_t)(leg->tl0_last - d.tl0) >= leg->tl0_count)
+		return ENOENT;
+
+	leg->stats.n_resent++;
+
+	return tl0_fwd_leg_send(leg, &d, hdr, mbuf_buf(mb), mbuf_get_left(mb));
+}
+
+void tl0_fwd_leg_stats(const struct tl0_fwd_leg *leg, struct tl0_fwd_leg_stats *stats)
+{
+	if(!leg || !stats)
+		return;
+
+	*stats = leg->stats;
+}
+
+int tl0_fwd_debug(struct re_printf *pf, const struct tl0_fwd *fwd)
+{
+	struct le *le;
+	int err;
+
+	if(!fwd)
+		return 0;
+
+	err = re_hprintf(pf, "tl0 forward: legs=%u packets=%llu ns/packet=%llu malformed=%llu"
+					 " layer rates=%u/%u/%u bit/s\n",
+					 list_count(&fwd->legl), fwd->stats.n_pkt,
+					 fwd->stats.n_pkt ? fwd->stats.ns_sum / fwd->stats.n_pkt : 0ULL,
+					 fwd->stats.n_malformed,
+					 fwd->rate[0], fwd->rate[1], fwd->rate[2]);
+
+	for(le = fwd->legl.head; le; le = le->next)
+	{
+		const struct tl0_fwd_leg *leg = le->data;
+
+		err |= re_hprintf(pf, "  leg: capacity=%u bit/s max TID=%u%s forwarded=%llu"
+						  " dropped=%llu switches=%u NACKed=%llu unmapped=%llu resent=%llu\n",
+						  leg->capacity, leg->max_tid, leg->forced_tid >= 0 ? " (forced)" : "",
+						  leg->stats.n_fwd, leg->stats.n_drop, leg->stats.n_switch,
+						  leg->stats.n_nack, leg->stats.n_nack_unmapped, leg->stats.n_resent);
+	}
+
+	return err;
+}
@@ -11,207 +11,393 @@
 #include <re.h>
 #include <baresip.h>
 #include "core.h"
+#include "tl0.h"
 
-#define NON_TL0_VALUE 255
-#define MAX_SEQ_INDEX 255
-#define MAX_RTP_SEQUENCE 65536
+/* F|NRI|type, SVC header, NUM_ENH_NALUS, TL0PICIDX, fsn, lsn */
+#define TL0D_HDR_SIZE 10
 #define MAX_PACKET_TOLERANCE 50
-#define MAX_NACK_TOLERANCE 5
 
-static struct list tl0l = LIST_INIT;
-static int packet_count = 0;
+/* NACK retransmission timeout when no RTT has been measured yet, and bounds */
+#define TL0_RTO_DEFAULT 100
+#define TL0_RTO_MIN 20
+#define TL0_RTO_MAX 1000
 
-struct enh_status
+/* default time an access unit may wait for its base layer, [ms] */
+#define TL0_PLAYOUT_DELAY 200
+
+/* Generic NACK FCIs sent per feedback interval */
+#define TL0_NACK_MAX_FCI 32
+#define TL0_NACK_INTERVAL 20
+
+/* one slot per TL0PICIDX, slots further than half the ring behind are stale */
+#define TL0_RING_SIZE 256
+#define TL0_RING_WINDOW (TL0_RING_SIZE / 2)
+
+/* widest TL0 access unit tracked, in packets */
+#define TL0_MAX_PACKETS 1024
+#define TL0_MAP_WORDS (TL0_MAX_PACKETS / 64)
+
+/* access units of a TL0 group in decode order: TL0, TID2, TID1, TID2 */
+#define TL0_AU_LAYERS 4
+
+/* how long an incomplete enhancement AU may hold back the AUs after it, [ms] */
+#define TL0_ENH_WAIT 40
+
+struct tl0_pkt
+{
+	struct le le;
+	struct rtp_header hdr;
+	struct mbuf *mb;
+};
+
+/* one access unit waiting to be released to the decoder */
+struct tl0_au
 {
-	uint8_t nalu_size;
-	uint8_t received_nalus;
-	bool got_enh;
-	bool skip;
+	struct list pktl;	/* packets sorted by sequence number */
+	uint32_t count;
+	uint8_t expected;	/* NUM_ENH_NALUS of an enhancement AU */
+	bool marker;
+	bool dropped;		/* late, incomplete or missing its reference */
+	uint64_t created;	/* first packet in [ms] */
 };
 
 struct TL0_info
 {
-	struct le le;
+	bool used;
 	
 	uint8_t TL0;
 	uint32_t first_seq;
 	uint32_t last_seq;
-	uint16_t num_nalus;
-	int32_t seq_index[MAX_SEQ_INDEX];
-	int nack_index[MAX_SEQ_INDEX];
+	uint32_t num_nalus;
+	uint32_t n_received;
+	uint64_t received[TL0_MAP_WORDS];	/* bit i: packet first_seq + i arrived */
+	uint64_t nacked[TL0_MAP_WORDS];	/* bit i: packet first_seq + i was NACKed */
+	uint32_t scanned;			/* positions below this were checked for gaps */
+	uint64_t nack_due;			/* next NACK retry in [ms], 0 if none */
+	uint64_t created;			/* first packet in [ms] */
+	uint64_t deadline;			/* playout deadline in [ms] */
+	bool gave_up;				/* retries stopped, deadline missed */
 	bool tl0_completed;
 	bool has_enhancement;
 	
-	struct enh_status enh_layers[3];
+	struct tl0_au au[TL0_AU_LAYERS];
 };
 
-void list_destructor(void)
+static inline void map_set(uint64_t *map, uint32_t pos)
 {
-	list_flush(&tl0l);
+	map[pos >> 6] |= 1ULL << (pos & 63);
 }
 
-static uint8_t get_tl0_from_tl0d(uint8_t v)
+static inline bool map_test(const uint64_t *map, uint32_t pos)
 {
-	return (v & 0xFF);
+	return (map[pos >> 6] >> (pos & 63)) & 1;
 }
 
-static uint8_t h264_hdr_decode(uint8_t v)
+/* position of the highest set bit below n, -1 if there is none */
+static int map_last(const uint64_t *map, uint32_t n)
 {
-	return (v>>0 & 0x1f);
+	int w;
+	
+	for(w = (int)((n + 63) >> 6) - 1; w >= 0; w--)
+	{
+		uint64_t v = map[w];
+		
+		if((uint32_t)(w + 1) * 64 > n)
+			v &= (1ULL << (n & 63)) - 1;
+		
+		if(v)
+			return w * 64 + 63 - __builtin_clzll(v);
+	}
+	
+	return -1;
 }
 
-static uint32_t get_tl0(struct mbuf *mb)
+/* bits of word w that lie in [from, to) */
+static inline uint64_t map_range(uint32_t w, uint32_t from, uint32_t to)
 {
-	uint8_t type;
-	uint8_t tl0;
+	uint64_t m = ~0ULL;
 	
-	type = h264_hdr_decode(mb->buf[mb->pos]);	
+	if(from > w * 64)
+		m &= ~0ULL << (from - w * 64);
 	
-	if(type == 31)
-	{
-		tl0 = get_tl0_from_tl0d(mb->buf[mb->pos + 5]);
-		return tl0;
-	}
+	if(to < (w + 1) * 64)
+		m &= (1ULL << (to - w * 64)) - 1;
 	
-	return NON_TL0_VALUE;
+	return m;
 }
 
-static uint32_t calc_scanning_length(struct TL0_info *inf, struct le *le)
+/* collects sequence numbers into the FCIs of one Generic NACK (RFC 4585 6.2.1) */
+struct tl0_nack
 {
-	uint32_t scanning_length = 0;
+	uint16_t pid[TL0_NACK_MAX_FCI];
+	uint16_t blp[TL0_NACK_MAX_FCI];
+	uint32_t n;
+	uint32_t dropped;
+};
+
+/* TL0 receiver state of one stream, never shared between streams */
+struct tl0_rx
+{
+	struct TL0_info ring[TL0_RING_SIZE];
+	bool seeded;		/* newest was set by a packet since the last flush */
+	uint8_t newest;		/* TL0PICIDX at the head of the ring */
+	struct tmr tmr;		/* NACK retries */
+	uint64_t fb_start;	/* start of the current feedback interval */
+	uint32_t fb_fci;	/* FCIs sent in the current feedback interval */
+	int packet_count;	/* packets dropped while waiting for a FIR answer */
 	
-	if(inf->has_enhancement || le->next)
-		scanning_length = inf->num_nalus;
-	else
-	{
-		int i;
-		
-		for(i = inf->num_nalus - 1; (i >= 0) && (inf->seq_index[i] == -1); i--){}
-		
-		scanning_length = i;
-	}
+	/* release cursor of the access unit buffer, in decode order */
+	bool jb_started;
+	uint8_t next_tl0;
+	uint8_t next_layer;
+	struct tmr jb_tmr;	/* deadline of the AU at the cursor */
 	
-	return scanning_length;
+	tl0_dec_ctrl_h *ctrlh;
+	void *ctrl_arg;
+	
+	struct tl0_rx_stats stats;
+};
+
+static inline uint64_t tl0_now_ns(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void tl0_pkt_destructor(void *arg)
+{
+	struct tl0_pkt *pkt = arg;
+	
+	list_unlink(&pkt->le);
+	mem_deref(pkt->mb);
+}
+
+static void tl0_au_clear(struct tl0_au *au)
+{
+	list_flush(&au->pktl);
+	memset(au, 0, sizeof(*au));
 }
 
-static uint16_t get_fseq_from_tl0d(struct mbuf *mb)
+/* evicts a ring slot together with the packets it still holds */
+static void tl0_slot_clear(struct TL0_info *inf)
 {
-	uint16_t v;
+	int l;
 	
-	memset(&v, 0, sizeof(v));
+	for(l = 0; l < TL0_AU_LAYERS; l++)
+		tl0_au_clear(&inf->au[l]);
 	
-	v |= (mb->buf[mb->pos + 6] & 0xFF) << 8;
-	v |= mb->buf[mb->pos + 7] & 0xFF;
+	inf->used = false;
+}
+
+static void tl0_rx_destructor(void *arg)
+{
+	struct tl0_rx *rx = arg;
 	
-	return v;
+	tl0_rx_flush(rx);
 }
 
-static uint16_t get_lseq_from_tl0d(struct mbuf *mb)
+int tl0_rx_alloc(struct tl0_rx **rxp)
 {
-	uint16_t v;
+	struct tl0_rx *rx;
+	
+	if(!rxp)
+		return EINVAL;
 	
-	memset(&v, 0, sizeof(v));
+	rx = mem_zalloc(sizeof(*rx), tl0_rx_destructor);
+	if(!rx)
+		return ENOMEM;
 	
-	v |= (mb->buf[mb->pos + 8] & 0xFF) << 8;
-	v |= mb->buf[mb->pos + 9] & 0xFF;
+	tmr_init(&rx->tmr);
+	tmr_init(&rx->jb_tmr);
 	
-	return v;
+	*rxp = rx;
+	
+	return 0;
+}
+
+void tl0_rx_stats(const struct tl0_rx *rx, struct tl0_rx_stats *stats)
+{
+	if(!rx || !stats)
+		return;
+	
+	*stats = rx->stats;
 }
 
-static uint8_t get_num_of_nalus(struct mbuf *mb)
+int tl0_rx_debug(struct re_printf *pf, const struct tl0_rx *rx)
 {
-	uint8_t v = 0;
+	const struct tl0_rx_stats *st;
+	
+	if(!rx)
+		return 0;
 	
-	v = (mb->buf[mb->pos + 4] & 0x7F);
+	st = &rx->stats;
 	
-	return v;
+	return re_hprintf(pf, "tl0 receiver: packets=%llu ns/packet=%llu"
+					  " AUs complete=%llu gave up=%llu"
+					  " completion avg=%llu ms max=%llu ms"
+					  " NACK packets=%llu FCIs=%llu capped=%llu recovered=%llu"
+					  " hand-offs=%llu AUs dropped=%llu late=%llu resyncs=%llu malformed=%llu\n",
+					  st->n_pkt, st->n_pkt ? st->ns_sum / st->n_pkt : 0ULL,
+					  st->n_au_complete, st->n_au_gave_up,
+					  st->n_au_complete ? st->complete_ms_sum / st->n_au_complete : 0ULL,
+					  st->complete_ms_max,
+					  st->n_nack_rtcp, st->n_nack_fci, st->n_nack_capped, st->n_recovered,
+					  st->n_handoff, st->n_au_dropped, st->n_late, st->n_resync, st->n_malformed);
 }
 
-static uint8_t get_sequence_id(struct mbuf *mb)
+/* forgets all access units, e.g. after a FIR */
+void tl0_rx_flush(struct tl0_rx *rx)
 {
-	uint8_t v = 0;
+	int i;
 	
-	v = (mb->buf[mb->pos + 4] >> 7);
+	if(!rx)
+		return;
+	
+	tmr_cancel(&rx->tmr);
+	tmr_cancel(&rx->jb_tmr);
 	
-	return v;
+	for(i = 0; i < TL0_RING_SIZE; i++)
+		tl0_slot_clear(&rx->ring[i]);
+	
+	rx->jb_started = false;
+	rx->seeded = false;
 }
 
-static uint8_t get_temporal_from_tl0d(struct mbuf *mb)
+/*
+ * Parses and checks the TL0D header in front of the payload, the only
+ * place the header bytes are read on the receiving side:
+ *
+ *  | F|NRI|31 | SVC header (3) | E|NUM_ENH_NALUS | TL0PICIDX | fsn | lsn |
+ */
+int tl0d_parse(struct tl0d_desc *d, const struct mbuf *mb)
 {
-	uint8_t v;
+	const uint8_t *p;
+	
+	if(!d || mbuf_get_left(mb) < TL0D_HDR_SIZE)
+		return EBADMSG;
+	
+	p = mbuf_buf(mb);
 	
-	memset(&v, 0, sizeof(v));
+	if((p[0] & 0x1f) != 31)
+		return EBADMSG;
 	
-	v = (mb->buf[mb->pos + 3] & 0xE0) >> 5;
+	d->tid    = p[3] >> 5;
+	d->n_enh  = p[4] & 0x7f;
+	d->seq_id = p[4] >> 7;
+	d->tl0    = p[5];
+	d->fsn    = (uint16_t)(p[6] << 8 | p[7]);
+	d->lsn    = (uint16_t)(p[8] << 8 | p[9]);
 	
-	return v;
+	return 0;
+}
+
+static uint32_t calc_scanning_length(const struct tl0_rx *rx, struct TL0_info *inf)
+{
+	uint32_t scanning_length = 0;
+	
+	if(inf->has_enhancement || inf->TL0 != rx->newest)
+		scanning_length = inf->num_nalus;
+	else
+	{
+		//the newest AU may still be arriving, only gaps below the highest packet count
+		int i = map_last(inf->received, inf->num_nalus);
+		
+		scanning_length = i > 0 ? (uint32_t)i : 0;
+	}
+	
+	return scanning_length;
 }
 
-static int init_tl0(struct TL0_info **inf, uint8_t tl0, uint16_t start_seq, uint16_t last_seq)
+static uint32_t tl0_playout_delay(void)
+{
+	uint32_t delay = TL0_PLAYOUT_DELAY;
+	
+	(void)conf_get_u32(conf_cur(), "tl0_playout_delay", &delay);
+	
+	return delay;
+}
+
+static int init_tl0(struct tl0_rx *rx, struct TL0_info **inf, uint8_t tl0, uint16_t start_seq, uint16_t last_seq)
 {
 	int err = 0;
 	
 	struct TL0_info *tl0_info;
 	
-	tl0_info = mem_zalloc(sizeof(*tl0_info), NULL);
+	//moving the head forward evicts slots that fall out of the window behind it
+	while((int8_t)(tl0 - rx->newest) > 0)
+	{
+		rx->newest++;
+		tl0_slot_clear(&rx->ring[(uint8_t)(rx->newest + TL0_RING_WINDOW)]);
+	}
+	
+	tl0_info = &rx->ring[tl0];
+	tl0_slot_clear(tl0_info);
+	memset(tl0_info, 0, sizeof(*tl0_info));
 	
+	tl0_info->used = true;
+	tl0_info->created = tmr_jiffies();
+	tl0_info->deadline = tl0_info->created + tl0_playout_delay();
 	tl0_info->TL0 = tl0;
 	tl0_info->first_seq = start_seq;
 	tl0_info->last_seq = last_seq;
 	tl0_info->tl0_completed = false;	
 	tl0_info->has_enhancement = false;
-	tl0_info->num_nalus = last_seq > start_seq ? (last_seq - start_seq + 1) : (MAX_RTP_SEQUENCE - start_seq + last_seq + 1);
-	
-	memset(tl0_info->seq_index, -1, sizeof(tl0_info->seq_index));
-	memset(tl0_info->nack_index, 0, sizeof(tl0_info->nack_index));
-	
-	tl0_info->enh_layers[0].nalu_size = 0;
-	tl0_info->enh_layers[0].received_nalus = 0;
-	tl0_info->enh_layers[0].got_enh = false;
-	tl0_info->enh_layers[0].skip = false;
-	
-	tl0_info->enh_layers[1].nalu_size = 0;
-	tl0_info->enh_layers[1].received_nalus = 0;
-	tl0_info->enh_layers[1].got_enh = false;
-	
-	tl0_info->enh_layers[2].nalu_size = 0;
-	tl0_info->enh_layers[2].received_nalus = 0;
-	tl0_info->enh_layers[2].got_enh = false;
-	tl0_info->enh_layers[2].skip = false;
+	tl0_info->num_nalus = (uint16_t)(last_seq - start_seq) + 1;
+	if(tl0_info->num_nalus > TL0_MAX_PACKETS)
+	{
+		warning("tl0: access unit of %u packets, tracking the first %u\n",
+				tl0_info->num_nalus, TL0_MAX_PACKETS);
+		tl0_info->num_nalus = TL0_MAX_PACKETS;
+	}
 	
 	*inf = tl0_info;
 	
 	return err;
 }
 
-static int update_tl0(struct TL0_info *inf, uint16_t seq)
+static int update_tl0(struct tl0_rx *rx, struct TL0_info *inf, uint16_t seq)
 {
 	int err = 0;
-	uint16_t i;
-	int position;
+	uint32_t position;
 	
-	position = (seq >= inf->first_seq) ? (seq - inf->first_seq) : (MAX_RTP_SEQUENCE - inf->first_seq + seq);
-	inf->seq_index[position] = seq;
+	position = (uint16_t)(seq - inf->first_seq);
+	if(position >= inf->num_nalus)
+		return 0;
 	
-	for(i = 0; i < inf->num_nalus; i++)
+	if(!map_test(inf->received, position))
 	{
-		if(inf->seq_index[i] == -1)
-			break;
+		map_set(inf->received, position);
+		inf->n_received++;
+		
+		if(map_test(inf->nacked, position))
+			rx->stats.n_recovered++;
 	}
 	
-	if(i == inf->num_nalus)
+	if(inf->n_received == inf->num_nalus)
+	{
+		uint64_t t = tmr_jiffies() - inf->created;
+		
 		inf->tl0_completed = true;
 		
+		rx->stats.n_au_complete++;
+		rx->stats.complete_ms_sum += t;
+		if(t > rx->stats.complete_ms_max)
+			rx->stats.complete_ms_max = t;
+	}
+		
 	return err;
 }
 
 static bool check_if_already(struct TL0_info *inf, uint16_t seq)
 {
-	int position;
+	uint32_t position;
 	
-	position = (seq >= inf->first_seq) ? (seq - inf->first_seq) : (MAX_RTP_SEQUENCE - inf->first_seq + seq);
+	position = (uint16_t)(seq - inf->first_seq);
 	
-	if(inf->seq_index[position] == seq)		
+	if(position < inf->num_nalus && map_test(inf->received, position))
 		return true;
 		
 	return false;
@@ -225,499 +411,745 @@ static bool check_cycle(struct TL0_info *inf, uint16_t first_seq, uint16_t last_
 	return true;
 }
 
-static struct TL0_info *tl0_find(uint8_t tl0, uint16_t start_seq, uint16_t last_seq)
+static struct TL0_info *tl0_find(struct tl0_rx *rx, uint8_t tl0, uint16_t start_seq, uint16_t last_seq)
 {
-	struct le *le;
+	struct TL0_info *tl0_inf = &rx->ring[tl0];
+	
+	if(!tl0_inf->used)
+		return NULL;
 	
-	for (le=tl0l.head; le; le=le->next)
+	//same TL0PICIDX but another AU, the index has wrapped
+	if(check_cycle(tl0_inf, start_seq, last_seq))
 	{
-		struct TL0_info *tl0_inf = le->data;
+		tl0_slot_clear(tl0_inf);
+		return NULL;
+	}
+	
+	return tl0_inf;
+}
+
+/*
+ * Adds a lost sequence number. Callers add in increasing order, so a
+ * number within 16 of the last PID goes into its bitmask.
+ */
+static void tl0_nack_add(struct tl0_nack *n, uint16_t seq)
+{
+	if(n->n)
+	{
+		uint16_t d = seq - n->pid[n->n - 1];
 		
-		if (tl0_inf->TL0 == tl0)
-		{			
-			if(check_cycle(tl0_inf, start_seq, last_seq))
-			{				
-				list_unlink(&tl0_inf->le);
-				mem_deref(tl0_inf);
-				
-				return NULL;
-			}
-			
-			return tl0_inf;
+		if(d == 0)
+			return;
+		
+		if(d <= 16)
+		{
+			n->blp[n->n - 1] |= 1 << (d - 1);
+			return;
 		}
 	}
 	
-	return NULL;
+	if(n->n == TL0_NACK_MAX_FCI)
+	{
+		n->dropped++;
+		return;
+	}
+	
+	n->pid[n->n] = seq;
+	n->blp[n->n] = 0;
+	n->n++;
 }
 
-static int request_missing_tl0_packets(struct stream *s)
+struct tl0_fci
 {
-	struct TL0_info *inf;
-	struct le *le;
+	const struct tl0_nack *n;
+	uint32_t count;
+};
+
+static int tl0_fci_encode(struct mbuf *mb, void *arg)
+{
+	const struct tl0_fci *fci = arg;
 	uint32_t i;
-	uint32_t scanning_length;
-	uint16_t fsn;
-	uint16_t blp;
-	int counter;
-	bool has_fsn = false;
+	int err = 0;
 	
-	for(le = tl0l.head; le; le = le->next)
+	for(i = 0; i < fci->count; i++)
 	{
-		counter = fsn = blp = scanning_length = 0;
-		inf = le->data;
-		
-		if(!inf->tl0_completed)
-		{
-			scanning_length = calc_scanning_length(inf, le);
-			
-			for(i = 0; i < scanning_length; i++)
-			{
-				if(inf->seq_index[i] == -1)
-				{						
-					if(inf->nack_index[i] == 0 || inf->nack_index[i] == MAX_NACK_TOLERANCE)
-					{
-						inf->nack_index[i] = 1;
-						
-						if(!has_fsn)
-						{
-							fsn = inf->first_seq + i;
-							has_fsn = true;
-						}
-						else
-						{
-							if(counter == 17)
-							{
-								rtcp_send_nack( s->rtp, fsn, blp);
-								
-								fsn = inf->first_seq + 1;
-								counter = 0;
-								blp = 0;
-							}
-							else
-							{
-								counter++;
-								blp |= (1 << (16 - counter));
-							}
-						}
-					}
-					else
-					{
-						inf->nack_index[i]++;
-					}
-				}
-			}
-		
-			if(has_fsn)
-				rtcp_send_nack( s->rtp, fsn, blp);
-		}
+		err |= mbuf_write_u16(mb, htons(fci->n->pid[i]));
+		err |= mbuf_write_u16(mb, htons(fci->n->blp[i]));
 	}
 	
-	return 0;
+	return err;
 }
 
-static int send_nalu_to_decoder(struct mbuf *mb, struct rtp_header hdr)
+/*
+ * Sends all collected FCIs in one RTPFB packet, limited to
+ * TL0_NACK_MAX_FCI per feedback interval. FCIs over the limit are not
+ * lost, their sequence numbers stay NACKed and go out with the next retry.
+ */
+static void tl0_nack_flush(struct stream *s, struct tl0_nack *n)
 {
-	uint8_t temporal_id;	
+	struct tl0_rx *rx = s->tl0;
+	struct tl0_fci fci;
+	struct mbuf *mb;
+	uint64_t now;
+	int err;
+	
+	fci.n = n;
+	fci.count = 0;
+	
+	if(!n->n)
+		goto out;
 	
-	temporal_id = get_temporal_from_tl0d(mb);
+	now = tmr_jiffies();
+	if(now - rx->fb_start >= TL0_NACK_INTERVAL)
+	{
+		rx->fb_start = now;
+		rx->fb_fci = 0;
+	}
 	
-	if(temporal_id > 0)
+	fci.count = min(n->n, TL0_NACK_MAX_FCI - rx->fb_fci);
+	if(!fci.count)
+		goto out;
+	
+	mb = mbuf_alloc(16 + 4 * fci.count);
+	if(!mb)
 	{
-		uint8_t tl0;
-		uint16_t first_seq;
-		uint16_t last_seq;
-		struct TL0_info *inf;
+		fci.count = 0;
+		goto out;
+	}
+	
+	err = rtcp_encode(mb, RTCP_RTPFB, RTCP_RTPFB_GNACK,
+					  rtp_sess_ssrc(s->rtp), s->ssrc_rx, tl0_fci_encode, &fci);
+	if(!err)
+	{
+		mb->pos = 0;
+		err = rtcp_send(s->rtp, mb);
+	}
+	
+	if(err)
+		warning("tl0: sending NACK failed (%m)\n", err);
+	else
+	{
+		rx->fb_fci += fci.count;
+		rx->stats.n_nack_rtcp++;
+		rx->stats.n_nack_fci += fci.count;
+	}
+	
+	mem_deref(mb);
+	
+ out:
+	rx->stats.n_nack_capped += n->n - fci.count + n->dropped;
+	memset(n, 0, sizeof(*n));
+}
+
+/* retransmission timeout from the RTT reported by RTCP, [ms] */
+static uint64_t tl0_rto(struct stream *s)
+{
+	struct rtcp_stats stats;
+	uint64_t rto;
+	
+	memset(&stats, 0, sizeof(stats));
+	
+	if(rtcp_stats(s->rtp, s->ssrc_rx, &stats) || !stats.rtt)
+		return TL0_RTO_DEFAULT;
+	
+	//rtt is in [us], allow half an RTT of jitter on top
+	rto = stats.rtt * 3 / 2000;
+	
+	if(rto < TL0_RTO_MIN)
+		rto = TL0_RTO_MIN;
+	else if(rto > TL0_RTO_MAX)
+		rto = TL0_RTO_MAX;
+	
+	return rto;
+}
+
+static void tl0_nack_timeout(void *arg);
+
+/* makes sure the timer fires no later than due */
+static void tl0_timer_arm(struct stream *s, uint64_t due)
+{
+	struct tl0_rx *rx = s->tl0;
+	uint64_t now = tmr_jiffies();
+	uint64_t delay = due > now ? due - now : 0;
+	
+	if(tmr_isrunning(&rx->tmr) && tmr_get_expire(&rx->tmr) <= delay)
+		return;
+	
+	tmr_start(&rx->tmr, delay, tl0_nack_timeout, s);
+}
 
-		tl0 = get_tl0(mb);
-		first_seq = get_fseq_from_tl0d(mb);
-		last_seq = get_lseq_from_tl0d(mb);
+/*
+ * NACKs the gaps that appeared in an access unit since its last check.
+ * Only positions that became checkable are looked at, so a packet that
+ * does not extend the known range costs nothing here.
+ */
+static void tl0_nack_gaps(struct stream *s, struct TL0_info *inf)
+{
+	struct tl0_nack n;
+	uint32_t len, w;
+	bool sent = false;
+	
+	if(!inf->used || inf->tl0_completed || inf->gave_up)
+		return;
+	
+	len = calc_scanning_length(s->tl0, inf);
+	if(len <= inf->scanned)
+		return;
+	
+	memset(&n, 0, sizeof(n));
+	
+	for(w = inf->scanned >> 6; w * 64 < len; w++)
+	{
+		uint64_t fresh = ~inf->received[w] & ~inf->nacked[w] & map_range(w, inf->scanned, len);
 		
-		inf = tl0_find(tl0, first_seq, last_seq);
+		inf->nacked[w] |= fresh;
 		
-		if(temporal_id == 1)
+		for(; fresh; fresh &= fresh - 1)
 		{
-			if(hdr.m && (inf->enh_layers[1].nalu_size == inf->enh_layers[1].received_nalus))
-			{
-				inf->enh_layers[1].got_enh = true;
-					
-				return 0;
-			}
-			else if(hdr.m && (inf->enh_layers[1].nalu_size != inf->enh_layers[1].received_nalus))
-			{
-				inf->enh_layers[2].skip = true;
-				
-				return 1;
-			}
-			
-			if(!inf->enh_layers[0].got_enh && !inf->enh_layers[0].skip)
-			{
-				inf->enh_layers[0].skip = true;
-				return -1;
-			}	
-		}
-		else
-		{
-			uint8_t sequence_id;
-			
-			sequence_id = get_sequence_id(mb);
-			if(sequence_id)
-			{
-				if(hdr.m && (inf->enh_layers[2].nalu_size == inf->enh_layers[2].received_nalus))
-				{
-					if(inf->enh_layers[1].got_enh)
-					{
-						inf->enh_layers[2].got_enh = true;
-						return 0;
-					}
-					
-					inf->enh_layers[2].skip = true;
-					return 1;
-				}
-				else if(hdr.m && (inf->enh_layers[2].nalu_size != inf->enh_layers[2].received_nalus))
-				{
-					inf->enh_layers[2].skip = true;
-					return 1;
-				}
-				else
-				{
-					if(inf->enh_layers[1].got_enh)
-						return 0;
-					
-					inf->enh_layers[2].skip = true;
-					return 1;
-				}
-			}
-			else
-			{
-				if(hdr.m && (inf->enh_layers[0].nalu_size == inf->enh_layers[0].received_nalus))
-				{
-					inf->enh_layers[0].got_enh = true;
-					
-					return 0;
-				}
-				else if(hdr.m && (inf->enh_layers[0].nalu_size != inf->enh_layers[0].received_nalus))
-				{
-					inf->enh_layers[0].skip = true;
-					return 1;
-				}
-			}
+			tl0_nack_add(&n, inf->first_seq + w * 64 + __builtin_ctzll(fresh));
+			sent = true;
 		}
 	}
-	else
+	
+	inf->scanned = len;
+	
+	tl0_nack_flush(s, &n);
+	
+	if(sent && !inf->nack_due)
 	{
-		uint8_t tl0;
-		uint16_t first_seq;
-		uint16_t last_seq;
-		struct TL0_info *inf;
-		struct TL0_info *prev_inf;
+		inf->nack_due = tmr_jiffies() + tl0_rto(s);
+		tl0_timer_arm(s, inf->nack_due);
+	}
+}
 
-		tl0 = get_tl0(mb);
-		first_seq = get_fseq_from_tl0d(mb);
-		last_seq = get_lseq_from_tl0d(mb);
+/*
+ * Repeats the NACKs whose retransmission did not arrive in time, and gives
+ * up on access units that could no longer be played out
+ */
+static void tl0_nack_timeout(void *arg)
+{
+	struct stream *s = arg;
+	struct tl0_rx *rx = s->tl0;
+	struct tl0_nack n;
+	uint64_t now = tmr_jiffies();
+	uint64_t rto = tl0_rto(s);
+	uint64_t next = 0;
+	int k;
+	
+	memset(&n, 0, sizeof(n));
+	
+	for(k = TL0_RING_WINDOW - 1; k >= 0; k--)
+	{
+		struct TL0_info *inf = &rx->ring[(uint8_t)(rx->newest - k)];
+		uint32_t w;
 		
-		inf = tl0_find(tl0, first_seq, last_seq);
+		if(!inf->used || inf->tl0_completed || inf->gave_up || !inf->nack_due)
+			continue;
 		
-		if(inf->le.prev)
+		if(inf->nack_due <= now)
 		{
-			prev_inf = inf->le.prev->data;
-			
-			if(!prev_inf->enh_layers[2].got_enh && prev_inf->enh_layers[2].nalu_size != 0 && prev_inf->enh_layers[2].received_nalus != 0 && !prev_inf->enh_layers[2].skip)
-			{
-				prev_inf->enh_layers[2].skip = true;
-				return -1;
-			}
-			
-			if(!prev_inf->enh_layers[1].got_enh && prev_inf->enh_layers[1].nalu_size != 0 && prev_inf->enh_layers[1].received_nalus != 0 && !prev_inf->enh_layers[1].skip)
+			//a retransmission requested now arrives after one RTT at best
+			if(now + rto * 2 / 3 > inf->deadline)
 			{
-				prev_inf->enh_layers[1].skip = true;
-				return -1;
+				inf->gave_up = true;
+				inf->nack_due = 0;
+				rx->stats.n_au_gave_up++;
+				continue;
 			}
 			
-			if(!prev_inf->enh_layers[0].got_enh && prev_inf->enh_layers[0].nalu_size != 0 && prev_inf->enh_layers[0].received_nalus != 0 && !prev_inf->enh_layers[0].skip)
+			for(w = 0; w * 64 < inf->scanned; w++)
 			{
-				prev_inf->enh_layers[0].skip = true;
-				return -1;
+				uint64_t outstanding = ~inf->received[w] & inf->nacked[w] & map_range(w, 0, inf->scanned);
+				
+				for(; outstanding; outstanding &= outstanding - 1)
+					tl0_nack_add(&n, inf->first_seq + w * 64 + __builtin_ctzll(outstanding));
 			}
 			
-			return 0;			
+			inf->nack_due = now + rto;
 		}
+		
+		if(!next || inf->nack_due < next)
+			next = inf->nack_due;
 	}
 	
-	return 0;
+	tl0_nack_flush(s, &n);
+	
+	if(next)
+		tmr_start(&rx->tmr, next - now, tl0_nack_timeout, s);
 }
 
-void rtp_recv_tl0(const struct sa *src, const struct rtp_header *hdr,
-		     struct mbuf *mb, void *arg)
+static void tl0_dec_ctrl(struct tl0_rx *rx, enum tl0_dec_ctrl ctrl)
 {
-	struct stream *s = arg;
-	bool flush = false;
-	int err;
+	if(ctrl == TL0_DEC_RESYNC)
+		rx->stats.n_resync++;
+	
+	if(rx->ctrlh)
+		rx->ctrlh(ctrl, rx->ctrl_arg);
+}
 
-	if (!mbuf_get_left(mb))
-		return;
+/* passes a packet on to the decoder */
+static void tl0_handoff(struct stream *s, const struct rtp_header *hdr, struct mbuf *mb)
+{
+	s->tl0->stats.n_handoff++;
+	
+	s->rtph(hdr, mb, s->arg);
+}
 
-	if (!(sdp_media_ldir(s->sdp) & SDP_RECVONLY))
+/* position of an access unit within its TL0 group, in decode order */
+static uint8_t tl0_au_layer(uint8_t temporal_id, uint8_t sequence_id)
+{
+	if(temporal_id == 0)
+		return 0;
+	
+	if(temporal_id == 1)
+		return 2;
+	
+	return sequence_id ? 3 : 1;
+}
+
+/* true if the AU was already released or dropped */
+static bool tl0_au_behind(const struct tl0_rx *rx, uint8_t tl0, uint8_t layer)
+{
+	int8_t d = tl0 - rx->next_tl0;
+	
+	if(!rx->jb_started)
+		return false;
+	
+	return d < 0 || (d == 0 && layer < rx->next_layer);
+}
+
+static void tl0_au_put(struct tl0_rx *rx, struct TL0_info *inf, const struct tl0d_desc *d,
+					   const struct rtp_header *hdr, struct mbuf *mb)
+{
+	uint8_t layer = tl0_au_layer(d->tid, d->seq_id);
+	struct tl0_au *au = &inf->au[layer];
+	struct tl0_pkt *pkt;
+	struct le *le;
+	
+	if(!rx->jb_started)
+	{
+		rx->jb_started = true;
+		rx->next_tl0 = inf->TL0;
+		rx->next_layer = 0;
+	}
+	
+	if(au->dropped || tl0_au_behind(rx, inf->TL0, layer))
+	{
+		rx->stats.n_late++;
+		return;
+	}
+	
+	//packets mostly arrive in order, search from the tail
+	for(le = au->pktl.tail; le; le = le->prev)
+	{
+		const struct tl0_pkt *p = le->data;
+		int16_t d = hdr->seq - p->hdr.seq;
+		
+		if(d == 0)
+			return;
+		
+		if(d > 0)
+			break;
+	}
+	
+	pkt = mem_zalloc(sizeof(*pkt), tl0_pkt_destructor);
+	if(!pkt)
 		return;
+	
+	pkt->hdr = *hdr;
+	pkt->mb = mem_ref(mb);
+	
+	if(le)
+		list_insert_after(&au->pktl, le, &pkt->le, pkt);
+	else
+		list_prepend(&au->pktl, &pkt->le, pkt);
+	
+	if(!au->count)
+		au->created = tmr_jiffies();
+	
+	au->count++;
+	au->marker |= hdr->m;
+	au->expected = d->n_enh;
+}
 
-	metric_add_packet(&s->metric_rx, mbuf_get_left(mb));
+static bool tl0_au_complete(const struct TL0_info *inf, uint8_t layer)
+{
+	const struct tl0_au *au = &inf->au[layer];
+	
+	if(layer == 0)
+		return inf->tl0_completed;
+	
+	//the sender refuses enhancement AUs that NUM_ENH_NALUS cannot count
+	return au->marker && au->count == au->expected;
+}
 
-	if (hdr->ssrc != s->ssrc_rx) {
-		if (s->ssrc_rx) {
-			flush = true;
-			info("stream: %s: SSRC changed %x -> %x"
-			     " (%u bytes from %J)\n",
-			     sdp_media_name(s->sdp), s->ssrc_rx, hdr->ssrc,
-			     mbuf_get_left(mb), src);
-		}
-		s->ssrc_rx = hdr->ssrc;
+/* the second TID2 AU references the TID1 AU, all others only the TL0 AU */
+static bool tl0_au_ref_lost(const struct TL0_info *inf, uint8_t layer)
+{
+	return layer == 3 && inf->au[2].dropped;
+}
+
+static void tl0_au_release(struct stream *s, struct tl0_au *au)
+{
+	struct le *le;
+	
+	for(le = au->pktl.head; le; le = le->next)
+	{
+		struct tl0_pkt *pkt = le->data;
+		
+		tl0_handoff(s, &pkt->hdr, pkt->mb);
 	}
+	
+	list_flush(&au->pktl);
+}
 
-	if(isVideo(s))
+static void tl0_au_drop(struct tl0_rx *rx, struct tl0_au *au)
+{
+	if(au->count)
+	{
+		rx->stats.n_au_dropped++;
+		tl0_dec_ctrl(rx, TL0_DEC_DISCARD);
+	}
+	
+	list_flush(&au->pktl);
+	au->dropped = true;
+}
+
+static void tl0_cursor_next(struct tl0_rx *rx)
+{
+	if(++rx->next_layer == TL0_AU_LAYERS)
 	{
-		uint8_t tl0;
-		uint16_t first_seq;
-		uint16_t last_seq;
-		uint8_t temporal_id;
-		struct TL0_info *inf;
+		rx->next_layer = 0;
+		rx->next_tl0++;
+	}
+}
+
+/* true if an AU after the cursor has arrived, or is complete */
+static bool tl0_later_au(const struct tl0_rx *rx, const struct TL0_info *inf, bool complete)
+{
+	const struct TL0_info *next = &rx->ring[(uint8_t)(rx->next_tl0 + 1)];
+	uint8_t l;
+	
+	for(l = rx->next_layer + 1; l < TL0_AU_LAYERS; l++)
+	{
+		if(complete ? tl0_au_complete(inf, l) : inf->au[l].count > 0)
+			return true;
+	}
+	
+	if(complete)
+		return next->used && next->tl0_completed;
+	
+	return (int8_t)(rx->newest - rx->next_tl0) > 0;
+}
+
+static void tl0_request_fir(struct stream *s)
+{
+	if(s->requested_fir)
+		return;
+	
+	stream_send_fir(s, true);
+	s->requested_fir = true;
+	
+	tl0_dec_ctrl(s->tl0, TL0_DEC_RESYNC);
+}
+
+static void tl0_jb_timeout(void *arg);
+
+/*
+ * Releases access units to the decoder in decode order. A TL0 AU is
+ * waited for until its playout deadline, retransmissions can still
+ * complete it until then. An enhancement AU is dropped as soon as it
+ * would hold back a complete AU after it, so it never stalls the base
+ * layer.
+ */
+static void tl0_jb_release(struct stream *s)
+{
+	struct tl0_rx *rx = s->tl0;
+	uint64_t now = tmr_jiffies();
+	uint64_t wait = 0;
+	
+	while(rx->jb_started && !s->requested_fir)
+	{
+		struct TL0_info *inf = &rx->ring[rx->next_tl0];
+		struct tl0_au *au;
 		
-		tl0 = get_tl0(mb);
+		if((int8_t)(rx->newest - rx->next_tl0) < 0)
+			break;
 		
-		if(s->requested_fir && tl0 != 0)
+		if(!inf->used)
 		{
-			list_flush(&tl0l);
-			jbuf_flush(s->jbuf);
+			const struct TL0_info *later = NULL;
+			uint8_t k;
 			
-			if(packet_count == MAX_PACKET_TOLERANCE)
+			//nothing of this group arrived, it is lost once a later group is due
+			for(k = rx->next_tl0 + 1; k != (uint8_t)(rx->newest + 1) && !later; k++)
 			{
-				stream_send_fir(s, true);
-				packet_count = 0;
-				
-				return;
+				if(rx->ring[k].used)
+					later = &rx->ring[k];
 			}
+			
+			if(!later)
+				break;
+			
+			if(now >= later->deadline)
+				tl0_request_fir(s);
 			else
+				wait = later->deadline;
+			
+			break;
+		}
+		
+		au = &inf->au[rx->next_layer];
+		
+		if(rx->next_layer == 0)
+		{
+			if(tl0_au_complete(inf, 0))
 			{
-				packet_count++;
-				
-				return;
+				tl0_au_release(s, au);
+				tl0_cursor_next(rx);
+				continue;
 			}
+			
+			if(inf->gave_up || now >= inf->deadline)
+			{
+				tl0_au_drop(rx, au);
+				tl0_request_fir(s);
+				break;
+			}
+			
+			wait = inf->deadline;
+			break;
 		}
-		else if(s->requested_fir && tl0 == 0)
+		
+		if(au->dropped || tl0_au_ref_lost(inf, rx->next_layer))
 		{
-			list_flush(&tl0l);
-			jbuf_flush(s->jbuf);
-			s->requested_fir = false;
-			packet_count = 0;
+			tl0_au_drop(rx, au);
+			tl0_cursor_next(rx);
+			continue;
 		}
 		
-		//Get the first sequence number for the TL0 AU
-		first_seq = get_fseq_from_tl0d(mb);
-		
-		//Get the last sequence number for the TL0 AU
-		last_seq = get_lseq_from_tl0d(mb);
-		
-		//Get Temporal ID from TL0D
-		temporal_id = get_temporal_from_tl0d(mb);
-		
-		//Find TL0_info from tl0l list
-		inf = tl0_find(tl0, first_seq, last_seq);
+		if(tl0_au_complete(inf, rx->next_layer))
+		{
+			tl0_au_release(s, au);
+			tl0_cursor_next(rx);
+			continue;
+		}
 		
-		if(!inf)
+		if(!au->count)
 		{
-			err = init_tl0(&inf, tl0, first_seq, last_seq);
-				
-			if(err)
-			{
-				//TODO Error handling
-				re_printf("RECEIVER: Error init_tl0()\n");
-				return;
-			}
+			//never arrived or not sent in this stream, AUs referencing it are dropped
+			if(!tl0_later_au(rx, inf, false))
+				break;
 			
-			list_append(&tl0l, &inf->le, inf);
+			au->dropped = true;
+			tl0_cursor_next(rx);
+			continue;
 		}
 		
-		if(temporal_id > 0)
+		if(tl0_later_au(rx, inf, true) || now >= au->created + TL0_ENH_WAIT)
 		{
-			uint8_t nalu_size;
-			
-			inf->has_enhancement = true;
-			
-			nalu_size = get_num_of_nalus(mb);
+			tl0_au_drop(rx, au);
+			tl0_cursor_next(rx);
+			continue;
+		}
+		
+		wait = au->created + TL0_ENH_WAIT;
+		break;
+	}
+	
+	if(wait)
+		tmr_start(&rx->jb_tmr, wait > now ? wait - now : 0, tl0_jb_timeout, s);
+	else
+		tmr_cancel(&rx->jb_tmr);
+}
+
+static void tl0_jb_timeout(void *arg)
+{
+	tl0_jb_release(arg);
+}
+
+/* base layer tracking, NACKs and decoder hand-off of one video packet */
+static void tl0_recv_video(struct stream *s, const struct sa *src, const struct rtp_header *hdr,
+						   struct mbuf *mb, bool flush)
+{
+	struct tl0d_desc d;
+	uint8_t newest;
+	struct TL0_info *inf;
+	struct tl0_rx *rx = s->tl0;
+	int err;
+	
+	(void)src;
+	
+	if(flush)
+	{
+		tl0_rx_flush(rx);
+		tl0_dec_ctrl(rx, TL0_DEC_RESYNC);
+	}
+	
+	err = tl0d_parse(&d, mb);
+	if(err)
+	{
+		rx->stats.n_malformed++;
+		return;
+	}
+	
+	if(s->requested_fir && d.tl0 != 0)
+	{
+		tl0_rx_flush(rx);
+		
+		if(rx->packet_count == MAX_PACKET_TOLERANCE)
+		{
+			stream_send_fir(s, true);
+			rx->packet_count = 0;
 			
-			if(temporal_id == 1)
-			{
-				inf->enh_layers[1].nalu_size = nalu_size;
-				inf->enh_layers[1].received_nalus++;
-			}
-			else
-			{
-				uint8_t sequence_id;
-				
-				sequence_id = get_sequence_id(mb);
-				
-				if(sequence_id)
-				{
-					if(inf->enh_layers[2].skip)
-						return;
-						
-					inf->enh_layers[2].nalu_size = nalu_size;
-					inf->enh_layers[2].received_nalus++;
-				}
-				else
-				{
-					if(inf->enh_layers[0].skip)
-						return;
-						
-					inf->enh_layers[0].nalu_size = nalu_size;
-					inf->enh_layers[0].received_nalus++;
-				}
-			}
+			return;
 		}
 		else
 		{
-			if(check_if_already(inf, hdr->seq))
-			{
-				struct rtp_header hdr2;
-				void *mb2 = NULL;
-				int ret = 0;
-			
-				err = request_missing_tl0_packets(s);
-				if(err)
-				{
-					//TODO error handling
-					re_printf("Error: request_missing_tl0_packets\n");
-					return;
-				}
-				
-				if (jbuf_get(s->jbuf, &hdr2, &mb2))
-				{
-
-					if (!s->jbuf_started)
-						return;
-
-					memset(&hdr2, 0, sizeof(hdr2));
-				}
-				else
-				{
-					s->jbuf_started = true;
-					
-					if( (ret = send_nalu_to_decoder(mb2, hdr2)) == 1)
-					{
-						hdr2.cc = 1;
-						s->rtph(&hdr2, mb2, s->arg);
-						
-						mem_deref(mb2);
-						
-						return;
-					}
-					else if(ret == -1)
-					{
-						
-						hdr2.cc = 1;
-						s->rtph(&hdr2, mb2, s->arg);
-						
-						hdr2.cc = 0;
-						s->rtph(&hdr2, mb2, s->arg);
-						
-						mem_deref(mb2);
-						
-						return;
-					}
-				}
-				
-				s->jbuf_started = true;
-					
-				s->rtph(&hdr2, mb2, s->arg);
-
-				mem_deref(mb2);	
-				
-				return;
-			}
+			rx->packet_count++;
 			
-			if(!inf->tl0_completed)
-			{
-				err = update_tl0(inf, hdr->seq);
-				if(err)
-				{
-					//TODO error handling
-					re_printf("Error: update_tl0\n");
-					return;
-				}
-			}
+			return;
 		}
-		
-		err = request_missing_tl0_packets(s);
+	}
+	else if(s->requested_fir && d.tl0 == 0)
+	{
+		tl0_rx_flush(rx);
+		s->requested_fir = false;
+		rx->packet_count = 0;
+	}
+	
+	//the stream may start anywhere, a FIR answer at 0; the head is placed by the first packet
+	if(!rx->seeded)
+	{
+		rx->newest = d.tl0;
+		rx->next_tl0 = d.tl0;
+		rx->next_layer = 0;
+		rx->seeded = true;
+	}
+	
+	newest = rx->newest;
+	
+	//Find TL0_info in the TL0PICIDX ring
+	inf = tl0_find(rx, d.tl0, d.fsn, d.lsn);
+	
+	if(!inf)
+	{
+		err = init_tl0(rx, &inf, d.tl0, d.fsn, d.lsn);
+			
 		if(err)
 		{
-			//TODO error handling
-			re_printf("Error: request_missing_tl0_packets\n");
+			//TODO Error handling
+			re_printf("RECEIVER: Error init_tl0()\n");
 			return;
 		}
+	}
+	
+	if(d.tid > 0)
+	{
+		inf->has_enhancement = true;
 		
-		if (s->jbuf)
+		tl0_au_put(rx, inf, &d, hdr, mb);
+	}
+	else
+	{
+		if(check_if_already(inf, hdr->seq))
+			return;
+		
+		if(!inf->tl0_completed)
 		{
-			struct rtp_header hdr2;
-			void *mb2 = NULL;
-			int ret = 0;
-
-			/* Put frame in Jitter Buffer */
-			if (flush)
-				jbuf_flush(s->jbuf);
-			
-			err = jbuf_put(s->jbuf, hdr, mb);
-			if (err)
+			err = update_tl0(rx, inf, hdr->seq);
+			if(err)
 			{
-				warning("%s: dropping %u bytes from %J (%m)\n",
-					 sdp_media_name(s->sdp), mb->end,
-					 src, err);
-				s->metric_rx.n_err++;
+				//TODO error handling
+				re_printf("Error: update_tl0\n");
+				return;
 			}
+		}
+		
+		tl0_au_put(rx, inf, &d, hdr, mb);
+	}
+	
+	//a new AU makes the tail of the previous one checkable
+	tl0_nack_gaps(s, inf);
+	if(newest != rx->newest)
+		tl0_nack_gaps(s, &rx->ring[newest]);
+	
+	tl0_jb_release(s);
+}
 
-			if (jbuf_get(s->jbuf, &hdr2, &mb2))
-			{
+//the stream owns its state, created with the first video packet
+static int tl0_rx_get(struct stream *s)
+{
+	if(s->tl0)
+		return 0;
+	
+	return tl0_rx_alloc(&s->tl0);
+}
 
-				if (!s->jbuf_started)
-					return;
+/*
+ * Registers the handler that resets the decoder when the receiver drops
+ * access units, may be called before the first packet arrives
+ */
+int tl0_set_dec_ctrl(struct stream *s, tl0_dec_ctrl_h *ctrlh, void *arg)
+{
+	int err;
+	
+	if(!s)
+		return EINVAL;
+	
+	err = tl0_rx_get(s);
+	if(err)
+		return err;
+	
+	s->tl0->ctrlh = ctrlh;
+	s->tl0->ctrl_arg = arg;
+	
+	return 0;
+}
 
-				memset(&hdr2, 0, sizeof(hdr2));
-			}
-			else
-			{
-				s->jbuf_started = true;
-				
-				if( (ret = send_nalu_to_decoder(mb2, hdr2)) == 1)
-				{
-					hdr2.cc = 1;
-					s->rtph(&hdr2, mb2, s->arg);
-					
-					mem_deref(mb2);
-					
-					return;
-				}
-				else if(ret == -1)
-				{
-					
-					hdr2.cc = 1;
-					s->rtph(&hdr2, mb2, s->arg);
-					
-					hdr2.cc = 0;
-					s->rtph(&hdr2, mb2, s->arg);
-					
-					mem_deref(mb2);
-					
-					return;
-				}
-			}
-			
-			s->jbuf_started = true;
-				
-			s->rtph(&hdr2, mb2, s->arg);
+void rtp_recv_tl0(const struct sa *src, const struct rtp_header *hdr,
+		     struct mbuf *mb, void *arg)
+{
+	struct stream *s = arg;
+	bool flush = false;
+	int err;
+
+	if (!mbuf_get_left(mb))
+		return;
+
+	if (!(sdp_media_ldir(s->sdp) & SDP_RECVONLY))
+		return;
 
-			mem_deref(mb2);	
+	metric_add_packet(&s->metric_rx, mbuf_get_left(mb));
+
+	if (hdr->ssrc != s->ssrc_rx) {
+		if (s->ssrc_rx) {
+			flush = true;
+			info("stream: %s: SSRC changed %x -> %x"
+			     " (%u bytes from %J)\n",
+			     sdp_media_name(s->sdp), s->ssrc_rx, hdr->ssrc,
+			     mbuf_get_left(mb), src);
 		}
-		else
+		s->ssrc_rx = hdr->ssrc;
+	}
+
+	if(isVideo(s))
+	{
+		uint64_t t;
+		
+		err = tl0_rx_get(s);
+		if(err)
 		{
-			s->rtph(hdr, mb, s->arg);
+			warning("tl0: could not allocate receiver state (%m)\n", err);
+			return;
 		}
+		
+		t = tl0_now_ns();
+		
+		tl0_recv_video(s, src, hdr, mb, flush);
+		
+		s->tl0->stats.n_pkt++;
+		s->tl0->stats.ns_sum += tl0_now_ns() - t;
 	}
 	else
 	{